@@ -0,0 +1,105 @@
+/*
+ * bodystore.c - content-addressed, reference counted storage for cached bytes
+ *
+ * Different URLs often come back with byte-identical bodies (mirrors, query
+ * string variants of the same asset), so the cache keeps one copy of each
+ * distinct body, found by hash, and every entry holding it is a link. A
+ * body's bytes count against the cache once, while it has at least one link.
+ *
+ * Readers take a ref with body_hold so they can write a body out after
+ * dropping the cache lock; an entry evicted meanwhile only drops its link and
+ * the bytes go away with the last ref.
+ */
+#include "bodystore.h"
+
+#define FNV64_OFFSET 14695981039346656037ull
+#define FNV64_PRIME 1099511628211ull
+
+static uint64_t hash_bytes(const void *buf, size_t len) {
+   const unsigned char *p = buf;
+   uint64_t h = FNV64_OFFSET;
+   for (size_t i = 0; i < len; i++) {
+      h ^= p[i];
+      h *= FNV64_PRIME;
+   }
+   return h;
+}
+
+void bodystore_init(BodyStore *bs) {
+   memset(bs->buckets, 0, sizeof(bs->buckets));
+   bs->count = 0;
+   bs->shared = 0;
+   pthread_mutex_init(&bs->mutex, NULL);
+}
+
+/* Unhooks and frees b once nothing refers to it. Caller holds the mutex. */
+static void body_free(BodyStore *bs, Body *b) {
+   Body **bp = &bs->buckets[b->hash % BODY_BUCKETS];
+   while (*bp != b) {
+      bp = &(*bp)->next;
+   }
+   *bp = b->next;
+   bs->count--;
+   free(b);
+}
+
+/*
+ * body_link - returns the stored body with these bytes, copying them in if
+ * there isn't one yet, with a link taken for a new cache entry. *added is
+ * size if the bytes weren't already counted against the cache, else 0.
+ */
+Body *body_link(BodyStore *bs, void *data, size_t size, size_t *added) {
+   uint64_t h = hash_bytes(data, size);
+   
+   pthread_mutex_lock(&bs->mutex);
+   Body *b = bs->buckets[h % BODY_BUCKETS];
+   while (b != NULL && (b->hash != h || b->size != size || memcmp(b->data, data, size) != 0)) {
+      b = b->next;
+   }
+   if (b == NULL) {
+      b = Malloc(sizeof(Body) + size);
+      b->hash = h;
+      b->size = size;
+      b->links = b->refs = 0;
+      memcpy(b->data, data, size);
+      b->next = bs->buckets[h % BODY_BUCKETS];
+      bs->buckets[h % BODY_BUCKETS] = b;
+      bs->count++;
+   }
+   else if (b->links > 0) {
+      bs->shared++;
+   }
+   *added = b->links == 0 ? size : 0; //a body only readers still held costs again once relinked
+   b->links++;
+   b->refs++;
+   pthread_mutex_unlock(&bs->mutex);
+   return b;
+}
+
+/* Drops a cache entry's link, returns the bytes the cache no longer pays for */
+size_t body_unlink(BodyStore *bs, Body *b) {
+   size_t freed;
+   
+   pthread_mutex_lock(&bs->mutex);
+   freed = --b->links == 0 ? b->size : 0;
+   if (--b->refs == 0) {
+      body_free(bs, b);
+   }
+   pthread_mutex_unlock(&bs->mutex);
+   return freed;
+}
+
+/* Keeps b alive for a reader until the matching body_release */
+void body_hold(BodyStore *bs, Body *b) {
+   pthread_mutex_lock(&bs->mutex);
+   b->refs++;
+   pthread_mutex_unlock(&bs->mutex);
+}
+
+void body_release(BodyStore *bs, Body *b) {
+   pthread_mutex_lock(&bs->mutex);
+   if (--b->refs == 0) {
+      body_free(bs, b);
+   }
+   pthread_mutex_unlock(&bs->mutex);
+}
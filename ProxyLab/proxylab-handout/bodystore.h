@@ -0,0 +1,36 @@
+/*
+ * bodystore.h - content-addressed, reference counted storage for cached bytes
+ */
+#ifndef __BODYSTORE_H__
+#define __BODYSTORE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include "csapp.h"
+
+#define BODY_BUCKETS 1024 //buckets in the content hash table
+
+typedef struct Body Body;
+struct Body {
+   uint64_t hash; //FNV-1a of data
+   size_t size; //bytes in data
+   int links; //cache entries pointing at it, its bytes count against the cache while > 0
+   int refs; //links plus readers serving it, freed when this drops to 0
+   Body *next; //next body in the same bucket
+   char data[]; //the bytes themselves
+};
+
+typedef struct {
+   Body *buckets[BODY_BUCKETS]; //every live body by hash
+   size_t count; //live bodies
+   size_t shared; //links that found their bytes already stored
+   pthread_mutex_t mutex; //protects the table and every count
+} BodyStore;
+
+void bodystore_init(BodyStore *bs);
+Body *body_link(BodyStore *bs, void *data, size_t size, size_t *added); //*added is the bytes it now costs
+size_t body_unlink(BodyStore *bs, Body *b); //bytes it stopped costing
+void body_hold(BodyStore *bs, Body *b);
+void body_release(BodyStore *bs, Body *b);
+
+#endif /* __BODYSTORE_H__ */
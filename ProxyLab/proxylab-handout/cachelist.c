@@ -0,0 +1,230 @@
+/*
+ * cachelist.c - the memory cache: an LRU list of responses over a body store
+ *
+ * Lives apart from proxy.c so cachesim can replay traces against exactly
+ * the code the proxy runs. Nothing here locks; the proxy holds its cache
+ * rwlock around every call.
+ */
+#include <assert.h>
+#include "cachelist.h"
+
+/* An empty list that may hold capacity bytes, objects up to max_object each */
+void cache_init(CacheList *list, size_t capacity, size_t max_object) {
+   list->size = 0;
+   list->capacity = capacity;
+   list->max_object = max_object;
+   list->evicting = NULL;
+   list->arg = NULL;
+   list->first = NULL;
+   list->last = NULL;
+   bodystore_init(&list->bodies);
+}
+
+/* Caches the response in item under URL. raw_size is nonzero if
+ compress_response gzipped its body. The bytes are copied into the body
+ store so item is always freed here. */
+void cache_URL(char *URL, void *item, size_t size, size_t raw_size, time_t stored, CacheList *list) {
+   Freshness f;
+   size_t head_added, body_added;
+   
+   if (size > list->max_object) {
+      free(item);
+      return; //can't hold something this big in the cache
+   }
+   
+   int head_len = freshness_parse(item, size, &f); //split off the headers so the body can be shared
+   if (head_len < 0) {
+      head_len = 0;
+   }
+   CachedItem *cached_item = (CachedItem*) Malloc(sizeof(struct CachedItem)); //make room for a new item
+   cached_item->head = body_link(&list->bodies, item, head_len, &head_added);
+   cached_item->body = body_link(&list->bodies, (char *) item + head_len, size - head_len, &body_added);
+   free(item);
+   
+   /* check to see if there is space in the cache if there isn't any
+    start evicting till there is space for the new thing. The links above
+    keep a body we share with an evicted item from going anywhere */
+   while (list->first != NULL && (list->size + head_added + body_added) > list->capacity) {
+      if (list->evicting != NULL) { //give the disk tier a chance to keep it
+         list->evicting(list->last, list->arg);
+      }
+      evict(list);
+   }
+   list->size += head_added + body_added; //only bytes that weren't already cached count
+   
+   strcpy(cached_item->url, URL); //copy URL into the cached_item's url
+   cached_item->raw_size = raw_size;
+   cached_item->size = raw_size ? head_len + raw_size : size; //store size of item
+   cached_item->prev = NULL; //Malloc doesn't zero, a lone item needs real NULLs
+   cached_item->next = NULL;
+   set_freshness(cached_item, stored, NULL); //work out how long it stays fresh from its headers
+   
+   
+   /* If the list is empty store first and last item as item just added */
+   if (list->first == NULL) {
+      list->first = cached_item;
+      list->last = cached_item;
+   }
+   
+   else { //the list isn't empty so put at the front
+      list->first->prev = cached_item;
+      cached_item->next = list->first;
+      cached_item->prev = NULL;
+      list->first = cached_item;
+   }
+   
+   return;
+}
+
+/* Works out expires/stale_until and the validators from the item's own
+ response headers. If override has an explicit lifetime (the headers of a
+ 304 that refreshed the item) that lifetime wins. */
+void set_freshness(CachedItem *item, time_t stored, Freshness *override) {
+   Freshness f;
+   long lifetime;
+   
+   freshness_parse(item->head->data, item->head->size, &f);
+   if (override != NULL && (override->max_age >= 0 || override->expires != 0)) {
+      lifetime = freshness_lifetime(override, stored);
+   }
+   else {
+      lifetime = freshness_lifetime(&f, stored);
+   }
+   
+   item->stored = stored;
+   item->expires = f.no_cache ? stored : stored + lifetime; //no-cache means ask every time
+   item->stale_until = f.no_cache || f.must_revalidate ? item->expires : item->expires + f.swr;
+   item->revalidating = 0;
+   strcpy(item->etag, f.etag);
+   strcpy(item->last_modified, f.last_modified_str);
+}
+
+void evict(CacheList *list) { //evicts based off of a LRU policy
+   assert(list->first != NULL); //should be so we can get rid of stuff
+   assert(list->last != NULL); //same check that the list isn't empty
+   
+   if (list->last == list->first) { //there is only one thing in the list
+      cache_unlink(list->last, list);
+      free(list->last);
+      list->last = NULL;
+      list->first = NULL;
+      return;
+   }
+   
+   //move new list around
+   list->last = list->last->prev;
+   cache_unlink(list->last->next, list);
+   free(list->last->next);
+   list->last->next = NULL;
+   return;
+}
+
+/* Drops an item's hold on its head and body and takes whatever that frees
+ off the cache size. Readers still serving them keep them alive. */
+void cache_unlink(CachedItem *item, CacheList *list) {
+   if (item->head != NULL) {
+      list->size -= body_unlink(&list->bodies, item->head);
+      list->size -= body_unlink(&list->bodies, item->body);
+      item->head = item->body = NULL;
+   }
+}
+
+/* A Malloc'd copy of the whole response as the server sent it, item->size
+ bytes, for everything that wants it in one piece (the disk tier,
+ revalidation). Caller holds the cache lock. */
+char *item_copy(CachedItem *item) {
+   char *copy = Malloc(item->size ? item->size : 1);
+   memcpy(copy, item->head->data, item->head->size);
+   if (item->raw_size == 0) {
+      memcpy(copy + item->head->size, item->body->data, item->body->size);
+   }
+   else if (gzip_decode(item->body->data, item->body->size, copy + item->head->size, item->raw_size) < 0) {
+      app_error("gzip_decode failed on a cached body"); //we made it, so this is memory corruption
+   }
+   return copy;
+}
+
+CachedItem *find(char *URL, CacheList *list) {
+   
+   if (list->first != NULL) { //contains something
+      if (strcmp(list->first->url, URL) == 0){
+         return list->first;
+      }
+      //Check if the last item in list is it
+      if (strcmp(list->last->url, URL) == 0){
+         return list->last;
+      }
+      
+      CachedItem *temp = list->first;
+      while (temp->next != NULL){ //Iterate through list till item is found
+         if (strcmp(temp->url, URL) != 0){
+            temp = temp->next;
+         }
+         else{
+            return temp;
+         }
+      }
+   }
+   return NULL; //list was empty
+}
+
+void cache_remove(char *URL, CacheList *list) {
+   CachedItem *item = find(URL, list);
+   
+   if (item == NULL) { //nothing to remove
+      return;
+   }
+   
+   if (item->prev != NULL) {
+      item->prev->next = item->next;
+   }
+   else {
+      list->first = item->next;
+   }
+   if (item->next != NULL) {
+      item->next->prev = item->prev;
+   }
+   else {
+      list->last = item->prev;
+   }
+   cache_unlink(item, list);
+   free(item);
+}
+
+void move_to_front(char *URL, CacheList *list){
+   CachedItem *item = find(URL, list);
+   
+   if (item == NULL) { //didn't find the item
+      return;
+   }
+   
+   if (item == list->first) { //item is already at the front
+      return;
+   }
+   
+   if (item == list->last) { //item is a the end move to front
+      list->last = item->prev;
+      list->first->prev = item;
+      item->next = list->first;
+      item->prev = NULL;
+      list->last->next = NULL;
+      list->first = item;
+      return;
+   }
+   else { //item is in the middle move to front and fix pointers
+      item->prev->next = item->next;
+      item->next->prev = item->prev;
+      item->prev = NULL;
+      item->next = list->first;
+      list->first->prev = item;
+      list->first = item;
+      return;
+   }
+   
+}
+
+void cache_destruct(CacheList *list){
+   while (list->first != NULL) { //keep evicting all of the items out to clean cache
+      evict(list);
+   }
+}
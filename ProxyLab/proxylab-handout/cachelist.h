@@ -0,0 +1,57 @@
+/*
+ * cachelist.h - the memory cache: an LRU list of responses over a body store
+ */
+#ifndef __CACHELIST_H__
+#define __CACHELIST_H__
+
+#include "csapp.h"
+#include "freshness.h"
+#include "bodystore.h"
+#include "encoding.h"
+
+/* Recommended max cache and object sizes */
+#define MAX_CACHE_SIZE 1049000
+#define MAX_OBJECT_SIZE 102400
+
+typedef struct CachedItem CachedItem;
+struct CachedItem {
+   char url[MAXLINE]; //holds the cached URL
+   Body *head; //status line and headers of the cached response
+   Body *body; //the rest of it, shared with every other entry whose body is byte-identical
+   size_t raw_size; //size of the body before it was gzipped, 0 if it's stored as the server sent it
+   size_t size; //size of the item, head and body together, before any gzip
+   time_t stored; //when the item came back from the server
+   time_t expires; //item is fresh until this time
+   time_t stale_until; //item may be served stale while it is revalidated until this time
+   int revalidating; //a background revalidation is already queued for this item
+   char etag[VALIDATOR_LEN]; //ETag to send back in If-None-Match, empty if none
+   char last_modified[VALIDATOR_LEN]; //Last-Modified to send back in If-Modified-Since, empty if none
+   CachedItem *prev; //pointer to previous item
+   CachedItem *next; //pointer to next item
+};
+
+typedef void cache_evict_fn(CachedItem *item, void *arg);
+
+typedef struct {
+   size_t size; //size of the entire Cache, a body shared by several items counts once
+   size_t capacity; //most bytes it may hold, MAX_CACHE_SIZE in the proxy
+   size_t max_object; //biggest response it will take, MAX_OBJECT_SIZE in the proxy
+   CachedItem *first; //pointer to the first item most used
+   CachedItem *last; //pointer to the last item and least used
+   BodyStore bodies; //where the items' heads and bodies actually live
+   cache_evict_fn *evicting; //called with each item just before it is evicted, NULL for nobody
+   void *arg; //passed to evicting
+} CacheList;
+
+void cache_init(CacheList *list, size_t capacity, size_t max_object);
+void cache_URL(char *URL, void *item, size_t size, size_t raw_size, time_t stored, CacheList *list);
+void cache_remove(char *URL, CacheList *list);
+void cache_unlink(CachedItem *item, CacheList *list);
+char *item_copy(CachedItem *item);
+void set_freshness(CachedItem *item, time_t stored, Freshness *override);
+void evict(CacheList *list);
+CachedItem *find(char *URL, CacheList *list);
+void move_to_front(char *URL, CacheList *list);
+void cache_destruct(CacheList *list);
+
+#endif /* __CACHELIST_H__ */
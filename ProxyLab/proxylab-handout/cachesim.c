@@ -0,0 +1,717 @@
+/*
+ * cachesim.c - replays an access trace against the cache, offline
+ *
+ * Choosing MAX_CACHE_SIZE or MAX_OBJECT_SIZE, or trying another eviction
+ * policy, shouldn't need real traffic. This reads a trace and replays it
+ * at several cache sizes against the CacheList code the proxy runs and a
+ * few other policies. For each one it prints the hit ratio, the byte hit
+ * ratio and requests per second. A trace can be lines of "url [bytes]",
+ * the proxy's own log.txt, or a synthetic Zipf workload. Everything is
+ * seeded, so the same arguments always give the same ratios.
+ *
+ * It also works out the LRU miss ratio curve in one pass with SHARDS
+ * (Waldspurger et al., FAST '15). Only keys that hash below a threshold
+ * are sampled, so every reference to a sampled object is seen. Their reuse
+ * distances, scaled up by the sampling rate, give the miss ratio at every
+ * cache size at once. A cache only a few hundred objects big needs a rate
+ * near the default 0.1 for that to be close; -r 1 gives exact LRU.
+ *
+ * The log doesn't say how big responses were, and neither need a trace
+ * file, so an object without a size gets one drawn from the synthetic
+ * distribution. A hash of its URL picks it, so the same URL always gets
+ * the same size.
+ *
+ * usage: ./cachesim [-f trace | -l log.txt | -z alpha] [-n requests] [-u objects]
+ *                   [-c bytes,bytes,...] [-o max_object] [-p policy,...] [-r rate] [-s seed]
+ */
+#include <math.h>
+#include <getopt.h>
+#include "cachelist.h"
+
+#define SIM_SIZES 16 //most cache sizes one run compares
+#define SIZE_MEDIAN 6000.0 //synthetic response sizes are lognormal around this many bytes
+#define SIZE_SIGMA 1.4 //and spread this wide, so a few percent are over MAX_OBJECT_SIZE
+#define SIZE_MIN 200 //room for the headers cachelist's responses carry
+#define SIZE_MAX_BYTES (4 << 20)
+#define SHARDS_MODULUS (1 << 24) //a key is sampled if its hash mod this is under rate times it
+
+/* The requests to replay, each naming one of the trace's objects */
+typedef struct {
+   char **keys; //each object's URL
+   size_t *sizes; //each object's response, headers and body
+   size_t objects;
+   size_t objects_max; //room in keys and sizes
+   uint32_t *refs; //the object each request asked for, in order
+   size_t count; //requests
+   size_t count_max; //room in refs
+   uint32_t *index; //open addressed, object number plus one by key hash
+   size_t index_mask;
+   unsigned long long bytes; //requested over the whole trace
+} Trace;
+
+/* One replay of a trace under one policy at one cache size */
+typedef struct Sim Sim;
+typedef int policy_fn(Sim *s, uint32_t obj); //1 for a hit, a miss caches obj if the policy takes it
+
+struct Sim {
+   Trace *t;
+   size_t capacity; //bytes the cache may hold
+   size_t max_object; //biggest response it takes
+   size_t used; //bytes it holds
+   unsigned char *cached; //whether each object is in the cache
+   unsigned char *referenced; //clock's second chance bit
+   int32_t *prev; //list neighbours by object number, -1 for none
+   int32_t *next;
+   int32_t head; //most recently inserted or used
+   int32_t tail; //next to go
+   uint32_t *freq; //gdsf, hits since the object was cached
+   double *priority; //gdsf, the lowest goes first
+   uint32_t *heap; //gdsf, objects ordered by priority
+   uint32_t *heap_pos; //where each object sits in heap
+   size_t heap_count;
+   double inflation; //gdsf, priority of the last object evicted
+   CacheList list; //the proxy's own cache, for the cachelist policy
+};
+
+typedef struct {
+   char *name;
+   policy_fn *access;
+} Policy;
+
+static uint64_t rng_state;
+
+/* FNV-1a, 64 bit */
+static uint64_t key_hash(char *s) {
+   uint64_t h = 14695981039346656037ull;
+   while (*s) {
+      h ^= (unsigned char) *s++;
+      h *= 1099511628211ull;
+   }
+   return h;
+}
+
+/* splitmix64's finalizer, so nearby inputs land far apart */
+static uint64_t mix(uint64_t x) {
+   x ^= x >> 30;
+   x *= 0xbf58476d1ce4e5b9ull;
+   x ^= x >> 27;
+   x *= 0x94d049bb133111ebull;
+   x ^= x >> 31;
+   return x;
+}
+
+/* xorshift64*, seeded with -s */
+static uint64_t rng_next(void) {
+   rng_state ^= rng_state >> 12;
+   rng_state ^= rng_state << 25;
+   rng_state ^= rng_state >> 27;
+   return rng_state * 2685821657736338717ull;
+}
+
+/* Uniform in (0, 1) from 53 bits of x */
+static double unit(uint64_t x) {
+   return ((x >> 11) + 0.5) / 9007199254740992.0;
+}
+
+/* A lognormal response size picked by h, Box-Muller on two values drawn from it */
+static size_t object_size(uint64_t h) {
+   double z = sqrt(-2.0 * log(unit(mix(h)))) * cos(2 * M_PI * unit(mix(h + 1)));
+   double size = SIZE_MEDIAN * exp(SIZE_SIGMA * z);
+   
+   if (size < SIZE_MIN) {
+      return SIZE_MIN;
+   }
+   return size > SIZE_MAX_BYTES ? SIZE_MAX_BYTES : (size_t) size;
+}
+
+static double now(void) {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void trace_init(Trace *t) {
+   memset(t, 0, sizeof(Trace));
+   t->index_mask = 1023;
+   t->index = Calloc(t->index_mask + 1, sizeof(uint32_t));
+}
+
+/* The object numbered for key, added with size bytes (0 for a made up
+ size) if the trace hasn't seen it before */
+static uint32_t trace_object(Trace *t, char *key, size_t size) {
+   uint64_t h = key_hash(key);
+   size_t i = h & t->index_mask;
+   
+   while (t->index[i] != 0) {
+      if (!strcmp(t->keys[t->index[i] - 1], key)) {
+         return t->index[i] - 1;
+      }
+      i = (i + 1) & t->index_mask;
+   }
+   if (t->objects == t->objects_max) {
+      t->objects_max = t->objects_max ? t->objects_max * 2 : 1024;
+      t->keys = Realloc(t->keys, t->objects_max * sizeof(char *));
+      t->sizes = Realloc(t->sizes, t->objects_max * sizeof(size_t));
+   }
+   uint32_t obj = t->objects++;
+   t->keys[obj] = strdup(key);
+   t->sizes[obj] = size ? size : object_size(h);
+   t->index[i] = obj + 1;
+   
+   if (t->objects * 2 > t->index_mask) { //keep the index under half full
+      size_t mask = t->index_mask * 2 + 1;
+      uint32_t *index = Calloc(mask + 1, sizeof(uint32_t));
+      for (uint32_t o = 0; o < t->objects; o++) {
+         size_t j = key_hash(t->keys[o]) & mask;
+         while (index[j] != 0) {
+            j = (j + 1) & mask;
+         }
+         index[j] = o + 1;
+      }
+      free(t->index);
+      t->index = index;
+      t->index_mask = mask;
+   }
+   return obj;
+}
+
+static void trace_request(Trace *t, uint32_t obj) {
+   if (t->count == t->count_max) {
+      t->count_max = t->count_max ? t->count_max * 2 : 4096;
+      t->refs = Realloc(t->refs, t->count_max * sizeof(uint32_t));
+   }
+   t->refs[t->count++] = obj;
+   t->bytes += t->sizes[obj];
+}
+
+/* Lines of "url [bytes]", blank lines and # comments skipped */
+static int read_trace(Trace *t, char *path) {
+   char line[MAXLINE], url[MAXLINE];
+   FILE *f = fopen(path, "r");
+   
+   if (f == NULL) {
+      return -1;
+   }
+   while (fgets(line, sizeof(line), f) != NULL) {
+      unsigned long size = 0;
+      if (sscanf(line, "%s %lu", url, &size) >= 1 && url[0] != '#') {
+         trace_request(t, trace_object(t, url, size));
+      }
+   }
+   fclose(f);
+   return 0;
+}
+
+/* The GETs in the proxy's log.txt, each logged as "User Request: GET url ..." */
+static int read_log(Trace *t, char *path) {
+   char line[MAXLINE], url[MAXLINE];
+   FILE *f = fopen(path, "r");
+   
+   if (f == NULL) {
+      return -1;
+   }
+   while (fgets(line, sizeof(line), f) != NULL) {
+      char *p = strstr(line, "User Request: GET "); //other messages can end up in front of it on the same line
+      if (p != NULL && sscanf(p + 18, "%s", url) == 1) {
+         trace_request(t, trace_object(t, url, 0));
+      }
+   }
+   fclose(f);
+   return 0;
+}
+
+/* count requests over objects URLs, the i'th most popular asked for in
+ proportion to 1/i^alpha */
+static void make_zipf(Trace *t, double alpha, size_t count, size_t objects) {
+   double *cdf = Malloc(objects * sizeof(double));
+   double sum = 0;
+   char url[MAXLINE];
+   
+   for (size_t i = 0; i < objects; i++) {
+      sum += 1.0 / pow(i + 1, alpha);
+      cdf[i] = sum;
+   }
+   for (size_t i = 0; i < objects; i++) {
+      cdf[i] /= sum;
+      sprintf(url, "http://sim.example/object/%zu", i);
+      trace_object(t, url, 0);
+   }
+   for (size_t n = 0; n < count; n++) {
+      double u = unit(rng_next());
+      size_t lo = 0, hi = objects - 1;
+      while (lo < hi) { //first object whose cumulative share reaches u
+         size_t mid = (lo + hi) / 2;
+         if (cdf[mid] < u) {
+            lo = mid + 1;
+         }
+         else {
+            hi = mid;
+         }
+      }
+      trace_request(t, lo);
+   }
+   free(cdf);
+}
+
+/* Object lists for lru, fifo and clock, by object number */
+static void list_unlink(Sim *s, uint32_t o) {
+   if (s->prev[o] >= 0) {
+      s->next[s->prev[o]] = s->next[o];
+   }
+   else {
+      s->head = s->next[o];
+   }
+   if (s->next[o] >= 0) {
+      s->prev[s->next[o]] = s->prev[o];
+   }
+   else {
+      s->tail = s->prev[o];
+   }
+}
+
+static void list_push(Sim *s, uint32_t o) {
+   s->prev[o] = -1;
+   s->next[o] = s->head;
+   if (s->head >= 0) {
+      s->prev[s->head] = o;
+   }
+   s->head = o;
+   if (s->tail < 0) {
+      s->tail = o;
+   }
+}
+
+/* Whether obj may be cached at all, everything in the cache taken together */
+static int admits(Sim *s, uint32_t obj) {
+   size_t size = s->t->sizes[obj];
+   return size <= s->max_object && size <= s->capacity;
+}
+
+/* Drops objects off the tail until size more bytes fit. With second_chance
+ a referenced one goes back to the head instead, once. */
+static void list_make_room(Sim *s, size_t size, int second_chance) {
+   while (s->tail >= 0 && s->used + size > s->capacity) {
+      uint32_t o = s->tail;
+      list_unlink(s, o);
+      if (second_chance && s->referenced[o]) {
+         s->referenced[o] = 0;
+         list_push(s, o);
+         continue;
+      }
+      s->cached[o] = 0;
+      s->used -= s->t->sizes[o];
+   }
+}
+
+static int list_insert(Sim *s, uint32_t obj, int second_chance) {
+   if (admits(s, obj)) {
+      list_make_room(s, s->t->sizes[obj], second_chance);
+      list_push(s, obj);
+      s->cached[obj] = 1;
+      s->referenced[obj] = 0;
+      s->used += s->t->sizes[obj];
+   }
+   return 0;
+}
+
+static int access_lru(Sim *s, uint32_t obj) {
+   if (s->cached[obj]) {
+      list_unlink(s, obj);
+      list_push(s, obj);
+      return 1;
+   }
+   return list_insert(s, obj, 0);
+}
+
+static int access_fifo(Sim *s, uint32_t obj) {
+   return s->cached[obj] ? 1 : list_insert(s, obj, 0);
+}
+
+/* FIFO with a second chance, the same victims CLOCK's hand would pick */
+static int access_clock(Sim *s, uint32_t obj) {
+   if (s->cached[obj]) {
+      s->referenced[obj] = 1;
+      return 1;
+   }
+   return list_insert(s, obj, 1);
+}
+
+/* Min heap of cached objects by gdsf priority */
+static void heap_swap(Sim *s, size_t a, size_t b) {
+   uint32_t o = s->heap[a];
+   s->heap[a] = s->heap[b];
+   s->heap[b] = o;
+   s->heap_pos[s->heap[a]] = a;
+   s->heap_pos[s->heap[b]] = b;
+}
+
+static void heap_up(Sim *s, size_t i) {
+   while (i > 0 && s->priority[s->heap[(i - 1) / 2]] > s->priority[s->heap[i]]) {
+      heap_swap(s, i, (i - 1) / 2);
+      i = (i - 1) / 2;
+   }
+}
+
+static void heap_down(Sim *s, size_t i) {
+   while (1) {
+      size_t least = i, l = 2 * i + 1, r = 2 * i + 2;
+      if (l < s->heap_count && s->priority[s->heap[l]] < s->priority[s->heap[least]]) {
+         least = l;
+      }
+      if (r < s->heap_count && s->priority[s->heap[r]] < s->priority[s->heap[least]]) {
+         least = r;
+      }
+      if (least == i) {
+         return;
+      }
+      heap_swap(s, i, least);
+      i = least;
+   }
+}
+
+/* Greedy-Dual-Size-Frequency: small, often used objects stay longest, and
+ the inflation value ages out ones that stopped being used */
+static int access_gdsf(Sim *s, uint32_t obj) {
+   size_t size = s->t->sizes[obj];
+   
+   if (s->cached[obj]) {
+      s->freq[obj]++;
+      s->priority[obj] = s->inflation + (double) s->freq[obj] / size;
+      heap_down(s, s->heap_pos[obj]); //priorities only go up on a hit
+      return 1;
+   }
+   if (!admits(s, obj)) {
+      return 0;
+   }
+   while (s->heap_count > 0 && s->used + size > s->capacity) {
+      uint32_t victim = s->heap[0];
+      s->inflation = s->priority[victim];
+      heap_swap(s, 0, --s->heap_count);
+      heap_down(s, 0);
+      s->cached[victim] = 0;
+      s->used -= s->t->sizes[victim];
+   }
+   s->cached[obj] = 1;
+   s->freq[obj] = 1;
+   s->priority[obj] = s->inflation + 1.0 / size;
+   s->heap[s->heap_count] = obj;
+   s->heap_pos[obj] = s->heap_count;
+   heap_up(s, s->heap_count++);
+   s->used += size;
+   return 0;
+}
+
+/* The proxy's CacheList, looked up and filled the way http_proxy does it.
+ Each response gets its own ETag and body bytes, so the body store has
+ nothing to share between objects that only happen to be the same size. */
+static int access_cachelist(Sim *s, uint32_t obj) {
+   char *key = s->t->keys[obj];
+   size_t size = s->t->sizes[obj];
+   
+   if (find(key, &s->list) != NULL) {
+      move_to_front(key, &s->list);
+      return 1;
+   }
+   if (size > s->list.max_object) { //cache_URL would only throw it away
+      return 0;
+   }
+   char *item = Malloc(size);
+   int n = sprintf(item, "HTTP/1.0 200 OK\r\nETag: \"%u\"\r\nContent-Length: %zu\r\n\r\n", obj, size);
+   size_t body = size - n;
+   memset(item + n, 'x', body);
+   memcpy(item + n, &obj, sizeof(obj) < body ? sizeof(obj) : body);
+   cache_URL(key, item, size, 0, 0, &s->list);
+   return 0;
+}
+
+static Policy policies[] = {
+   {"cachelist", access_cachelist},
+   {"lru", access_lru},
+   {"fifo", access_fifo},
+   {"clock", access_clock},
+   {"gdsf", access_gdsf},
+};
+#define POLICY_COUNT (sizeof(policies) / sizeof(Policy))
+
+/* Replays t through policy at capacity bytes, returns the hits and bytes
+ hit and how long it took */
+static double replay(Trace *t, Policy *policy, size_t capacity, size_t max_object,
+                     unsigned long *hits, unsigned long long *byte_hits) {
+   Sim s;
+   size_t n = t->objects;
+   
+   memset(&s, 0, sizeof(s));
+   s.t = t;
+   s.capacity = capacity;
+   s.max_object = max_object;
+   s.cached = Calloc(n, 1);
+   s.referenced = Calloc(n, 1);
+   s.prev = Calloc(n, sizeof(int32_t));
+   s.next = Calloc(n, sizeof(int32_t));
+   s.head = s.tail = -1;
+   s.freq = Calloc(n, sizeof(uint32_t));
+   s.priority = Calloc(n, sizeof(double));
+   s.heap = Calloc(n, sizeof(uint32_t));
+   s.heap_pos = Calloc(n, sizeof(uint32_t));
+   cache_init(&s.list, capacity, max_object);
+   
+   *hits = 0;
+   *byte_hits = 0;
+   double start = now();
+   for (size_t i = 0; i < t->count; i++) {
+      uint32_t obj = t->refs[i];
+      if (policy->access(&s, obj)) {
+         (*hits)++;
+         *byte_hits += t->sizes[obj];
+      }
+   }
+   double secs = now() - start;
+   
+   cache_destruct(&s.list);
+   free(s.cached);
+   free(s.referenced);
+   free(s.prev);
+   free(s.next);
+   free(s.freq);
+   free(s.priority);
+   free(s.heap);
+   free(s.heap_pos);
+   return secs;
+}
+
+/* Fenwick tree over sampled reference times, bytes of the objects last used at each */
+static void fenwick_add(long long *tree, size_t n, size_t i, long long v) {
+   for (; i <= n; i += i & -i) {
+      tree[i] += v;
+   }
+}
+
+static long long fenwick_sum(long long *tree, size_t i) {
+   long long sum = 0;
+   for (; i > 0; i -= i & -i) {
+      sum += tree[i];
+   }
+   return sum;
+}
+
+static int distance_cmp(const void *a, const void *b) {
+   double x = *(double *) a, y = *(double *) b;
+   return x < y ? -1 : x > y;
+}
+
+/*
+ * shards - LRU miss ratios at each of the count cache sizes in sizes, from
+ * one pass over a rate sample of t's keys. A reference hits an LRU cache
+ * of C bytes if the distinct bytes used since the object's last reference,
+ * plus its own, fit in C; the sample's distances are divided by rate to
+ * stand for the whole trace. SHARDS-adj puts the difference between the
+ * references expected in the sample and those actually in it at distance
+ * zero, which corrects for a few very popular keys landing in or out of it.
+ */
+static double shards(Trace *t, size_t max_object, double rate, size_t *sizes, int count,
+                     double *miss, size_t *sampled) {
+   uint64_t threshold = rate * SHARDS_MODULUS;
+   unsigned char *in_sample = Malloc(t->objects);
+   size_t *last = Calloc(t->objects, sizeof(size_t)); //sample time of each object's last reference, 0 for never
+   long long *tree = Calloc(t->count + 1, sizeof(long long));
+   double *dist = Malloc((t->count + 1) * sizeof(double));
+   size_t time = 0, reuses = 0;
+   
+   double start = now();
+   for (size_t o = 0; o < t->objects; o++) {
+      in_sample[o] = (mix(key_hash(t->keys[o])) % SHARDS_MODULUS) < threshold;
+   }
+   for (size_t i = 0; i < t->count; i++) {
+      uint32_t obj = t->refs[i];
+      size_t size = t->sizes[obj];
+      if (!in_sample[obj]) {
+         continue;
+      }
+      time++;
+      if (size > max_object) { //never cached, so it never hits and takes up no room
+         continue;
+      }
+      if (last[obj] != 0) {
+         long long between = fenwick_sum(tree, time - 1) - fenwick_sum(tree, last[obj]);
+         dist[reuses++] = between / rate + size;
+         fenwick_add(tree, t->count, last[obj], -(long long) size);
+      }
+      fenwick_add(tree, t->count, time, size);
+      last[obj] = time;
+   }
+   qsort(dist, reuses, sizeof(double), distance_cmp);
+   
+   double expected = rate * t->count;
+   for (int c = 0; c < count; c++) {
+      size_t lo = 0, hi = reuses;
+      while (lo < hi) { //reuses that fit in sizes[c]
+         size_t mid = (lo + hi) / 2;
+         if (dist[mid] <= sizes[c]) {
+            lo = mid + 1;
+         }
+         else {
+            hi = mid;
+         }
+      }
+      double hits = lo + (expected - time);
+      miss[c] = expected > 0 ? 1 - hits / expected : 0;
+      miss[c] = miss[c] < 0 ? 0 : miss[c] > 1 ? 1 : miss[c];
+   }
+   double secs = now() - start;
+   
+   *sampled = time;
+   free(in_sample);
+   free(last);
+   free(tree);
+   free(dist);
+   return secs;
+}
+
+/* A byte count with an optional k or m suffix, 0 if it isn't one */
+static size_t parse_bytes(char *s, char **end) {
+   double v = strtod(s, end);
+   
+   if (*end == s || v <= 0) {
+      return 0;
+   }
+   if (**end == 'k' || **end == 'K') {
+      v *= 1024;
+      (*end)++;
+   }
+   else if (**end == 'm' || **end == 'M') {
+      v *= 1024 * 1024;
+      (*end)++;
+   }
+   return v;
+}
+
+static int size_cmp(const void *a, const void *b) {
+   size_t x = *(size_t *) a, y = *(size_t *) b;
+   return x < y ? -1 : x > y;
+}
+
+int main(int argc, char **argv) {
+   Trace t;
+   char *trace_path = NULL, *log_path = NULL, *policy_list = NULL;
+   double alpha = 0.8, rate = 0.1;
+   size_t requests = 200000, objects = 20000, max_object = MAX_OBJECT_SIZE;
+   size_t sizes[SIM_SIZES] = {MAX_CACHE_SIZE / 4, MAX_CACHE_SIZE / 2, MAX_CACHE_SIZE, MAX_CACHE_SIZE * 2, MAX_CACHE_SIZE * 4};
+   int nsizes = 5, opt, bad = 0;
+   unsigned long seed = 1;
+   
+   while ((opt = getopt(argc, argv, "f:l:z:n:u:c:o:p:r:s:")) != -1) {
+      char *end;
+      switch (opt) {
+         case 'f':
+            trace_path = optarg;
+            break;
+         case 'l':
+            log_path = optarg;
+            break;
+         case 'z':
+            alpha = atof(optarg);
+            break;
+         case 'n':
+            requests = strtoul(optarg, NULL, 10);
+            break;
+         case 'u':
+            objects = strtoul(optarg, NULL, 10);
+            break;
+         case 'c':
+            nsizes = 0;
+            for (char *p = optarg; *p != '\0' && !bad; p = *end == ',' ? end + 1 : end) {
+               if (nsizes == SIM_SIZES || (sizes[nsizes++] = parse_bytes(p, &end)) == 0 || (*end != ',' && *end != '\0')) {
+                  bad = 1;
+               }
+            }
+            break;
+         case 'o':
+            bad |= (max_object = parse_bytes(optarg, &end)) == 0;
+            break;
+         case 'p':
+            policy_list = optarg;
+            break;
+         case 'r':
+            rate = atof(optarg);
+            bad |= rate <= 0 || rate > 1;
+            break;
+         case 's':
+            seed = strtoul(optarg, NULL, 10);
+            break;
+         default:
+            bad = 1;
+            break;
+      }
+   }
+   if (bad || nsizes == 0 || optind != argc || (trace_path != NULL && log_path != NULL) || objects == 0) {
+      fprintf(stderr, "usage: %s [-f trace | -l log.txt | -z alpha] [-n requests] [-u objects] "
+              "[-c bytes,bytes,...] [-o max_object] [-p policy,...] [-r rate] [-s seed]\n", argv[0]);
+      exit(1);
+   }
+   qsort(sizes, nsizes, sizeof(size_t), size_cmp);
+   
+   trace_init(&t);
+   rng_state = mix(seed) | 1; //xorshift never leaves zero
+   if (trace_path != NULL || log_path != NULL) {
+      char *path = trace_path != NULL ? trace_path : log_path;
+      if ((trace_path != NULL ? read_trace(&t, path) : read_log(&t, path)) < 0) {
+         fprintf(stderr, "Couldn't read %s: %s\n", path, strerror(errno));
+         exit(1);
+      }
+      printf("trace %s: ", path);
+   }
+   else {
+      make_zipf(&t, alpha, requests, objects);
+      printf("zipf alpha %.2f seed %lu: ", alpha, seed);
+   }
+   if (t.count == 0) {
+      printf("no requests\n");
+      return 0;
+   }
+   size_t oversized = 0;
+   for (size_t o = 0; o < t.objects; o++) {
+      oversized += t.sizes[o] > max_object;
+   }
+   printf("%zu requests, %zu objects (%zu over %zu bytes), %.1f MB requested\n\n",
+          t.count, t.objects, oversized, max_object, t.bytes / 1048576.0);
+   
+   double lru_miss[SIM_SIZES];
+   int have_lru = 0;
+   printf("%-10s %12s %8s %10s %12s\n", "policy", "cache bytes", "hit %", "byte hit %", "requests/s");
+   for (size_t p = 0; p < POLICY_COUNT; p++) {
+      if (policy_list != NULL) { //only the ones named, in our order
+         char *at = strstr(policy_list, policies[p].name);
+         size_t len = strlen(policies[p].name);
+         if (at == NULL || (at != policy_list && at[-1] != ',') || (at[len] != ',' && at[len] != '\0')) {
+            continue;
+         }
+      }
+      for (int c = 0; c < nsizes; c++) {
+         unsigned long hits;
+         unsigned long long byte_hits;
+         double secs = replay(&t, &policies[p], sizes[c], max_object, &hits, &byte_hits);
+         printf("%-10s %12zu %8.2f %10.2f %12.0f\n", policies[p].name, sizes[c],
+                100.0 * hits / t.count, 100.0 * byte_hits / t.bytes, t.count / secs);
+         if (policies[p].access == access_lru) {
+            lru_miss[c] = 1 - (double) hits / t.count;
+            have_lru = 1;
+         }
+      }
+   }
+   
+   double miss[SIM_SIZES];
+   size_t sampled;
+   double secs = shards(&t, max_object, rate, sizes, nsizes, miss, &sampled);
+   printf("\nLRU miss ratio curve, SHARDS at rate %g: %zu of %zu requests sampled in %.3f s\n",
+          rate, sampled, t.count, secs);
+   printf("%12s %10s %10s\n", "cache bytes", "shards %", "exact %");
+   for (int c = 0; c < nsizes; c++) {
+      if (have_lru) {
+         printf("%12zu %10.2f %10.2f\n", sizes[c], 100 * miss[c], 100 * lru_miss[c]);
+      }
+      else {
+         printf("%12zu %10.2f %10s\n", sizes[c], 100 * miss[c], "-");
+      }
+   }
+   return 0;
+}
@@ -14,6 +14,9 @@
  * 
  * Updated 4/2013 droh: - rio_readlineb: fixed edge case bug - rio_readnb:
  * removed redundant EINTR check
+ *
+ * rio_readlineb copies whole lines out of the internal buffer, finding the
+ * '\n' with memchr, instead of calling rio_read once per byte.
  */
 /* $begin csapp.c */
 #include "csapp.h"
@@ -910,10 +913,8 @@ rio_writen(int fd, void *usrbuf, size_t n)
  */
 /* $begin rio_read */
 static ssize_t 
-rio_read(rio_t * rp, char *usrbuf, size_t n)
+rio_fill(rio_t * rp)
 {
-	int		cnt;
-
 	while (rp->rio_cnt <= 0) {	/* Refill if buf is empty */
 		rp->rio_cnt = read(rp->rio_fd, rp->rio_buf,
 				   sizeof(rp->rio_buf));
@@ -926,6 +927,17 @@ rio_read(rio_t * rp, char *usrbuf, size_t n)
 		else
 			rp->rio_bufptr = rp->rio_buf;	/* Reset buffer ptr */
 	}
+	return rp->rio_cnt;
+}
+
+static ssize_t 
+rio_read(rio_t * rp, char *usrbuf, size_t n)
+{
+	int		cnt;
+	ssize_t		rc;
+
+	if ((rc = rio_fill(rp)) <= 0)
+		return rc;
 
 	/* Copy min(n, rp->rio_cnt) bytes from internal buf to user buf */
 	cnt = n;
@@ -981,26 +993,31 @@ rio_readnb(rio_t * rp, void *usrbuf, size_t n)
 ssize_t 
 rio_readlineb(rio_t * rp, void *usrbuf, size_t maxlen)
 {
-	int		n         , rc;
-	char		c        , *bufp = usrbuf;
-
-	for (n = 1; n < maxlen; n++) {
-		if ((rc = rio_read(rp, &c, 1)) == 1) {
-			*bufp++ = c;
-			if (c == '\n') {
-				n++;
-				break;
-			}
-		} else if (rc == 0) {
-			if (n == 1)
-				return 0;	/* EOF, no data read */
-			else
-				break;	/* EOF, some data was read */
-		} else
+	size_t		n = 0, want, take;
+	ssize_t		rc;
+	char           *bufp = usrbuf, *nl = NULL;
+
+	if (maxlen == 0)
+		return 0;
+	while (nl == NULL && n < maxlen - 1) {
+		if ((rc = rio_fill(rp)) < 0)
 			return -1;	/* Error */
+		else if (rc == 0)
+			break;	/* EOF */
+
+		/* Copy up to and including the '\n', or all that's buffered */
+		want = maxlen - 1 - n;
+		if ((size_t) rp->rio_cnt < want)
+			want = rp->rio_cnt;
+		nl = memchr(rp->rio_bufptr, '\n', want);
+		take = nl != NULL ? (size_t) (nl - rp->rio_bufptr) + 1 : want;
+		memcpy(bufp + n, rp->rio_bufptr, take);
+		rp->rio_bufptr += take;
+		rp->rio_cnt -= take;
+		n += take;
 	}
-	*bufp = 0;
-	return n - 1;
+	bufp[n] = 0;
+	return n;
 }
 /* $end rio_readlineb */
 
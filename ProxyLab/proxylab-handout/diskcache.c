@@ -0,0 +1,360 @@
+/*
+ * diskcache.c - log-structured on-disk second tier for the proxy cache
+ *
+ * Objects are appended to a ring of fixed size segment files in one
+ * directory (seg.<seq>). Every record is a DiskRecord header followed by
+ * the key and the body, so the in-memory index can be rebuilt at startup
+ * by walking the headers without reading any bodies. When the ring is full
+ * the oldest segment is unlinked along with every index entry pointing at it.
+ */
+#include "diskcache.h"
+
+#define FNV_OFFSET 2166136261u
+#define FNV_PRIME 16777619u
+
+/* FNV-1a over len bytes, continuing from h */
+static uint32_t hash_bytes(const void *buf, size_t len, uint32_t h) {
+   const unsigned char *p = buf;
+   for (size_t i = 0; i < len; i++) {
+      h ^= p[i];
+      h *= FNV_PRIME;
+   }
+   return h;
+}
+
+static uint32_t record_check(DiskRecord *rec, char *key) {
+   uint32_t h = hash_bytes(rec, offsetof(DiskRecord, check), FNV_OFFSET);
+   h = hash_bytes(&rec->stored, sizeof(rec->stored), h);
+   return hash_bytes(key, rec->key_len, h);
+}
+
+static void segment_path(DiskCache *dc, uint32_t seq, char *path) {
+   snprintf(path, MAXLINE, "%s/seg.%u", dc->dir, seq);
+}
+
+static DiskEntry *lookup(DiskCache *dc, char *key) {
+   DiskEntry *e = dc->buckets[hash_bytes(key, strlen(key), FNV_OFFSET) % DISK_INDEX_BUCKETS];
+   while (e != NULL && strcmp(e->key, key) != 0) {
+      e = e->next;
+   }
+   return e;
+}
+
+/* Point key at a record, replacing an older record for the same key */
+static void index_insert(DiskCache *dc, char *key, uint32_t seq, off_t offset, size_t size, time_t stored) {
+   DiskEntry *e = lookup(dc, key);
+   if (e == NULL) {
+      uint32_t b = hash_bytes(key, strlen(key), FNV_OFFSET) % DISK_INDEX_BUCKETS;
+      e = Malloc(sizeof(DiskEntry));
+      e->key = strdup(key);
+      e->next = dc->buckets[b];
+      dc->buckets[b] = e;
+      dc->count++;
+   }
+   e->seq = seq;
+   e->offset = offset;
+   e->size = size;
+   e->stored = stored;
+}
+
+/* Forget every entry that lives in segment seq, then close and unlink it.
+ Caller holds the write lock. */
+static void drop_segment(DiskCache *dc, uint32_t seq) {
+   char path[MAXLINE];
+   int slot = seq % DISK_NSEGMENTS;
+
+   for (int b = 0; b < DISK_INDEX_BUCKETS; b++) {
+      DiskEntry **ep = &dc->buckets[b];
+      while (*ep != NULL) {
+         DiskEntry *e = *ep;
+         if (e->seq == seq) {
+            *ep = e->next;
+            free(e->key);
+            free(e);
+            dc->count--;
+         }
+         else {
+            ep = &e->next;
+         }
+      }
+   }
+
+   if (dc->fds[slot] >= 0) {
+      close(dc->fds[slot]);
+      dc->fds[slot] = -1;
+   }
+   segment_path(dc, seq, path);
+   unlink(path);
+}
+
+/* Walk the record headers of one segment and index them. A record that is
+ cut short or fails its check marks the end of the log, anything after it
+ is truncated away. Returns the offset the next append should go to. */
+static off_t scan_segment(DiskCache *dc, uint32_t seq, int fd) {
+   struct stat st;
+   DiskRecord rec;
+   char key[MAXLINE];
+   off_t off = 0;
+
+   if (fstat(fd, &st) < 0) {
+      return 0;
+   }
+
+   while (off + (off_t) sizeof(rec) <= st.st_size) {
+      if (pread(fd, &rec, sizeof(rec), off) != sizeof(rec)) {
+         break;
+      }
+      if (rec.magic != DISK_RECORD_MAGIC || rec.key_len == 0 || rec.key_len >= MAXLINE) {
+         break;
+      }
+      off_t end = off + sizeof(rec) + rec.key_len + rec.body_len;
+      if (end > st.st_size) { //body never made it to disk
+         break;
+      }
+      if (pread(fd, key, rec.key_len, off + sizeof(rec)) != rec.key_len) {
+         break;
+      }
+      if (record_check(&rec, key) != rec.check) {
+         break;
+      }
+      key[rec.key_len] = '\0';
+      index_insert(dc, key, seq, off + sizeof(rec) + rec.key_len, rec.body_len, rec.stored);
+      off = end;
+   }
+
+   if (off < st.st_size && ftruncate(fd, off) < 0) {
+      return off; //garbage stays on disk but the next append overwrites it
+   }
+   return off;
+}
+
+static int open_segment(DiskCache *dc, uint32_t seq, int flags) {
+   char path[MAXLINE];
+   segment_path(dc, seq, path);
+   int fd = open(path, O_RDWR | flags, DEF_MODE);
+   if (fd >= 0) {
+      dc->fds[seq % DISK_NSEGMENTS] = fd;
+   }
+   return fd;
+}
+
+static int compare_seq(const void *a, const void *b) {
+   uint32_t x = *(const uint32_t *) a;
+   uint32_t y = *(const uint32_t *) b;
+   return (x > y) - (x < y);
+}
+
+/*
+ * diskcache_open - open (creating if needed) the segments in dir and rebuild
+ * the index from them. Returns the number of objects found or -1 on error.
+ */
+int diskcache_open(DiskCache *dc, char *dir) {
+   DIR *dp;
+   struct dirent *de;
+   uint32_t *seqs = NULL;
+   size_t nseqs = 0, cap = 0;
+
+   memset(dc, 0, sizeof(DiskCache));
+   for (int i = 0; i < DISK_NSEGMENTS; i++) {
+      dc->fds[i] = -1;
+   }
+   snprintf(dc->dir, sizeof(dc->dir), "%s", dir);
+   pthread_rwlock_init(&dc->lock, NULL);
+   pthread_mutex_init(&dc->append, NULL);
+
+   if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+      return -1;
+   }
+   if ((dp = opendir(dir)) == NULL) {
+      return -1;
+   }
+   while ((de = readdir(dp)) != NULL) { //collect the sequence numbers of every segment
+      unsigned int seq;
+      char tail;
+      if (sscanf(de->d_name, "seg.%u%c", &seq, &tail) != 1) {
+         continue;
+      }
+      if (nseqs == cap) {
+         cap = cap ? cap * 2 : 16;
+         seqs = Realloc(seqs, cap * sizeof(uint32_t));
+      }
+      seqs[nseqs++] = seq;
+   }
+   closedir(dp);
+
+   if (nseqs == 0) { //fresh directory, start the log at segment 0
+      free(seqs);
+      if (open_segment(dc, 0, O_CREAT | O_TRUNC) < 0) {
+         return -1;
+      }
+      return 0;
+   }
+
+   qsort(seqs, nseqs, sizeof(uint32_t), compare_seq);
+   dc->last = seqs[nseqs - 1];
+   dc->first = dc->last >= DISK_NSEGMENTS - 1 ? dc->last - (DISK_NSEGMENTS - 1) : 0;
+
+   /* Replay oldest to newest so newer records win */
+   for (size_t i = 0; i < nseqs; i++) {
+      if (seqs[i] < dc->first) { //left over from a bigger ring, throw it away
+         char path[MAXLINE];
+         segment_path(dc, seqs[i], path);
+         unlink(path);
+         continue;
+      }
+      int fd = open_segment(dc, seqs[i], 0);
+      if (fd < 0) {
+         continue;
+      }
+      off_t end = scan_segment(dc, seqs[i], fd);
+      if (seqs[i] == dc->last) {
+         dc->tail = end;
+      }
+   }
+   free(seqs);
+
+   if (dc->fds[dc->last % DISK_NSEGMENTS] < 0) {
+      return -1;
+   }
+   return (int) dc->count;
+}
+
+void diskcache_close(DiskCache *dc) {
+   for (int b = 0; b < DISK_INDEX_BUCKETS; b++) {
+      DiskEntry *e = dc->buckets[b];
+      while (e != NULL) {
+         DiskEntry *next = e->next;
+         free(e->key);
+         free(e);
+         e = next;
+      }
+      dc->buckets[b] = NULL;
+   }
+   for (int i = 0; i < DISK_NSEGMENTS; i++) {
+      if (dc->fds[i] >= 0) {
+         close(dc->fds[i]);
+         dc->fds[i] = -1;
+      }
+   }
+   dc->count = 0;
+   pthread_rwlock_destroy(&dc->lock);
+   pthread_mutex_destroy(&dc->append);
+}
+
+/* Start a new segment, dropping the oldest one if the ring is full.
+ Caller holds the append mutex. */
+static int roll_segment(DiskCache *dc) {
+   uint32_t next = dc->last + 1;
+
+   pthread_rwlock_wrlock(&dc->lock);
+   while (next - dc->first >= DISK_NSEGMENTS) {
+      drop_segment(dc, dc->first++);
+   }
+   int fd = open_segment(dc, next, O_CREAT | O_TRUNC);
+   if (fd >= 0) {
+      dc->last = next;
+      dc->tail = 0;
+   }
+   pthread_rwlock_unlock(&dc->lock);
+   return fd < 0 ? -1 : 0;
+}
+
+/* Write all of buf at off, returns -1 if it couldn't */
+static int pwrite_all(int fd, void *buf, size_t n, off_t off) {
+   char *p = buf;
+   while (n > 0) {
+      ssize_t w = pwrite(fd, p, n, off);
+      if (w < 0) {
+         if (errno == EINTR) {
+            continue;
+         }
+         return -1;
+      }
+      p += w;
+      off += w;
+      n -= w;
+   }
+   return 0;
+}
+
+/*
+ * diskcache_put - append item to the log under key, stamped with the time it
+ * was fetched so its freshness survives a restart. Returns -1 if the item
+ * is too big or the write failed.
+ */
+int diskcache_put(DiskCache *dc, char *key, void *item, size_t size, time_t stored) {
+   DiskRecord rec;
+   size_t key_len = strlen(key);
+
+   if (size > MAX_DISK_OBJECT_SIZE || key_len == 0 || key_len >= MAXLINE) {
+      return -1;
+   }
+   rec.magic = DISK_RECORD_MAGIC;
+   rec.key_len = key_len;
+   rec.body_len = size;
+   rec.stored = stored;
+   rec.check = record_check(&rec, key);
+
+   pthread_mutex_lock(&dc->append);
+   off_t need = sizeof(rec) + key_len + size;
+   if (dc->tail + need > DISK_SEGMENT_SIZE && roll_segment(dc) < 0) {
+      pthread_mutex_unlock(&dc->append);
+      return -1;
+   }
+
+   int fd = dc->fds[dc->last % DISK_NSEGMENTS];
+   off_t off = dc->tail;
+   if (pwrite_all(fd, &rec, sizeof(rec), off) < 0 ||
+       pwrite_all(fd, key, key_len, off + sizeof(rec)) < 0 ||
+       pwrite_all(fd, item, size, off + sizeof(rec) + key_len) < 0) {
+      if (ftruncate(fd, off) < 0) { //leave no half record behind
+         dc->tail = off + need; //couldn't cut it off, skip past it instead
+      }
+      pthread_mutex_unlock(&dc->append);
+      return -1;
+   }
+
+   pthread_rwlock_wrlock(&dc->lock);
+   index_insert(dc, key, dc->last, off + sizeof(rec) + key_len, size, stored);
+   pthread_rwlock_unlock(&dc->lock);
+   dc->tail = off + need;
+   pthread_mutex_unlock(&dc->append);
+   return 0;
+}
+
+/*
+ * diskcache_get - read the body stored under key into a Malloc'd buffer.
+ * Returns NULL on a miss. The read lock is held across the pread so the
+ * segment can't be dropped underneath it.
+ */
+void *diskcache_get(DiskCache *dc, char *key, size_t *size, time_t *stored) {
+   char *buf = NULL;
+
+   pthread_rwlock_rdlock(&dc->lock);
+   DiskEntry *e = lookup(dc, key);
+   if (e != NULL) {
+      int fd = dc->fds[e->seq % DISK_NSEGMENTS];
+      size_t got = 0;
+      buf = Malloc(e->size ? e->size : 1);
+      while (got < e->size) {
+         ssize_t r = pread(fd, buf + got, e->size - got, e->offset + got);
+         if (r < 0 && errno == EINTR) {
+            continue;
+         }
+         if (r <= 0) {
+            break;
+         }
+         got += r;
+      }
+      if (got != e->size) {
+         free(buf);
+         buf = NULL;
+      }
+      else {
+         *size = e->size;
+         *stored = e->stored;
+      }
+   }
+   pthread_rwlock_unlock(&dc->lock);
+   return buf;
+}
@@ -0,0 +1,53 @@
+/*
+ * diskcache.h - log-structured on-disk second tier for the proxy cache
+ */
+#ifndef __DISKCACHE_H__
+#define __DISKCACHE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include "csapp.h"
+
+#define DISK_SEGMENT_SIZE (8*1024*1024) //bytes in one log segment before rolling to a new one
+#define DISK_NSEGMENTS 8 //segments kept on disk, oldest is dropped when a new one is needed
+#define MAX_DISK_OBJECT_SIZE (DISK_SEGMENT_SIZE - MAXLINE) //biggest object the disk tier will take
+#define DISK_INDEX_BUCKETS 4096 //buckets in the in-memory index
+#define DISK_RECORD_MAGIC 0x50525832 //"PRX2" marks the start of every record
+
+/* Header written in front of every key/body pair in a segment */
+typedef struct {
+   uint32_t magic; //always DISK_RECORD_MAGIC
+   uint32_t key_len; //bytes of key following the header
+   uint32_t body_len; //bytes of body following the key
+   uint32_t check; //hash over the other fields and the key to catch torn writes
+   int64_t stored; //when the proxy got the response from the server
+} DiskRecord;
+
+typedef struct DiskEntry DiskEntry;
+struct DiskEntry {
+   char *key; //request line the body was cached under
+   uint32_t seq; //sequence number of the segment holding the body
+   off_t offset; //where the body starts inside that segment
+   size_t size; //size of the body
+   time_t stored; //when the proxy got the response from the server
+   DiskEntry *next; //next entry in the same bucket
+};
+
+typedef struct {
+   char dir[MAXLINE - 32]; //directory the segments live in, leaves room for /seg.<seq>
+   int fds[DISK_NSEGMENTS]; //open segment files, slot is seq % DISK_NSEGMENTS
+   uint32_t first; //oldest segment still on disk
+   uint32_t last; //segment currently being appended to
+   off_t tail; //append offset in the last segment
+   size_t count; //number of objects in the index
+   DiskEntry *buckets[DISK_INDEX_BUCKETS]; //index from key to record
+   pthread_rwlock_t lock; //readers look up and pread, writers change the index or drop segments
+   pthread_mutex_t append; //serializes appends to the last segment
+} DiskCache;
+
+int diskcache_open(DiskCache *dc, char *dir); //open dir and rebuild the index, -1 on error
+void diskcache_close(DiskCache *dc);
+int diskcache_put(DiskCache *dc, char *key, void *item, size_t size, time_t stored);
+void *diskcache_get(DiskCache *dc, char *key, size_t *size, time_t *stored);
+
+#endif /* __DISKCACHE_H__ */
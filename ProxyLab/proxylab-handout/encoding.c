@@ -0,0 +1,220 @@
+/*
+ * encoding.c - gzip Content-Encoding for cached responses
+ *
+ * The cache keeps compressible bodies gzipped under the server's original
+ * headers. A client that accepts gzip gets those bytes as they are with the
+ * headers rewritten by gzip_head; anyone else gets the original headers and
+ * the body inflated a chunk at a time on its way out, so the whole thing is
+ * never held uncompressed.
+ */
+#include <zlib.h>
+#include "encoding.h"
+
+/* Content-Types worth compressing, compared as prefixes */
+static char *compressible_types[] = {
+   "text/",
+   "application/javascript",
+   "application/x-javascript",
+   "application/json",
+   "application/xml",
+   "image/svg+xml",
+   NULL
+};
+
+/* Points at the value of header name in head (the status line is skipped),
+ NULL if it isn't there. The value runs up to the next CR or LF. */
+static char *find_header(char *head, size_t head_len, char *name) {
+   size_t name_len = strlen(name);
+   char *end = head + head_len;
+   char *line = memchr(head, '\n', head_len);
+   
+   while (line != NULL && ++line < end && *line != '\r' && *line != '\n') {
+      if ((size_t) (end - line) > name_len && !strncasecmp(line, name, name_len) && line[name_len] == ':') {
+         char *v = line + name_len + 1;
+         while (v < end && (*v == ' ' || *v == '\t')) {
+            v++;
+         }
+         return v;
+      }
+      line = memchr(line, '\n', end - line);
+   }
+   return NULL;
+}
+
+/*
+ * encoding_compressible - whether a response may be stored gzipped: a 200
+ * with a textual Content-Type, not already encoded, not marked no-transform
+ * and big enough to bother with
+ */
+int encoding_compressible(char *head, size_t head_len, size_t body_len) {
+   char *v;
+   
+   if (body_len < GZIP_MIN_SIZE || head_len < 12 || strncmp(head + 8, " 200", 4) != 0) {
+      return 0;
+   }
+   if (find_header(head, head_len, "Content-Encoding") != NULL) {
+      return 0;
+   }
+   if ((v = find_header(head, head_len, "Cache-Control")) != NULL) {
+      char *eol = memchr(v, '\n', head + head_len - v);
+      for (; eol != NULL && v + 12 <= eol; v++) {
+         if (!strncasecmp(v, "no-transform", 12)) { //the server wants its bytes left alone
+            return 0;
+         }
+      }
+   }
+   if ((v = find_header(head, head_len, "Content-Type")) == NULL) {
+      return 0;
+   }
+   for (int i = 0; compressible_types[i] != NULL; i++) {
+      size_t n = strlen(compressible_types[i]);
+      if ((size_t) (head + head_len - v) > n && !strncasecmp(v, compressible_types[i], n)) {
+         return 1;
+      }
+   }
+   return 0;
+}
+
+/*
+ * encoding_accepts_gzip - whether an Accept-Encoding value allows gzip,
+ * either by name or through "*", and doesn't give it q=0
+ */
+int encoding_accepts_gzip(char *accept_encoding) {
+   char list[MAXLINE], *tok, *save;
+   
+   snprintf(list, sizeof(list), "%s", accept_encoding);
+   for (tok = strtok_r(list, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save)) {
+      while (*tok == ' ' || *tok == '\t') {
+         tok++;
+      }
+      size_t n = strcspn(tok, " \t;");
+      if ((n == 4 && !strncasecmp(tok, "gzip", 4)) || (n == 6 && !strncasecmp(tok, "x-gzip", 6)) ||
+          (n == 1 && *tok == '*')) {
+         char *q = strstr(tok, "q=");
+         return q == NULL || strtod(q + 2, NULL) > 0;
+      }
+   }
+   return 0;
+}
+
+/*
+ * gzip_encode - gzip len bytes of body into a Malloc'd buffer. Returns NULL
+ * if zlib fails or the result wouldn't save at least an eighth.
+ */
+char *gzip_encode(void *body, size_t len, size_t *out_len) {
+   z_stream zs;
+   
+   memset(&zs, 0, sizeof(zs));
+   if (deflateInit2(&zs, GZIP_LEVEL, Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+      return NULL;
+   }
+   size_t cap = deflateBound(&zs, len);
+   char *out = Malloc(cap);
+   zs.next_in = body;
+   zs.avail_in = len;
+   zs.next_out = (unsigned char *) out;
+   zs.avail_out = cap;
+   int rc = deflate(&zs, Z_FINISH);
+   deflateEnd(&zs);
+   if (rc != Z_STREAM_END || zs.total_out > len - len / 8) {
+      free(out);
+      return NULL;
+   }
+   *out_len = zs.total_out;
+   return Realloc(out, zs.total_out);
+}
+
+/* Inflates a body gzip_encode made into the raw_len bytes at out */
+int gzip_decode(void *gz, size_t len, void *out, size_t raw_len) {
+   z_stream zs;
+   
+   memset(&zs, 0, sizeof(zs));
+   if (inflateInit2(&zs, 16 + MAX_WBITS) != Z_OK) {
+      return -1;
+   }
+   zs.next_in = gz;
+   zs.avail_in = len;
+   zs.next_out = out;
+   zs.avail_out = raw_len;
+   int rc = inflate(&zs, Z_FINISH);
+   inflateEnd(&zs);
+   return rc == Z_STREAM_END && zs.total_out == raw_len ? 0 : -1;
+}
+
+/*
+ * gzip_stream - write prefix and then the inflated body to fd, GZIP_CHUNK
+ * bytes at a time. prefix goes out in the same write as the first chunk so
+ * a short header block doesn't wait on its own ack. Returns -1 on a write
+ * or zlib error.
+ */
+int gzip_stream(int fd, char *prefix, size_t prefix_len, void *gz, size_t len) {
+   z_stream zs;
+   int rc = Z_OK;
+   
+   memset(&zs, 0, sizeof(zs));
+   if (inflateInit2(&zs, 16 + MAX_WBITS) != Z_OK) {
+      return -1;
+   }
+   char *out = Malloc(prefix_len + GZIP_CHUNK);
+   memcpy(out, prefix, prefix_len);
+   zs.next_in = gz;
+   zs.avail_in = len;
+   while (rc == Z_OK) {
+      zs.next_out = (unsigned char *) out + prefix_len;
+      zs.avail_out = GZIP_CHUNK;
+      rc = inflate(&zs, Z_NO_FLUSH);
+      if (rc != Z_OK && rc != Z_STREAM_END) {
+         break;
+      }
+      size_t n = prefix_len + GZIP_CHUNK - zs.avail_out;
+      if (rio_writen(fd, out, n) != (ssize_t) n) {
+         rc = Z_ERRNO;
+         break;
+      }
+      prefix_len = 0;
+   }
+   inflateEnd(&zs);
+   free(out);
+   return rc == Z_STREAM_END ? 0 : -1;
+}
+
+/*
+ * gzip_head - the headers to send with the gzipped body: the original ones
+ * minus Content-Length, plus Content-Encoding, the compressed length and
+ * Vary so caches further down keep the two forms apart. A strong ETag is
+ * made weak, since the gzipped bytes aren't the ones the origin tagged; a
+ * weak tag still revalidates with If-None-Match but never satisfies an
+ * If-Range, so no range of the identity body is spliced onto gzip. Malloc'd.
+ */
+char *gzip_head(char *head, size_t head_len, size_t gz_len, size_t *out_len) {
+   char *out = Malloc(head_len + MAXLINE);
+   char *line = head, *end = head + head_len;
+   size_t n = 0;
+   
+   while (line < end) {
+      char *eol = memchr(line, '\n', end - line);
+      eol = eol != NULL ? eol + 1 : end;
+      if (*line == '\r' || *line == '\n') { //blank line, the new headers go in front of it
+         break;
+      }
+      char *value = line + 5;
+      if (!strncasecmp(line, "ETag:", 5)) {
+         while (value < eol && (*value == ' ' || *value == '\t')) {
+            value++;
+         }
+      }
+      if (!strncasecmp(line, "ETag:", 5) && value < eol && *value == '"') { //strong, W/ in front weakens it
+         n += sprintf(out + n, "ETag: W/");
+         memcpy(out + n, value, eol - value);
+         n += eol - value;
+      }
+      else if (strncasecmp(line, "Content-Length:", 15) != 0) {
+         memcpy(out + n, line, eol - line);
+         n += eol - line;
+      }
+      line = eol;
+   }
+   n += sprintf(out + n, "Content-Encoding: gzip\r\nContent-Length: %zu\r\nVary: Accept-Encoding\r\n\r\n", gz_len);
+   *out_len = n;
+   return out;
+}
@@ -0,0 +1,21 @@
+/*
+ * encoding.h - gzip Content-Encoding for cached responses
+ */
+#ifndef __ENCODING_H__
+#define __ENCODING_H__
+
+#include <stddef.h>
+#include "csapp.h"
+
+#define GZIP_MIN_SIZE 256 //bodies smaller than this aren't worth compressing
+#define GZIP_LEVEL 6 //zlib compression level
+#define GZIP_CHUNK 16384 //bytes inflated per write when decompressing for a client
+
+int encoding_compressible(char *head, size_t head_len, size_t body_len);
+int encoding_accepts_gzip(char *accept_encoding);
+char *gzip_encode(void *body, size_t len, size_t *out_len); //NULL if it doesn't get smaller
+int gzip_decode(void *gz, size_t len, void *out, size_t raw_len); //-1 unless exactly raw_len came out
+int gzip_stream(int fd, char *prefix, size_t prefix_len, void *gz, size_t len);
+char *gzip_head(char *head, size_t head_len, size_t gz_len, size_t *out_len);
+
+#endif /* __ENCODING_H__ */
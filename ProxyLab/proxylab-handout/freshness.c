@@ -0,0 +1,210 @@
+/*
+ * freshness.c - HTTP caching headers (Cache-Control, Expires, validators)
+ *
+ * Works on the raw response bytes the proxy already keeps in its cache, so
+ * nothing extra has to be stored to know how long an object stays fresh or
+ * how to revalidate it.
+ */
+#define _XOPEN_SOURCE 700 //strptime
+#define _DEFAULT_SOURCE //timegm
+#include "freshness.h"
+
+/* The three date formats RFC 7231 says a recipient has to accept */
+static char *date_formats[] = {
+   "%a, %d %b %Y %H:%M:%S GMT", //RFC 1123
+   "%A, %d-%b-%y %H:%M:%S GMT", //RFC 850
+   "%a %b %e %H:%M:%S %Y", //asctime
+   NULL
+};
+
+/*
+ * http_date - parse an HTTP date into t, returns 0 if none of the formats fit
+ */
+int http_date(char *s, time_t *t) {
+   struct tm tm;
+
+   while (*s == ' ' || *s == '\t') {
+      s++;
+   }
+   for (int i = 0; date_formats[i] != NULL; i++) {
+      memset(&tm, 0, sizeof(tm));
+      char *end = strptime(s, date_formats[i], &tm);
+      if (end != NULL) {
+         *t = timegm(&tm);
+         return 1;
+      }
+   }
+   return 0;
+}
+
+/* Copy a header value without surrounding blanks or the CRLF */
+static void copy_value(char *dst, size_t dstlen, char *val, char *eol) {
+   while (val < eol && (*val == ' ' || *val == '\t')) {
+      val++;
+   }
+   while (eol > val && (eol[-1] == ' ' || eol[-1] == '\t' || eol[-1] == '\r')) {
+      eol--;
+   }
+   size_t n = eol - val < (long) dstlen - 1 ? (size_t) (eol - val) : dstlen - 1;
+   memcpy(dst, val, n);
+   dst[n] = '\0';
+}
+
+/* Pick the directives the proxy cares about out of one Cache-Control value */
+static void parse_cache_control(char *val, Freshness *f) {
+   char *tok, *save;
+   int s_maxage = 0; //s-maxage wins over max-age in a shared cache
+
+   for (tok = strtok_r(val, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save)) {
+      while (*tok == ' ' || *tok == '\t') {
+         tok++;
+      }
+      if (!strncasecmp(tok, "s-maxage=", 9)) {
+         f->max_age = atol(tok + 9);
+         s_maxage = f->shared = 1;
+      }
+      else if (!strncasecmp(tok, "max-age=", 8) && !s_maxage) {
+         f->max_age = atol(tok + 8);
+      }
+      else if (!strncasecmp(tok, "stale-while-revalidate=", 23)) {
+         f->swr = atol(tok + 23);
+      }
+      else if (!strncasecmp(tok, "no-store", 8) || !strncasecmp(tok, "private", 7)) {
+         f->no_store = 1;
+      }
+      else if (!strncasecmp(tok, "no-cache", 8)) {
+         f->no_cache = 1;
+      }
+      else if (!strncasecmp(tok, "must-revalidate", 15)) { //fresh copies are fine, stale ones never
+         f->must_revalidate = f->shared = 1;
+      }
+      else if (!strncasecmp(tok, "proxy-revalidate", 16)) {
+         f->must_revalidate = 1;
+      }
+      else if (!strncasecmp(tok, "public", 6)) {
+         f->shared = 1;
+      }
+   }
+}
+
+/*
+ * freshness_parse - read the status line and caching headers of the response
+ * in resp. Returns the length of the header block including the blank line,
+ * or -1 if the blank line isn't within len bytes.
+ */
+int freshness_parse(char *resp, size_t len, Freshness *f) {
+   char value[VALIDATOR_LEN];
+   char *line = resp, *end = resp + len;
+
+   memset(f, 0, sizeof(Freshness));
+   f->max_age = -1;
+
+   char *eol = memchr(line, '\n', end - line);
+   if (eol == NULL) {
+      return -1;
+   }
+   if (sscanf(line, "HTTP/%*d.%*d %d", &f->status) != 1) {
+      f->status = 0;
+   }
+
+   for (line = eol + 1; line < end; line = eol + 1) {
+      if ((eol = memchr(line, '\n', end - line)) == NULL) {
+         return -1;
+      }
+      if (line[0] == '\r' || line[0] == '\n') { //blank line ends the headers
+         return eol + 1 - resp;
+      }
+      char *colon = memchr(line, ':', eol - line);
+      if (colon == NULL) {
+         continue;
+      }
+      size_t name_len = colon - line;
+      copy_value(value, sizeof(value), colon + 1, eol);
+
+      if (name_len == 13 && !strncasecmp(line, "Cache-Control", 13)) {
+         parse_cache_control(value, f);
+      }
+      else if (name_len == 6 && !strncasecmp(line, "Pragma", 6) && !strncasecmp(value, "no-cache", 8)) {
+         f->no_cache = 1;
+      }
+      else if (name_len == 7 && !strncasecmp(line, "Expires", 7)) {
+         if (!http_date(value, &f->expires) || f->expires == 0) {
+            f->expires = 1; //"Expires: 0" and friends mean already expired
+         }
+      }
+      else if (name_len == 4 && !strncasecmp(line, "Date", 4)) {
+         http_date(value, &f->date);
+      }
+      else if (name_len == 3 && !strncasecmp(line, "Age", 3)) {
+         f->age = atol(value);
+      }
+      else if (name_len == 13 && !strncasecmp(line, "Last-Modified", 13)) {
+         if (http_date(value, &f->last_modified)) {
+            strcpy(f->last_modified_str, value);
+         }
+      }
+      else if (name_len == 4 && !strncasecmp(line, "ETag", 4)) {
+         strcpy(f->etag, value);
+      }
+      else if (name_len == 4 && !strncasecmp(line, "Vary", 4)) { //may be sent more than once
+         size_t used = strlen(f->vary);
+         if (used + strlen(value) + 2 < sizeof(f->vary)) {
+            sprintf(f->vary + used, "%s%s", used ? "," : "", value);
+         }
+         else {
+            strcpy(f->vary, "*"); //too many to track, treat it as uncacheable
+         }
+      }
+   }
+   return -1;
+}
+
+/*
+ * freshness_cacheable - whether a shared cache may store this response at
+ * all. Statuses outside the heuristically cacheable set are only kept if the
+ * server gave them an explicit lifetime.
+ */
+int freshness_cacheable(Freshness *f) {
+   if (f->no_store || strchr(f->vary, '*') != NULL) { //Vary: * can never match a later request
+      return 0;
+   }
+   switch (f->status) {
+      case 206: //a part, caching it under the whole URL would hand it to everyone
+         return 0;
+      case 200: case 203: case 204: case 300: case 301:
+      case 404: case 405: case 410: case 414: case 501:
+         return 1;
+      default:
+         return f->status != 0 && (f->max_age >= 0 || f->expires != 0);
+   }
+}
+
+/*
+ * freshness_lifetime - seconds after stored that the response stops being
+ * fresh: max-age, else Expires minus Date, else a tenth of the time since
+ * Last-Modified, else 0. With nothing to go on a response is stale as soon
+ * as it's stored, so it's revalidated rather than trusted for a guessed
+ * lifetime. Age already spent upstream is taken off. Never negative.
+ */
+long freshness_lifetime(Freshness *f, time_t stored) {
+   time_t date = f->date ? f->date : stored;
+   long lifetime;
+
+   if (f->max_age >= 0) {
+      lifetime = f->max_age;
+   }
+   else if (f->expires != 0) {
+      lifetime = f->expires - date;
+   }
+   else if (f->last_modified != 0 && f->last_modified < date) {
+      lifetime = (date - f->last_modified) / 10;
+      if (lifetime > MAX_HEURISTIC_FRESHNESS) {
+         lifetime = MAX_HEURISTIC_FRESHNESS;
+      }
+   }
+   else {
+      lifetime = 0;
+   }
+   lifetime -= f->age;
+   return lifetime < 0 ? 0 : lifetime;
+}
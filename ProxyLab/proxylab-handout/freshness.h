@@ -0,0 +1,35 @@
+/*
+ * freshness.h - HTTP caching headers (Cache-Control, Expires, validators)
+ */
+#ifndef __FRESHNESS_H__
+#define __FRESHNESS_H__
+
+#include <time.h>
+#include "csapp.h"
+
+#define MAX_HEURISTIC_FRESHNESS 86400 //cap on the Last-Modified heuristic
+#define VALIDATOR_LEN 256 //room for an ETag or Last-Modified value
+
+typedef struct {
+   int status; //status code from the status line
+   int no_store; //no-store or private, never cache it
+   int no_cache; //no-cache, never serve it without asking
+   int must_revalidate; //must-revalidate or proxy-revalidate, never serve it stale
+   int shared; //public, s-maxage or must-revalidate, may be kept for a request with Authorization
+   long max_age; //max-age or s-maxage in seconds, -1 if neither was sent
+   long swr; //stale-while-revalidate in seconds, 0 if not sent
+   long age; //Age header, 0 if not sent
+   time_t date; //Date header, 0 if not sent
+   time_t expires; //Expires header, 0 if not sent, 1 if it didn't parse (already expired)
+   time_t last_modified; //Last-Modified header, 0 if not sent
+   char etag[VALIDATOR_LEN]; //ETag as sent, empty if none
+   char last_modified_str[VALIDATOR_LEN]; //Last-Modified as sent, for If-Modified-Since
+   char vary[VALIDATOR_LEN]; //every Vary header joined with commas, empty if none
+} Freshness;
+
+int freshness_parse(char *resp, size_t len, Freshness *f); //bytes of header parsed, -1 if incomplete
+int freshness_cacheable(Freshness *f);
+long freshness_lifetime(Freshness *f, time_t stored);
+int http_date(char *s, time_t *t);
+
+#endif /* __FRESHNESS_H__ */
@@ -0,0 +1,226 @@
+/*
+ * httpreq.c - single pass, resumable HTTP request parser
+ *
+ * The parser never copies: the method, URI, version and every header name
+ * and value come back as views into the buffer the request was read into.
+ * Bytes can arrive in any number of reads; the caller appends them to the
+ * same buffer and calls httpreq_parse again, which picks up at the first
+ * line it hasn't finished.
+ */
+#include "httpreq.h"
+
+static char root_path[] = "/";
+
+void httpreq_init(HttpRequest *req) {
+   req->state = REQ_LINE;
+   req->pos = 0;
+   req->nheaders = 0;
+   req->header_start = req->header_end = 0;
+}
+
+int view_is(StrView v, char *s) {
+   return strlen(s) == v.len && !strncasecmp(v.p, s, v.len);
+}
+
+static int is_blank(char c) {
+   return c == ' ' || c == '\t';
+}
+
+/* Takes the next blank-separated token off the front of [*p, end) */
+static StrView next_token(char **p, char *end) {
+   StrView v;
+   
+   while (*p < end && is_blank(**p)) {
+      (*p)++;
+   }
+   v.p = *p;
+   while (*p < end && !is_blank(**p)) {
+      (*p)++;
+   }
+   v.len = *p - v.p;
+   return v;
+}
+
+static int parse_request_line(HttpRequest *req, char *line, char *end) {
+   req->method = next_token(&line, end);
+   req->uri = next_token(&line, end);
+   req->version = next_token(&line, end);
+   if (req->method.len == 0 || req->uri.len == 0 || next_token(&line, end).len != 0) {
+      return REQ_ERROR;
+   }
+   return 0;
+}
+
+static int parse_header_line(HttpRequest *req, char *line, char *end, char *next) {
+   char *colon = memchr(line, ':', end - line);
+   
+   if (is_blank(*line)) { //obsolete line folding, RFC 7230 lets us refuse it
+      return REQ_ERROR;
+   }
+   if (colon == NULL || colon == line || is_blank(colon[-1])) {
+      return REQ_ERROR;
+   }
+   if (req->nheaders == REQ_MAX_HEADERS) {
+      return REQ_ERROR;
+   }
+   HttpHeader *h = &req->headers[req->nheaders++];
+   h->line.p = line;
+   h->line.len = next - line;
+   h->name.p = line;
+   h->name.len = colon - line;
+   char *v = colon + 1;
+   while (v < end && is_blank(*v)) {
+      v++;
+   }
+   while (end > v && is_blank(end[-1])) {
+      end--;
+   }
+   h->value.p = v;
+   h->value.len = end - v;
+   return 0;
+}
+
+/*
+ * httpreq_parse - parse as much of buf[0, len) as forms whole lines. Returns
+ * the length of the request line and headers once the blank line is in,
+ * REQ_PARTIAL if more bytes are needed, or REQ_ERROR. buf must not move or
+ * change below len between calls.
+ */
+int httpreq_parse(HttpRequest *req, char *buf, size_t len) {
+   while (req->state != REQ_DONE) {
+      char *line = buf + req->pos;
+      char *nl = memchr(line, '\n', len - req->pos);
+      if (nl == NULL) {
+         return REQ_PARTIAL;
+      }
+      char *end = nl > line && nl[-1] == '\r' ? nl - 1 : nl; //line without its CRLF or LF
+      req->pos = nl + 1 - buf;
+      
+      if (req->state == REQ_LINE) {
+         if (end == line) { //RFC 7230 says to skip blank lines before a request
+            continue;
+         }
+         if (parse_request_line(req, line, end) < 0) {
+            return REQ_ERROR;
+         }
+         req->state = REQ_HEADERS;
+         req->header_start = req->pos;
+      }
+      else if (end == line) {
+         req->state = REQ_DONE;
+         req->header_end = req->pos;
+      }
+      else if (parse_header_line(req, line, end, nl + 1) < 0) {
+         return REQ_ERROR;
+      }
+   }
+   return req->header_end;
+}
+
+/* The first header called name, NULL if there isn't one */
+HttpHeader *httpreq_header(HttpRequest *req, char *name) {
+   for (int i = 0; i < req->nheaders; i++) {
+      if (view_is(req->headers[i].name, name)) {
+         return &req->headers[i];
+      }
+   }
+   return NULL;
+}
+
+/*
+ * http_split_host - split host[:port] (a Host header or a URI's authority,
+ * any user@ in front dropped) into u->host and u->port
+ */
+int http_split_host(StrView authority, HttpUri *u) {
+   char *p = authority.p, *end = authority.p + authority.len;
+   char *at = memchr(p, '@', authority.len);
+   
+   if (at != NULL) {
+      p = at + 1;
+   }
+   u->port = 80;
+   if (p < end && *p == '[') { //[v6 literal]
+      char *close = memchr(p, ']', end - p);
+      if (close == NULL) {
+         return -1;
+      }
+      u->host.p = p + 1;
+      u->host.len = close - p - 1;
+      p = close + 1;
+   }
+   else {
+      u->host.p = p;
+      while (p < end && *p != ':') {
+         p++;
+      }
+      u->host.len = p - u->host.p;
+   }
+   if (p < end) {
+      if (*p++ != ':') {
+         return -1;
+      }
+      if (p < end) { //"host:" alone means the default port
+         int port = 0;
+         for (; p < end; p++) {
+            if (*p < '0' || *p > '9' || (port = port * 10 + (*p - '0')) > 65535) {
+               return -1;
+            }
+         }
+         if (port == 0) {
+            return -1;
+         }
+         u->port = port;
+      }
+   }
+   return u->host.len > 0 ? 0 : -1;
+}
+
+/*
+ * http_split_uri - split an absolute URI (scheme://authority/path) or an
+ * origin-form one (/path, host left empty for the Host header to fill in)
+ */
+int http_split_uri(StrView uri, HttpUri *u) {
+   char *p = uri.p, *end = uri.p + uri.len;
+   char *scheme = NULL;
+   
+   for (char *c = p; c + 2 < end && *c != '/'; c++) { //"://" before the first lone slash
+      if (c[0] == ':' && c[1] == '/' && c[2] == '/') {
+         scheme = c;
+         break;
+      }
+   }
+   u->scheme.p = p;
+   u->scheme.len = scheme != NULL ? scheme - p : 0;
+   u->host.p = p;
+   u->host.len = 0;
+   u->port = 80;
+   if (scheme != NULL) {
+      StrView authority;
+      authority.p = scheme + 3;
+      p = authority.p;
+      while (p < end && *p != '/' && *p != '?' && *p != '#') {
+         p++;
+      }
+      authority.len = p - authority.p;
+      if (http_split_host(authority, u) < 0) {
+         return -1;
+      }
+   }
+   else if (p == end || *p != '/') {
+      return -1;
+   }
+   
+   u->path.p = p;
+   while (p < end && *p != '#') { //the fragment is the client's business only
+      p++;
+   }
+   u->path.len = p - u->path.p;
+   if (u->path.len == 0) { //"http://host" asks for /
+      u->path.p = root_path;
+      u->path.len = 1;
+   }
+   else if (*u->path.p != '/') { //"http://host?q", no path to hang the query on
+      return -1;
+   }
+   return 0;
+}
@@ -0,0 +1,56 @@
+/*
+ * httpreq.h - single pass, resumable HTTP request parser
+ */
+#ifndef __HTTPREQ_H__
+#define __HTTPREQ_H__
+
+#include <stddef.h>
+#include "csapp.h"
+
+#define REQ_MAX_HEADERS 64 //header lines a request may have
+#define REQ_PARTIAL 0 //httpreq_parse needs more bytes
+#define REQ_ERROR -1 //httpreq_parse found something that isn't a request
+
+#define REQ_LINE 0 //parser states, waiting on the request line
+#define REQ_HEADERS 1 //waiting on header lines
+#define REQ_DONE 2 //the blank line has been seen
+
+/* Bytes inside the caller's buffer, not NUL terminated */
+typedef struct {
+   char *p; //first byte
+   size_t len; //number of bytes
+} StrView;
+
+typedef struct {
+   StrView name; //as sent
+   StrView value; //without the blanks around it
+   StrView line; //the whole line as sent, line ending included
+} HttpHeader;
+
+typedef struct {
+   int state; //REQ_LINE, REQ_HEADERS or REQ_DONE
+   size_t pos; //bytes of the buffer already parsed, always at a line start
+   StrView method; //request line, split on blanks
+   StrView uri;
+   StrView version; //empty for an HTTP/0.9 style request line
+   HttpHeader headers[REQ_MAX_HEADERS]; //in the order they came
+   int nheaders;
+   size_t header_start; //offset of the first header line
+   size_t header_end; //offset just past the blank line
+} HttpRequest;
+
+typedef struct {
+   StrView scheme; //before the ://, empty for an origin-form URI
+   StrView host; //without brackets around an IPv6 literal
+   int port; //80 unless the URI said otherwise
+   StrView path; //from the first / up to any #, "/" if there was none
+} HttpUri;
+
+void httpreq_init(HttpRequest *req);
+int httpreq_parse(HttpRequest *req, char *buf, size_t len); //header bytes once complete, REQ_PARTIAL or REQ_ERROR
+HttpHeader *httpreq_header(HttpRequest *req, char *name);
+int http_split_uri(StrView uri, HttpUri *u); //-1 if the authority is malformed
+int http_split_host(StrView authority, HttpUri *u);
+int view_is(StrView v, char *s); //case-insensitive compare with a string
+
+#endif /* __HTTPREQ_H__ */
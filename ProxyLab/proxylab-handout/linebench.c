@@ -0,0 +1,151 @@
+/*
+ * linebench.c - microbenchmark for rio_readlineb's buffered line copy
+ *
+ * Fills a file with copies of a typical browser request and response header
+ * block, then times reading it back line by line three ways: the old
+ * rio_readlineb (one rio_read call per byte, reproduced here through
+ * rio_readnb) and the current one, which copies whole lines out of the
+ * buffer; then a plain byte loop against memchr, which rio_readlineb uses
+ * to find each '\n', over the same bytes in memory.
+ *
+ * usage: ./linebench [megabytes]
+ */
+#include "csapp.h"
+
+static char *sample =
+   "GET http://www.example.com/static/js/application.bundle.js?v=20181004 HTTP/1.1\r\n"
+   "Host: www.example.com\r\n"
+   "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:62.0) Gecko/20100101 Firefox/62.0\r\n"
+   "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+   "Accept-Language: en-US,en;q=0.5\r\n"
+   "Accept-Encoding: gzip, deflate\r\n"
+   "Referer: http://www.example.com/index.html\r\n"
+   "Cookie: session=0123456789abcdef0123456789abcdef; theme=dark; tz=America%2FDenver\r\n"
+   "Connection: keep-alive\r\n"
+   "\r\n"
+   "HTTP/1.1 200 OK\r\n"
+   "Date: Thu, 04 Oct 2018 17:32:10 GMT\r\n"
+   "Server: Apache/2.4.29 (Ubuntu)\r\n"
+   "Last-Modified: Mon, 01 Oct 2018 09:12:44 GMT\r\n"
+   "ETag: \"5b3f-57725a8c0a3e0\"\r\n"
+   "Cache-Control: max-age=3600, public\r\n"
+   "Content-Type: application/javascript\r\n"
+   "Content-Length: 23359\r\n"
+   "\r\n";
+
+static double now(void) {
+   struct timeval tv;
+   gettimeofday(&tv, NULL);
+   return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* rio_readlineb as it was, a rio_read call for every byte */
+static ssize_t readline_bytewise(rio_t *rp, char *usrbuf, size_t maxlen) {
+   size_t n;
+   char c, *bufp = usrbuf;
+
+   for (n = 1; n < maxlen; n++) {
+      ssize_t rc = rio_readnb(rp, &c, 1);
+      if (rc == 1) {
+         *bufp++ = c;
+         if (c == '\n') {
+            n++;
+            break;
+         }
+      }
+      else if (rc == 0) {
+         if (n == 1) {
+            return 0;
+         }
+         break;
+      }
+      else {
+         return -1;
+      }
+   }
+   *bufp = 0;
+   return n - 1;
+}
+
+static size_t count_lines(int fd, ssize_t (*readline)(rio_t *, char *, size_t), double *secs) {
+   rio_t rio;
+   char line[MAXLINE];
+   size_t lines = 0;
+
+   lseek(fd, 0, SEEK_SET);
+   Rio_readinitb(&rio, fd);
+   double start = now();
+   while (readline(&rio, line, MAXLINE) > 0) {
+      lines++;
+   }
+   *secs = now() - start;
+   return lines;
+}
+
+static ssize_t readline_current(rio_t *rp, char *usrbuf, size_t maxlen) {
+   return rio_readlineb(rp, usrbuf, maxlen);
+}
+
+static char *findnl_bytewise(char *buf, size_t n) {
+   for (size_t i = 0; i < n; i++) {
+      if (buf[i] == '\n') {
+         return buf + i;
+      }
+   }
+   return NULL;
+}
+
+static char *findnl_memchr(char *buf, size_t n) {
+   return memchr(buf, '\n', n);
+}
+
+static double scan(char *buf, size_t len, char *(*findnl)(char *, size_t), size_t *lines) {
+   double start = now();
+   char *p = buf, *end = buf + len, *nl;
+   *lines = 0;
+   while ((nl = findnl(p, end - p)) != NULL) {
+      (*lines)++;
+      p = nl + 1;
+   }
+   return now() - start;
+}
+
+int main(int argc, char **argv) {
+   size_t mb = argc > 1 ? atoi(argv[1]) : 64;
+   size_t sample_len = strlen(sample);
+   size_t copies = mb * 1024 * 1024 / sample_len;
+   size_t len = copies * sample_len;
+   char path[] = "/tmp/linebench.XXXXXX";
+   double t_old, t_new, t_byte, t_memchr;
+   size_t l_old, l_new, l_byte, l_memchr;
+
+   char *buf = Malloc(len);
+   for (size_t i = 0; i < copies; i++) {
+      memcpy(buf + i * sample_len, sample, sample_len);
+   }
+   int fd = mkstemp(path);
+   if (fd < 0) {
+      unix_error("mkstemp");
+   }
+   unlink(path);
+   Rio_writen(fd, buf, len);
+
+   count_lines(fd, readline_current, &t_new); //warm the page cache
+   l_old = count_lines(fd, readline_bytewise, &t_old);
+   l_new = count_lines(fd, readline_current, &t_new);
+   t_byte = scan(buf, len, findnl_bytewise, &l_byte);
+   t_memchr = scan(buf, len, findnl_memchr, &l_memchr);
+   if (l_old != l_new || l_byte != l_memchr || l_new != l_memchr) {
+      fprintf(stderr, "line counts differ: %zu %zu %zu %zu\n", l_old, l_new, l_byte, l_memchr);
+      exit(1);
+   }
+
+   printf("%zu MB, %zu lines\n", len >> 20, l_new);
+   printf("rio_readlineb, byte at a time  %8.1f MB/s\n", len / t_old / 1e6);
+   printf("rio_readlineb, line copy       %8.1f MB/s  (%.1fx)\n", len / t_new / 1e6, t_old / t_new);
+   printf("find '\\n', byte loop           %8.1f MB/s\n", len / t_byte / 1e6);
+   printf("find '\\n', memchr              %8.1f MB/s  (%.1fx)\n", len / t_memchr / 1e6, t_byte / t_memchr);
+   close(fd);
+   free(buf);
+   return 0;
+}
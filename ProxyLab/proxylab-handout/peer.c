@@ -0,0 +1,201 @@
+/*
+ * peer.c - sibling proxies on one host sharing their caches
+ *
+ * Each proxy started with the same -P list of ports puts every sibling on a
+ * consistent hash ring, so they all agree which one owns a URL. A proxy only
+ * keeps the URLs it owns. For any other URL it asks the owner over UDP
+ * whether the owner has it, in the style of ICP, and then fetches it through
+ * the owner, which caches it on a miss. N siblings together act as one
+ * cache N times the size instead of N copies of the same popular objects.
+ * If the owner doesn't answer, the proxy goes to the server itself, so a
+ * sibling that is down only costs one query timeout.
+ */
+#include <poll.h>
+#include "peer.h"
+
+/* FNV-1a, spread a little more so nearby ports don't land next to each other */
+static uint32_t ring_hash(char *s) {
+   uint32_t h = 2166136261u;
+   while (*s) {
+      h ^= (unsigned char) *s++;
+      h *= 16777619u;
+   }
+   h ^= h >> 15;
+   h *= 0x2c1b3c6du;
+   h ^= h >> 12;
+   return h;
+}
+
+static int point_cmp(const void *a, const void *b) {
+   uint32_t x = ((PeerPoint *) a)->hash, y = ((PeerPoint *) b)->hash;
+   return x < y ? -1 : x > y;
+}
+
+/*
+ * peer_init - read a comma separated list of ports into pg, adding
+ * self_port if it isn't there, build the ring and bind the UDP socket
+ * queries for this proxy come in on.
+ */
+int peer_init(PeerGroup *pg, char *ports, int self_port) {
+   struct sockaddr_in addr;
+   char *p = ports;
+   
+   pg->count = 0;
+   pg->self = -1;
+   while (*p != '\0') {
+      char *end;
+      long port = strtol(p, &end, 10);
+      if (end == p || port <= 0 || port > 65535 || (*end != ',' && *end != '\0') || pg->count == PEER_MAX) {
+         return -1;
+      }
+      if (port == self_port) {
+         pg->self = pg->count;
+      }
+      pg->ports[pg->count++] = port;
+      p = *end == ',' ? end + 1 : end;
+   }
+   if (pg->self < 0) {
+      if (pg->count == PEER_MAX) {
+         return -1;
+      }
+      pg->self = pg->count;
+      pg->ports[pg->count++] = self_port;
+   }
+   
+   pg->points = 0;
+   for (int i = 0; i < pg->count; i++) { //the ring only depends on the ports, so every sibling builds the same one
+      for (int v = 0; v < PEER_VNODES; v++) {
+         char name[32];
+         sprintf(name, "%d#%d", pg->ports[i], v);
+         pg->ring[pg->points].hash = ring_hash(name);
+         pg->ring[pg->points].peer = i;
+         pg->points++;
+      }
+   }
+   qsort(pg->ring, pg->points, sizeof(PeerPoint), point_cmp);
+   
+   if ((pg->fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+      return -1;
+   }
+   memset(&addr, 0, sizeof(addr));
+   addr.sin_family = AF_INET;
+   addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK); //siblings are on this host, nobody else gets to ask
+   addr.sin_port = htons(self_port);
+   if (bind(pg->fd, (SA *) &addr, sizeof(addr)) < 0) {
+      close(pg->fd);
+      return -1;
+   }
+   pg->reqnum = 0;
+   return 0;
+}
+
+/* The sibling owning url: the first point on the ring at or after its hash */
+int peer_owner(PeerGroup *pg, char *url) {
+   uint32_t h = ring_hash(url);
+   int lo = 0, hi = pg->points;
+   
+   while (lo < hi) {
+      int mid = (lo + hi) / 2;
+      if (pg->ring[mid].hash < h) {
+         lo = mid + 1;
+      }
+      else {
+         hi = mid;
+      }
+   }
+   return pg->ring[lo == pg->points ? 0 : lo].peer; //past the last point wraps around to the first
+}
+
+/* Fills buf with a packet carrying key, returns its length or 0 if key won't fit */
+static size_t packet_build(char *buf, int opcode, uint32_t reqnum, char *key) {
+   PeerPacket h;
+   size_t key_len = strlen(key) + 1;
+   
+   if (sizeof(h) + key_len > PEER_PACKET) {
+      return 0;
+   }
+   h.opcode = opcode;
+   h.version = PEER_VERSION;
+   h.length = htons(sizeof(h) + key_len);
+   h.reqnum = htonl(reqnum);
+   memcpy(buf, &h, sizeof(h));
+   memcpy(buf + sizeof(h), key, key_len);
+   return sizeof(h) + key_len;
+}
+
+/* Checks n bytes in buf are a whole packet and unpacks its header into h */
+static int packet_parse(char *buf, ssize_t n, PeerPacket *h) {
+   if (n < (ssize_t) sizeof(PeerPacket) + 1) {
+      return 0;
+   }
+   memcpy(h, buf, sizeof(PeerPacket));
+   h->length = ntohs(h->length);
+   h->reqnum = ntohl(h->reqnum);
+   return h->version == PEER_VERSION && h->length == n && buf[n - 1] == '\0';
+}
+
+/*
+ * peer_query - ask sibling peer whether it has key cached. Each query gets
+ * its own connected socket so workers never read each other's replies, and
+ * a sibling that isn't running comes back as a refused send straight away
+ * rather than a timeout.
+ */
+int peer_query(PeerGroup *pg, int peer, char *key, long timeout_ms) {
+   struct sockaddr_in addr;
+   struct pollfd pfd;
+   char buf[PEER_PACKET];
+   PeerPacket h;
+   int rc = PEER_DOWN;
+   
+   uint32_t reqnum = __sync_add_and_fetch(&pg->reqnum, 1);
+   size_t len = packet_build(buf, PEER_QUERY, reqnum, key);
+   if (len == 0 || (pfd.fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+      return PEER_DOWN;
+   }
+   memset(&addr, 0, sizeof(addr));
+   addr.sin_family = AF_INET;
+   addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+   addr.sin_port = htons(pg->ports[peer]);
+   if (connect(pfd.fd, (SA *) &addr, sizeof(addr)) < 0 || send(pfd.fd, buf, len, 0) < 0) {
+      close(pfd.fd);
+      return PEER_DOWN;
+   }
+   
+   pfd.events = POLLIN;
+   while (poll(&pfd, 1, timeout_ms) > 0) { //a lost reply just times out, the query isn't worth a retry
+      ssize_t n = recv(pfd.fd, buf, sizeof(buf), 0);
+      if (n < 0) { //ICMP port unreachable, nobody is listening
+         break;
+      }
+      if (packet_parse(buf, n, &h) && h.reqnum == reqnum && (h.opcode == PEER_HIT || h.opcode == PEER_MISS)) {
+         rc = h.opcode;
+         break;
+      }
+   }
+   close(pfd.fd);
+   return rc;
+}
+
+/*
+ * peer_serve - answer every query that comes in on pg's socket with
+ * PEER_HIT or PEER_MISS, whichever lookup says. Anything that isn't a well
+ * formed query is dropped.
+ */
+void peer_serve(PeerGroup *pg, peer_lookup_fn *lookup, void *arg) {
+   char buf[PEER_PACKET];
+   struct sockaddr_storage from;
+   PeerPacket h;
+   
+   while (1) {
+      socklen_t from_len = sizeof(from);
+      ssize_t n = recvfrom(pg->fd, buf, sizeof(buf), 0, (SA *) &from, &from_len);
+      if (n < 0 || !packet_parse(buf, n, &h) || h.opcode != PEER_QUERY) {
+         continue;
+      }
+      char *key = buf + sizeof(PeerPacket);
+      int opcode = lookup(key, arg) ? PEER_HIT : PEER_MISS;
+      char reply[PEER_PACKET];
+      size_t len = packet_build(reply, opcode, h.reqnum, key); //echoes the key back like ICP does
+      sendto(pg->fd, reply, len, 0, (SA *) &from, from_len);
+   }
+}
@@ -0,0 +1,54 @@
+/*
+ * peer.h - sibling proxies on one host sharing their caches
+ */
+#ifndef __PEER_H__
+#define __PEER_H__
+
+#include <stdint.h>
+#include "csapp.h"
+
+#define PEER_MAX 16 //sibling proxies, this one included
+#define PEER_VNODES 64 //points each sibling gets on the hash ring, so the URLs split evenly
+#define PEER_TIMEOUT_MS 50 //how long a query waits for the owner before going without it
+#define PEER_PACKET MAXLINE //biggest query or reply, header and key together
+#define PEER_VERSION 2 //of the packet format below
+#define PEER_HEADER "X-Proxy-Peer" //marks a request one sibling sends another, which never goes on to a third
+
+/* Opcodes, numbered as in ICP (RFC 2186) */
+#define PEER_QUERY 1
+#define PEER_HIT 2
+#define PEER_MISS 3
+#define PEER_DOWN -1 //no answer, the owner isn't running
+
+/* Every packet starts with this, in network byte order, and a NUL-terminated key follows */
+typedef struct {
+   uint8_t opcode; //PEER_QUERY, PEER_HIT or PEER_MISS
+   uint8_t version; //PEER_VERSION
+   uint16_t length; //bytes in the packet, this header included
+   uint32_t reqnum; //a reply carries its query's, so a late one isn't mistaken for the next
+} PeerPacket;
+
+/* One point on the consistent hash ring */
+typedef struct {
+   uint32_t hash; //where on the ring
+   int peer; //index of the sibling it belongs to
+} PeerPoint;
+
+typedef struct {
+   int ports[PEER_MAX]; //every sibling's port on 127.0.0.1, TCP for requests and UDP for queries
+   int count; //siblings, this one included
+   int self; //index of this proxy in ports
+   PeerPoint ring[PEER_MAX * PEER_VNODES]; //sorted by hash
+   int points; //entries in ring
+   int fd; //UDP socket this proxy answers queries on
+   uint32_t reqnum; //last query number handed out
+} PeerGroup;
+
+typedef int peer_lookup_fn(char *key, void *arg); //whether key is cached here
+
+int peer_init(PeerGroup *pg, char *ports, int self_port); //-1 if the list is bad or the UDP port is taken
+int peer_owner(PeerGroup *pg, char *url); //index of the sibling url belongs to
+int peer_query(PeerGroup *pg, int peer, char *key, long timeout_ms); //PEER_HIT, PEER_MISS or PEER_DOWN
+void peer_serve(PeerGroup *pg, peer_lookup_fn *lookup, void *arg); //answers queries forever, run it in its own thread
+
+#endif /* __PEER_H__ */
@@ -0,0 +1,263 @@
+/*
+ * prefetch.c - finds the assets an HTML page will make the browser ask for next
+ *
+ * A browser that gets home.html comes straight back for godzilla.gif. With
+ * prefetching on, the proxy reads each HTML page it caches for the things a
+ * browser loads on its own, src= on any tag and href= on <link> (style
+ * sheets, icons), and fetches those into the cache ahead of the browser.
+ * Plain <a href> links are left alone, nothing says they will be followed.
+ *
+ * Only links back to the same host and port are taken, resolved against
+ * the page's path into the origin-form path the proxy would ask the server
+ * for. The scan is a loose one, good enough for finding tags and their
+ * attributes, not an HTML parser.
+ */
+#include "prefetch.h"
+
+/*
+ * html_response - whether a response head is a 200 with an HTML body, the
+ * only kind worth scanning for links
+ */
+int html_response(char *head, size_t head_len) {
+   int status;
+   char *end = head + head_len;
+   char *line = memchr(head, '\n', head_len);
+   
+   if (sscanf(head, "HTTP/%*d.%*d %d", &status) != 1 || status != 200) {
+      return 0;
+   }
+   while (line != NULL && ++line < end && *line != '\r' && *line != '\n') {
+      if (end - line > 13 && !strncasecmp(line, "Content-Type:", 13)) {
+         char *v = line + 13;
+         while (v < end && (*v == ' ' || *v == '\t')) {
+            v++;
+         }
+         return end - v >= 9 && !strncasecmp(v, "text/html", 9);
+      }
+      line = memchr(line, '\n', end - line);
+   }
+   return 0;
+}
+
+/* Removes "." and ".." segments from the path in buf, in place (RFC 3986 5.2.4) */
+static void remove_dots(char *buf) {
+   char *query = strchr(buf, '?');
+   char *in = buf, *out = buf;
+   size_t len = query != NULL ? (size_t) (query - buf) : strlen(buf);
+   char *end = buf + len;
+   
+   while (in < end) {
+      char *seg_end = memchr(in + 1, '/', end - in - 1); //in always sits on a '/'
+      if (seg_end == NULL) {
+         seg_end = end;
+      }
+      size_t seg = seg_end - in;
+      if (seg == 2 && in[1] == '.') { //"/."
+         if (seg_end == end) {
+            *out++ = '/';
+         }
+      }
+      else if (seg == 3 && in[1] == '.' && in[2] == '.') { //"/..", back up over the last segment written
+         while (out > buf && *--out != '/') {
+         }
+         if (seg_end == end) {
+            *out++ = '/';
+         }
+      }
+      else {
+         memmove(out, in, seg);
+         out += seg;
+      }
+      in = seg_end;
+   }
+   if (out == buf) {
+      *out++ = '/';
+   }
+   memmove(out, end, strlen(end) + 1); //the query, and the NUL
+}
+
+/*
+ * resolve_link - turn link, as written in a page fetched from page, into the
+ * origin-form path to request, in path. Returns -1 for links to another
+ * host, another scheme, or just a fragment, or if it won't fit in cap bytes.
+ */
+int resolve_link(char *link, size_t len, HttpUri *page, char *path, size_t cap) {
+   char *hash = memchr(link, '#', len);
+   if (hash != NULL) { //the fragment never goes to a server
+      len = hash - link;
+   }
+   if (len == 0) {
+      return -1;
+   }
+   
+   if (len >= 2 && link[0] == '/' && link[1] == '/') { //scheme-relative, same scheme as the page: http
+      link += 2;
+      len -= 2;
+   }
+   else if (len > 7 && !strncasecmp(link, "http://", 7)) {
+      link += 7;
+      len -= 7;
+   }
+   else {
+      for (size_t i = 0; i < len && link[i] != '/' && link[i] != '?'; i++) {
+         if (link[i] == ':') { //https:, mailto:, javascript:, data:
+            return -1;
+         }
+      }
+      if (link[0] == '/') { //absolute path
+         if (len >= cap) {
+            return -1;
+         }
+         memcpy(path, link, len);
+         path[len] = '\0';
+         remove_dots(path);
+         return 0;
+      }
+      //relative to the page's directory
+      size_t dir = page->path.len;
+      char *q = memchr(page->path.p, '?', page->path.len);
+      if (q != NULL) {
+         dir = q - page->path.p;
+      }
+      while (dir > 0 && page->path.p[dir - 1] != '/') {
+         dir--;
+      }
+      if (dir + len >= cap) {
+         return -1;
+      }
+      memcpy(path, page->path.p, dir);
+      memcpy(path + dir, link, len);
+      path[dir + len] = '\0';
+      remove_dots(path);
+      return 0;
+   }
+   
+   //had an authority, it has to be the page's own
+   HttpUri u;
+   size_t auth = 0;
+   while (auth < len && link[auth] != '/' && link[auth] != '?') {
+      auth++;
+   }
+   StrView authority = {link, auth};
+   if (http_split_host(authority, &u) < 0 || u.port != page->port || u.host.len != page->host.len ||
+       strncasecmp(u.host.p, page->host.p, u.host.len)) {
+      return -1;
+   }
+   if (auth == len) { //"http://host" is "/"
+      link = "/";
+      auth = 0;
+      len = 1;
+   }
+   else if (link[auth] == '?') {
+      return -1;
+   }
+   if (len - auth >= cap) {
+      return -1;
+   }
+   memcpy(path, link + auth, len - auth);
+   path[len - auth] = '\0';
+   remove_dots(path);
+   return 0;
+}
+
+static int is_space(char c) {
+   return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\f';
+}
+
+/*
+ * html_links - scan html, fetched from page, for assets a browser would load
+ * with it, and call fn with the path of each different same-origin one, up
+ * to max of them. Returns how many fn was called for.
+ */
+int html_links(char *html, size_t len, HttpUri *page, int max, link_fn *fn, void *arg) {
+   char *p = html, *end = html + len;
+   char path[MAXLINE];
+   unsigned int seen[max > 0 ? max : 1]; //hashes of the paths handed out, a page often repeats an image
+   int found = 0;
+   
+   while (found < max && (p = memchr(p, '<', end - p)) != NULL) {
+      p++;
+      if (end - p >= 3 && !strncmp(p, "!--", 3)) { //comment, skip it whole
+         for (p += 3; p + 2 < end && (p[0] != '-' || p[1] != '-' || p[2] != '>'); p++) {
+         }
+         p += 3;
+         if (p >= end) {
+            break;
+         }
+         continue;
+      }
+      char *tag = p;
+      while (p < end && isalnum((unsigned char) *p)) {
+         p++;
+      }
+      size_t tag_len = p - tag;
+      if (tag_len == 0) { //"</x>", "<!DOCTYPE" and stray '<'s
+         continue;
+      }
+      int is_link = tag_len == 4 && !strncasecmp(tag, "link", 4);
+      
+      while (p < end && *p != '>') { //each attribute of the tag
+         while (p < end && (is_space(*p) || *p == '/')) {
+            p++;
+         }
+         char *name = p;
+         while (p < end && !is_space(*p) && *p != '=' && *p != '>' && *p != '/') {
+            p++;
+         }
+         size_t name_len = p - name;
+         while (p < end && is_space(*p)) {
+            p++;
+         }
+         if (p == end || *p != '=') { //no value
+            if (name_len == 0 && p < end && *p != '>') {
+               p++; //something odd, step over it
+            }
+            continue;
+         }
+         p++;
+         while (p < end && is_space(*p)) {
+            p++;
+         }
+         char *value = p;
+         size_t value_len;
+         if (p < end && (*p == '"' || *p == '\'')) {
+            char *close = memchr(p + 1, *p, end - p - 1);
+            if (close == NULL) {
+               return found;
+            }
+            value = p + 1;
+            value_len = close - value;
+            p = close + 1;
+         }
+         else {
+            while (p < end && !is_space(*p) && *p != '>') {
+               p++;
+            }
+            value_len = p - value;
+         }
+         
+         int wanted = (name_len == 3 && !strncasecmp(name, "src", 3)) ||
+                      (is_link && name_len == 4 && !strncasecmp(name, "href", 4));
+         while (value_len > 0 && is_space(*value)) {
+            value++;
+            value_len--;
+         }
+         if (!wanted || found >= max || resolve_link(value, value_len, page, path, sizeof(path)) < 0) {
+            continue;
+         }
+         unsigned int h = 5381;
+         for (char *c = path; *c; c++) {
+            h = h * 33 + (unsigned char) *c;
+         }
+         int dup = 0;
+         for (int i = 0; i < found; i++) {
+            dup |= seen[i] == h;
+         }
+         if (!dup) {
+            seen[found++] = h;
+            fn(path, arg);
+         }
+      }
+   }
+   return found;
+}
@@ -0,0 +1,18 @@
+/*
+ * prefetch.h - finds the assets an HTML page will make the browser ask for next
+ */
+#ifndef __PREFETCH_H__
+#define __PREFETCH_H__
+
+#include "csapp.h"
+#include "httpreq.h"
+
+#define PREFETCH_PER_PAGE 8 //links taken from one page at most
+
+typedef void link_fn(char *path, void *arg);
+
+int html_response(char *head, size_t head_len); //a 200 with Content-Type text/html
+int html_links(char *html, size_t len, HttpUri *page, int max, link_fn *fn, void *arg); //links passed to fn
+int resolve_link(char *link, size_t len, HttpUri *page, char *path, size_t cap); //-1 unless same origin
+
+#endif /* __PREFETCH_H__ */
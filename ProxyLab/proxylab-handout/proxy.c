@@ -1,20 +1,47 @@
 #include <stdio.h>
-#include <assert.h>
+#include <getopt.h>
+#include <sys/uio.h>
+#include <sys/prctl.h>
 #include "csapp.h"
+#include "diskcache.h"
+#include "snapshot.h"
+#include "freshness.h"
+#include "bodystore.h"
+#include "encoding.h"
+#include "httpreq.h"
+#include "tunnel.h"
+#include "ratelimit.h"
+#include "upstream.h"
+#include "prefetch.h"
+#include "range.h"
+#include "peer.h"
+#include "shmcache.h"
+#include "cachelist.h"
+#include "reqtrace.h"
 
-/* Recommended max cache and object sizes */
-#define MAX_CACHE_SIZE 1049000
-#define MAX_OBJECT_SIZE 102400
 #define DEST_PORT_SIZE 100
-#define SBUFSIZE 16 //size of buffer with conn descriptors
+#define SBUFSIZE 128 //size of buffer with conn descriptors, QUEUE_TARGET_MS sheds load well before it fills
 #define NTHREADS 4 //number of worker threads
+#define QUEUE_TARGET_MS 250 //longest a connection should wait for a worker before new ones get a 503
 #define CBUFSIZE 32 //size of log buffer
+#define DBUFSIZE 64 //size of the queue of objects waiting to be written to disk
+#define PBUFSIZE 32 //size of the queue of URLs waiting to be prefetched, more are dropped
+#define PREFETCH_BUDGET (MAX_CACHE_SIZE / 4) //bytes prefetching may pull into the cache per minute
+#define VARY_BUCKETS 256 //buckets in the table of URLs whose responses carry Vary
+#define MAX_COMPRESS_SIZE (4*MAX_OBJECT_SIZE) //biggest response -z will try to gzip into the memory cache
+#define REQUEST_IOV (2*REQ_MAX_HEADERS + 16) //iovec slots for a request to a server
+#define CONNECT_TIMEOUT_MS 5000 //default for how long a server gets to accept a connection
+#define FIRST_BYTE_TIMEOUT_MS 30000 //default for how long a server gets to start answering
+#define IDLE_TIMEOUT_MS 30000 //default for how long a server may go quiet partway through an answer
+#define HEDGE_MIN_MS 20 //never hedge sooner than this, however fast the p95 is
+#define VARY_MAX 4096 //URLs the Vary table will remember before it stops caching new Vary responses
 
 FILE *fp; //File that logging thread writes to
 pthread_rwlock_t lock; //lock that will protect my cache for readers and writers
 
 typedef struct {
    int *buf; //Buffer array
+   long *stamps; //when each item was inserted, ms on the monotonic clock
    int n; //Maximum number of slots
    int front; //buf[front+1%n] is first item
    int rear; //buf[rear%n] is last item
@@ -33,47 +60,106 @@ typedef struct {
    sem_t items; //Counts abailable items
 } charlog_t;
 
-typedef struct CachedItem CachedItem;
-struct CachedItem {
-   char url[MAXLINE]; //holds the cached URL
-   void *item_p; //holds a pointer the cached item
-   size_t size; //size of the item
-   CachedItem *prev; //pointer to previous item
-   CachedItem *next; //pointer to next item
-};
+typedef struct {
+   char *key; //request line the object is cached under
+   void *item; //body to write, freed once it is on disk
+   size_t size; //size of the body
+   time_t stored; //when the body came back from the server
+} DiskJob;
+
+typedef struct {
+   DiskJob *jobs; //Pending disk writes
+   int n;  //Maximum number of slots
+   int front; //buf[front+1%n] is first item
+   int rear; //buf[rear%n] is last item
+   sem_t mutex; //Protects accesses to buf
+   sem_t slots; //Counts abailable slots
+   sem_t items; //Counts abailable items
+} demote_t;
 
+/* The request for a server as slices of the client's buffer and constant
+ strings, sent with one writev */
 typedef struct {
-   size_t size; //size of the entire Cache
-   CachedItem *first; //pointer to the first item most used
-   CachedItem *last; //pointer to the last item and least used
-} CacheList;
+   struct iovec iov[REQUEST_IOV]; //slices in the order they go out
+   int n; //slices used
+   char port[16]; //":port" for a Host header the proxy writes itself
+} UpstreamRequest;
+
+/* Remembers which request headers a URL's response varies on, so the cache
+ key for the next request can include their values before anything is fetched */
+typedef struct VaryEntry VaryEntry;
+struct VaryEntry {
+   char *url; //canonical URL the Vary header came back for
+   char *headers; //lowercased header names from Vary, comma separated
+   VaryEntry *next; //next entry in the same bucket
+};
 
-void interrupt_handler(int); //for when the user clicks Ctrl-c
 void sbuf_init(sbuf_t *sp, int n);
 void sbuf_deinit(sbuf_t *sp);
 void sbuf_insert(sbuf_t *sp, int item);
+int sbuf_tryinsert(sbuf_t *sp, int item);
 int sbuf_remove(sbuf_t *sp);
+long sbuf_waited(sbuf_t *sp);
+long monotonic_ms(void);
 
 void charlog_init(charlog_t *sp, int n);
 void charlog_deinit(charlog_t *sp);
 void charlog_insert(charlog_t *sp, char *item);
+int charlog_tryinsert(charlog_t *sp, char *item);
 char *charlog_remove(charlog_t *sp);
 
+void demote_init(demote_t *sp, int n);
+void demote_deinit(demote_t *sp);
+int demote_tryinsert(demote_t *sp, char *key, void *item, size_t size, time_t stored);
+DiskJob demote_remove(demote_t *sp);
+
 /* You won't lose style points for including this long line in your code */
 static const char *user_agent_hdr = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
 void http_proxy(int connfd);
-void parse_uri(char *uri, char *hostname, char *path, int *port);
-void build_http_request(char *http_header, char *hostname, char *path, int port, rio_t *rio_client);
+void proxy_error(int connfd, char *status, char *msg);
+void turn_away(int connfd, char *status);
+char *relay_response(rio_t *rio_server, int connfd, char *status_line, size_t status_len, size_t *total);
+size_t read_headers(rio_t *rio_server, char *first, size_t first_len, char *headers, size_t cap);
+void store_response(char *url, char *client_headers, char *object, size_t size, time_t stored, int scan);
+int stale_allowed(char *item, size_t size);
+void queue_prefetch(char *path, void *arg);
+void *prefetchthread(void *vargp);
+void refresh_response(char *key, char *headers, size_t headers_len, char *body, size_t size);
+void serve_item(int connfd, char *item, size_t size);
+void serve_response(int connfd, char *item, size_t size, char *client_headers);
+int serve_range(int connfd, char *head, size_t head_len, char *body, size_t body_len, char *client_headers);
+void serve_cached(int connfd, Body *head, Body *body, size_t raw_size, int gzip_ok);
+void serve_parts(int connfd, char *head, size_t head_len, char *body, size_t body_len);
+int writev_all(int fd, struct iovec *iov, int n);
+size_t compress_response(char **object, size_t *size);
+void *revalidatethread(void *vargp);
+int fetch_upstream(char *hostname, char *port, struct iovec *iov, int n, int hedge);
+int read_status(rio_t *rio_server, char *status_line, ssize_t *status_len);
+int read_request(int connfd, HttpRequest *req, char *buf, size_t cap, size_t *extra);
+void connect_tunnel(int connfd, HttpRequest *req, char *early, size_t early_len);
+void tunnel_closed(Tunnel *t, char *why, void *arg);
+void build_http_request(UpstreamRequest *out, HttpUri *target, HttpRequest *req, char *extra_headers, int ranged);
+int header_value(char *headers, char *name, char *value, size_t len);
+void canonical_url(char *url, StrView host, int port, StrView path);
+int cache_key(char *key, char *url, char *client_headers);
+int vary_find(char *url, char *names);
+void vary_set(char *url, char *vary);
 void *thread(void *vargp);
 void *loggingthread(void *vargp);
+void *diskthread(void *vargp);
+void *snapshotthread(void *vargp);
+void *tunnelthread(void *vargp);
+void *peerthread(void *vargp);
+void *tracethread(void *vargp);
+void *interruptthread(void *vargp); //for when the user clicks Ctrl-c
+void prefork(int workers);
+int peer_cached(char *key, void *arg);
 
-void cache_init(CacheList *list);
-void cache_URL(char *URL, void *item, size_t size, CacheList *list);
-void evict(CacheList *list);
-CachedItem *find(char *URL, CacheList *list);
-void move_to_front(char *URL, CacheList *list);
+void conditional_headers(char *etag, char *last_modified, char *headers);
 void print_URLs(CacheList *list);
-void cache_destruct(CacheList *list);
+void demote(CachedItem *item, void *arg);
+int cache_snapshot(CacheList *list, char *path);
+void cache_restore(char *URL, void *item, size_t size, time_t stored, void *arg);
 
 /* Pthread reader writer lock wrapper functions likes */
 int Pthread_rwlock_init(pthread_rwlock_t *rwlock, const pthread_rwlockattr_t *attr); //initiate lock
@@ -85,6 +171,7 @@ int Pthread_rwlock_destroy(pthread_rwlock_t *rwlock); //destroys read-write lock
 /* Create an empty, bounded, shared FIFO buffer with n slots */
 void sbuf_init(sbuf_t *sp, int n) {
    sp->buf = Calloc(n, sizeof(int));
+   sp->stamps = Calloc(n, sizeof(long));
    sp->n = n;                    /* Buffer holds max of n items */
    sp->front = sp->rear = 0;     /* Empty buffer iff front == rear */
    Sem_init(&sp->mutex, 0, 1);   /* Binary semaphore for locking */
@@ -95,6 +182,7 @@ void sbuf_init(sbuf_t *sp, int n) {
 /* Clean up buffer sp */
 void sbuf_deinit(sbuf_t *sp) {
    Free(sp->buf);
+   Free(sp->stamps);
 }
 
 /* Insert item onto the rear of shared buffer sp */
@@ -103,8 +191,23 @@ void sbuf_insert(sbuf_t *sp, int item) {
    P(&sp->mutex);                         /* Lock the buffer */
    sp->rear = (sp->rear + 1) % sp->n;     /* Resets the rear so no overflow */
    sp->buf[sp->rear] = item;            /* Inserts the item */
+   sp->stamps[sp->rear] = monotonic_ms();
+   V(&sp->mutex);                         /* Unlock the buffer */
+   V(&sp->items);                         /* Announce available item */
+}
+
+/* Insert item onto the rear of sp if there is room, 0 if there wasn't */
+int sbuf_tryinsert(sbuf_t *sp, int item) {
+   if (sem_trywait(&sp->slots) < 0) {     /* No free slot, caller keeps the item */
+      return 0;
+   }
+   P(&sp->mutex);                         /* Lock the buffer */
+   sp->rear = (sp->rear + 1) % sp->n;     /* Resets the rear so no overflow */
+   sp->buf[sp->rear] = item;              /* Inserts the item */
+   sp->stamps[sp->rear] = monotonic_ms();
    V(&sp->mutex);                         /* Unlock the buffer */
    V(&sp->items);                         /* Announce available item */
+   return 1;
 }
 
 /* Remove and return the first item from buffer sp */
@@ -119,6 +222,24 @@ int sbuf_remove(sbuf_t *sp) {
    return item;
 }
 
+/* How long, in ms, the oldest item in sp has been waiting. 0 if sp is empty. */
+long sbuf_waited(sbuf_t *sp) {
+   long waited = 0;
+   P(&sp->mutex);
+   if (sp->front != sp->rear) {
+      waited = monotonic_ms() - sp->stamps[(sp->front + 1) % sp->n];
+   }
+   V(&sp->mutex);
+   return waited;
+}
+
+/* Milliseconds on a clock that only goes forward, for measuring waits */
+long monotonic_ms(void) {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
 /* Create an empty, bounded, shared FIFO buffer with n slots */
 void charlog_init(charlog_t *sp, int n) {
    sp->logs = Calloc(n, sizeof(char **));
@@ -144,6 +265,19 @@ void charlog_insert(charlog_t *sp, char *item) {
    V(&sp->items);                         /* Announce available item */
 }
 
+/* Insert item onto the rear of sp if there is room, 0 if there wasn't */
+int charlog_tryinsert(charlog_t *sp, char *item) {
+   if (sem_trywait(&sp->slots) < 0) {     /* No free slot, caller keeps the item */
+      return 0;
+   }
+   P(&sp->mutex);                         /* Lock the buffer */
+   sp->rear = (sp->rear + 1) % sp->n;     /* Resets the rear so no overflow */
+   sp->logs[sp->rear] = item;             /* Inserts the item */
+   V(&sp->mutex);                         /* Unlock the buffer */
+   V(&sp->items);                         /* Announce available item */
+   return 1;
+}
+
 /* Remove and return the first item from buffer sp */
 char *charlog_remove(charlog_t *sp) {
    char *item;
@@ -156,133 +290,94 @@ char *charlog_remove(charlog_t *sp) {
    return item;
 }
 
-void cache_init(CacheList *list) {
-   list->size = 0;
-   list->first = NULL;
-   list->last = NULL;
+/* Create an empty, bounded, shared FIFO queue of disk writes with n slots */
+void demote_init(demote_t *sp, int n) {
+   sp->jobs = Calloc(n, sizeof(DiskJob));
+   sp->n = n;                    /* Buffer holds max of n items */
+   sp->front = sp->rear = 0;     /* Empty buffer iff front == rear */
+   Sem_init(&sp->mutex, 0, 1);   /* Binary semaphore for locking */
+   Sem_init(&sp->slots, 0, n);   /* Initially, buf has n empty slots */
+   Sem_init(&sp->items, 0, 0);   /* Initially, buf has 0 items */
 }
 
-void cache_URL(char *URL, void *item, size_t size, CacheList *list) {
-   if (size > MAX_OBJECT_SIZE) {
-      return; //can't hold something this big in the cache
-   }
-   
-   /* check to see if there is space in the cache if there isn't any
-    start evicting till there is space for the new thing */
-   while ((list->size + size) > MAX_CACHE_SIZE) {
-      evict(list);
-   }
-   list->size += size; //add the new object size to the total size of the cache
-   
-   CachedItem *cached_item = (CachedItem*) Malloc(sizeof(struct CachedItem)); //make room for a new item
-   strcpy(cached_item->url, URL); //copy URL into the cached_item's url
-   cached_item->item_p = item; //store what itemp is
-   cached_item->size = size; //store size of item
-   
-   
-   /* If the list is empty store first and last item as item just added */
-   if (list->first == NULL) {
-      list->first = cached_item;
-      list->last = cached_item;
-   }
-   
-   else { //the list isn't empty so put at the front
-      list->first->prev = cached_item;
-      cached_item->next = list->first;
-      cached_item->prev = NULL;
-      list->first = cached_item;
-   }
-   
-   return;
+/* Clean up buffer sp */
+void demote_deinit(demote_t *sp) {
+   Free(sp->jobs);
 }
 
-void evict(CacheList *list) { //evicts based off of a LRU policy
-   assert(list->size > 0); //should be so we can get rid of stuff
-   assert(list->first != NULL); //same check that the list isn't empty
-   assert(list->last != NULL); //same check that the list isn't empty
-   
-   if (list->last->size == list->size) { //there is only one thing in the list taking up whole thing
-      free(list->last->item_p);
-      free(list->last);
-      list->last = NULL;
-      list->first = NULL;
-      list->size = 0;
-      return;
+/* Queue a disk write without blocking, returns 0 if the queue is full. Called
+ with the cache write lock held so it must never wait for the disk thread. */
+int demote_tryinsert(demote_t *sp, char *key, void *item, size_t size, time_t stored) {
+   if (sem_trywait(&sp->slots) < 0) {     /* No free slot, caller keeps the item */
+      return 0;
    }
-   
-   assert(list->last != list->first); //this checks to make sure that last and first aren't equal
-   
-   //move new list around
-   list->last = list->last->prev;
-   list->size -= list->last->next->size;
-   free(list->last->next->item_p);
-   free(list->last->next);
-   list->last->next = NULL;
-   return;
+   P(&sp->mutex);                         /* Lock the buffer */
+   sp->rear = (sp->rear + 1) % sp->n;     /* Resets the rear so no overflow */
+   sp->jobs[sp->rear].key = strdup(key);  /* Inserts the item */
+   sp->jobs[sp->rear].item = item;
+   sp->jobs[sp->rear].size = size;
+   sp->jobs[sp->rear].stored = stored;
+   V(&sp->mutex);                         /* Unlock the buffer */
+   V(&sp->items);                         /* Announce available item */
+   return 1;
 }
 
-CachedItem *find(char *URL, CacheList *list) {
-   
-   if (list->size > 0) { //contains something
-      if (strcmp(list->first->url, URL) == 0){
-         return list->first;
-      }
-      //Check if the last item in list is it
-      if (strcmp(list->last->url, URL) == 0){
-         return list->last;
-      }
-      
-      CachedItem *temp = list->first;
-      while (temp->next != NULL){ //Iterate through list till item is found
-         if (strcmp(temp->url, URL) != 0){
-            temp = temp->next;
-         }
-         else{
-            return temp;
-         }
-      }
-   }
-   return NULL; //list was empty
+/* Remove and return the first job from buffer sp */
+DiskJob demote_remove(demote_t *sp) {
+   DiskJob job;
+   P(&sp->items);                         /* Wait for available item */
+   P(&sp->mutex);                         /* Lock the buffer */
+   sp->front = (sp->front + 1) % sp->n;   /* Resets the front so no overflow */
+   job = sp->jobs[sp->front];             /* Remove the item */
+   V(&sp->mutex);                         /* Unlock the buffer */
+   V(&sp->slots);                         /* Announce available slot */
+   return job;
 }
 
-void move_to_front(char *URL, CacheList *list){
-   CachedItem *item = find(URL, list);
-   
-   if (item == NULL) { //didn't find the item
-      return;
+/* Fills headers with the If-None-Match/If-Modified-Since lines for a stale
+ copy, empty if it has no validators */
+void conditional_headers(char *etag, char *last_modified, char *headers) {
+   headers[0] = '\0';
+   if (etag[0] != '\0') {
+      sprintf(headers, "If-None-Match: %s\r\n", etag);
    }
-   
-   if (item == list->first) { //item is already at the front
-      return;
-   }
-   
-   if (item == list->last) { //item is a the end move to front
-      list->last = item->prev;
-      list->first->prev = item;
-      item->next = list->first;
-      item->prev = NULL;
-      list->last->next = NULL;
-      list->first = item;
-      return;
-   }
-   else { //item is in the middle move to front and fix pointers
-      item->prev->next = item->next;
-      item->next->prev = item->prev;
-      item->prev = NULL;
-      item->next = list->first;
-      list->first->prev = item;
-      list->first = item;
-      return;
+   if (last_modified[0] != '\0') {
+      sprintf(headers + strlen(headers), "If-Modified-Since: %s\r\n", last_modified);
    }
-   
 }
 
 charlog_t c_log; /* Shared buffer of chars for print statements */
 sbuf_t sbuf; /* Shared buffer of connected descriptors */
+sem_t stopped; /* Posted by each worker thread as it stops for ctrl-c */
 CacheList *CACHE_LIST; //holds my cache
+demote_t d_queue; /* Shared buffer of objects on their way to disk */
+charlog_t r_queue; /* Shared buffer of keys waiting for a background revalidation */
+charlog_t p_queue; /* Shared buffer of URLs waiting to be prefetched */
+int PREFETCH_MODE; //-p, fetch what cached HTML pages link to before the browser asks
+DiskCache *DISK_CACHE; //second tier behind CACHE_LIST, NULL when there is no cache dir
+RateTable *RATE_TABLE; //per client token buckets, NULL unless -r was given
+long CONNECT_TIMEOUT = CONNECT_TIMEOUT_MS; //-t, ms a server gets to accept
+long FIRST_BYTE_TIMEOUT = FIRST_BYTE_TIMEOUT_MS; //-t, ms a server gets to start answering
+long IDLE_TIMEOUT = IDLE_TIMEOUT_MS; //-t, ms a server may stall mid-answer
+int HEDGE_MODE; //-H, hedge GETs that take longer than most
+LatencyLog LATENCY; //recent first byte times, for the hedge delay
+PeerGroup *PEERS; //-P, sibling proxies sharing the cache, NULL when this one runs alone
+ShmCache *SHARED_CACHE; //-w, the memory cache every worker process shares, NULL with just one process
+char *TRACE_PATH; //-T, where sampled request traces are written, NULL when tracing is off
+
+/* CacheList eviction callback, hands a copy of the item to the disk thread */
+void demote(CachedItem *item, void *arg) {
+   if (DISK_CACHE == NULL) {
+      return;
+   }
+   char *copy = item_copy(item);
+   if (!demote_tryinsert(&d_queue, item->url, copy, item->size, item->stored)) {
+      free(copy); //queue is full, the disk tier misses out on this one
+   }
+}
 
 void print_URLs(CacheList *list){ //used to print the contents of the cache
-   if (list->size > 0) {
+   if (list->first != NULL) {
       CachedItem *item = list->first;
       while (item->next != NULL){
          
@@ -299,10 +394,182 @@ void print_URLs(CacheList *list){ //used to print the contents of the cache
    }
 }
 
-void cache_destruct(CacheList *list){
-   while (list->size != 0) { //keep evicting all of the items out to clean cache
-      evict(list);
+VaryEntry *VARY_TABLE[VARY_BUCKETS]; //URLs whose responses carried Vary, guarded by the cache lock, unused under -w
+int VARY_COUNT; //entries in VARY_TABLE
+
+static unsigned int hash_string(char *str) {
+   unsigned int h = 2166136261u; //FNV-1a
+   while (*str) {
+      h ^= (unsigned char) *str++;
+      h *= 16777619u;
+   }
+   return h;
+}
+
+/* Copies the Vary header names recorded for url into names (VALIDATOR_LEN
+ bytes), 0 if its responses don't vary. Under -w the names live in the
+ shared segment, so every worker builds the same keys. Caller holds the
+ cache lock. */
+int vary_find(char *url, char *names) {
+   if (SHARED_CACHE != NULL) {
+      return shmcache_vary_get(SHARED_CACHE, url, names);
+   }
+   VaryEntry *e = VARY_TABLE[hash_string(url) % VARY_BUCKETS];
+   while (e != NULL && strcmp(e->url, url) != 0) {
+      e = e->next;
+   }
+   if (e == NULL) {
+      return 0;
+   }
+   strcpy(names, e->headers);
+   return 1;
+}
+
+/* Records the header names in vary (as sent, any case or spacing) for url,
+ or forgets url if vary is empty. Caller holds the write lock. */
+void vary_set(char *url, char *vary) {
+   char names[VALIDATOR_LEN];
+   int n = 0;
+   
+   for (char *c = vary; *c != '\0' && n < (int) sizeof(names) - 1; c++) { //lowercase and drop blanks
+      if (*c != ' ' && *c != '\t') {
+         names[n++] = tolower((unsigned char) *c);
+      }
+   }
+   names[n] = '\0';
+   
+   if (SHARED_CACHE != NULL) {
+      shmcache_vary_set(SHARED_CACHE, url, names);
+      return;
+   }
+   unsigned int b = hash_string(url) % VARY_BUCKETS;
+   VaryEntry **ep = &VARY_TABLE[b];
+   while (*ep != NULL && strcmp((*ep)->url, url) != 0) {
+      ep = &(*ep)->next;
+   }
+   VaryEntry *e = *ep;
+   if (n == 0) { //doesn't vary (any more), plain URL keys from now on
+      if (e != NULL) {
+         *ep = e->next;
+         free(e->url);
+         free(e->headers);
+         free(e);
+         VARY_COUNT--;
+      }
+      return;
+   }
+   if (e == NULL) {
+      if (VARY_COUNT >= VARY_MAX) {
+         return;
+      }
+      e = Malloc(sizeof(VaryEntry));
+      e->url = strdup(url);
+      e->headers = NULL;
+      e->next = VARY_TABLE[b];
+      VARY_TABLE[b] = e;
+      VARY_COUNT++;
+   }
+   free(e->headers);
+   e->headers = strdup(names);
+}
+
+/*
+ * cache_key - the key a request for url is cached under. It's just url
+ * unless url's responses carry Vary, then a CRLF and one "name: value"
+ * line per varying header follow, values lowercased with blanks dropped so
+ * "gzip, deflate" and "gzip,deflate" share an entry. The lines are real
+ * request headers so the revalidation thread can send them upstream as is.
+ * Caller holds the cache lock. Returns -1 if the key won't fit in MAXLINE.
+ */
+int cache_key(char *key, char *url, char *client_headers) {
+   char names[VALIDATOR_LEN], value[MAXLINE];
+   char *name, *save;
+   size_t len = strlen(url);
+   
+   if (len >= MAXLINE) {
+      return -1;
+   }
+   strcpy(key, url);
+   if (!vary_find(url, names)) {
+      return 0;
+   }
+   
+   strcpy(key + len, "\r\n");
+   len += 2;
+   for (name = strtok_r(names, ",", &save); name != NULL; name = strtok_r(NULL, ",", &save)) {
+      int n = 0;
+      if (header_value(client_headers, name, value, sizeof(value))) {
+         for (char *c = value; *c != '\0'; c++) {
+            if (*c != ' ' && *c != '\t') {
+               value[n++] = tolower((unsigned char) *c);
+            }
+         }
+      }
+      value[n] = '\0';
+      if (len + strlen(name) + n + 5 >= MAXLINE) {
+         return -1;
+      }
+      len += sprintf(key + len, "%s: %s\r\n", name, value);
+   }
+   return 0;
+}
+
+/* The scheme, lowercased host, port and path http_split_uri found, so the
+ request line's HTTP version, an explicit :80 and host case don't split the
+ cache. The caller makes sure host and path fit in MAXLINE. */
+void canonical_url(char *url, StrView host, int port, StrView path) {
+   int v6 = memchr(host.p, ':', host.len) != NULL; //needs its brackets back
+   int n = sprintf(url, v6 ? "http://[" : "http://");
+   for (size_t i = 0; i < host.len; i++) {
+      url[n++] = tolower((unsigned char) host.p[i]);
+   }
+   snprintf(url + n, MAXLINE - n, "%s:%d%.*s", v6 ? "]" : "", port, (int) path.len, path.p);
+}
+
+pthread_mutex_t snap_lock = PTHREAD_MUTEX_INITIALIZER; //one snapshot written at a time
+int COMPRESS_MODE; //-z, keep compressible bodies gzipped in memory
+char *SNAPSHOT_PATH; //where cache_snapshot writes to, NULL when snapshots are off
+int SNAPSHOT_INTERVAL; //seconds between background snapshots, 0 for only at shutdown
+
+/* Copies the cache into a snapshot under the read lock, least recently used
+ first so cache_restore ends up with the same order, then writes it out with
+ the lock dropped. Returns -1 if the file couldn't be written. */
+int cache_snapshot(CacheList *list, char *path) {
+   Snapshot snap;
+   int rc;
+   
+   Pthread_rwlock_rdlock(&lock);
+   snapshot_init(&snap, list->size);
+   for (CachedItem *item = list->last; item != NULL; item = item->prev) {
+      if (item->raw_size != 0) { //snapshots hold what the server sent, cache_restore gzips it again
+         char *copy = item_copy(item);
+         snapshot_add(&snap, item->url, copy, item->size, NULL, 0, item->stored);
+         free(copy);
+      }
+      else {
+         snapshot_add(&snap, item->url, item->head->data, item->head->size, item->body->data, item->body->size, item->stored);
+      }
+      if (item == list->first) {
+         break;
+      }
    }
+   Pthread_rwlock_unlock(&lock);
+   
+   pthread_mutex_lock(&snap_lock);
+   rc = snapshot_save(&snap, path);
+   pthread_mutex_unlock(&snap_lock);
+   snapshot_free(&snap);
+   return rc;
+}
+
+/* snapshot_load callback, item points into the mapped file so take a copy
+ for cache_URL to own */
+void cache_restore(char *URL, void *item, size_t size, time_t stored, void *arg) {
+   CacheList *list = arg;
+   char *copy = Malloc(size ? size : 1);
+   memcpy(copy, item, size);
+   size_t raw_size = compress_response(&copy, &size);
+   cache_URL(URL, copy, size, raw_size, stored, list);
 }
 
 
@@ -376,274 +643,1011 @@ int Pthread_rwlock_destroy(pthread_rwlock_t *rwlock) {
  */
 void http_proxy(int connfd) {
    int dst_serverfd; //holds the destination server socket
-   char read_buf[MAXLINE]; //buffer read from for response
-   char request_method[MAXLINE]; //The HTTP method will only be GET since that's all that needs to be done
-   char uri[MAXLINE]; //website address we are going to if it had http:// its a proxy request
-   char http_version[MAXLINE]; //version of HTTP being used
-   char hostname[MAXLINE]; //holds the host name
-   char path[MAXLINE]; //holds file path
-   char http_header[MAXLINE]; //holds http header request
-   rio_t rio_client;  //holds the input output of client
+   char req_buf[MAXBUF]; //the request as it was read, everything in req points in here
+   HttpRequest req; //the request line and headers, parsed in place
+   HttpUri target; //host, port and path the request is for
+   char hostname[MAXLINE]; //target's host with a NUL on the end for upstream_connect
+   UpstreamRequest request; //what goes to the server, borrowed from req_buf
+   char *client_headers; //the client's header lines in req_buf, so Vary can pick from them
+   char url[MAXLINE]; //canonical form of the uri
+   char key[MAXLINE]; //what the response is cached under, url plus any Vary'd header values
+   char status_line[MAXLINE]; //first line of the server's response
+   char validators[MAXLINE]; //If-None-Match/If-Modified-Since lines when revalidating a stale copy
+   char *stale_body = NULL; //private copy of a stale cached response, served on a 304 or if the server is down
+   size_t stale_size = 0; //size of stale_body
    rio_t rio_server; //holds the server input output
-   int port; //port server is on
-   size_t written = 0;
-   
-   char buf[MAXLINE]; //buffer that will hold request
-   memset(&buf[0], 0, sizeof(buf));
+   int revalidate = 0; //served stale, queue a background revalidation
+   time_t now; //when the request came in, for freshness checks
    
    char *message = "Thread in http_proxy\n";
    charlog_insert(&c_log, message);
    
    // Read request line and headers
-   Rio_readinitb(&rio_client, connfd);
-   if (!Rio_readlineb(&rio_client, buf, MAXLINE)) { //read up to MAXLINE from read_buf and store in rio_client
+   size_t extra; //bytes read past the headers, they follow the NUL after them
+   long long started = reqtrace_now(); //start of whichever phase is being timed
+   int header_len = read_request(connfd, &req, req_buf, sizeof(req_buf), &extra);
+   reqtrace_span(SPAN_READ, started);
+   if (header_len == 0) { //client went away
+      reqtrace_outcome("gone");
+      return;
+   }
+   if (header_len < 0) {
+      reqtrace_outcome("error");
+      proxy_error(connfd, "400", "Bad Request");
       return;
    }
-   //printf("%s", read_buf);
-   sscanf(buf, "%s %s %s", request_method, uri, http_version);
    charlog_insert(&c_log, "User Request: ");
-   charlog_insert(&c_log, buf);
-   if (strcasecmp(request_method, "GET")) {
+   charlog_insert(&c_log, req_buf);
+   if (view_is(req.method, "CONNECT")) { //HTTPS, just pass bytes both ways
+      reqtrace_outcome("tunnel");
+      connect_tunnel(connfd, &req, req_buf + header_len + 1, extra);
+      return;
+   }
+   if (!view_is(req.method, "GET")) {
       //method isn't Get so don't do anything with it
       char *message = "ERROR: Proxy only implements the GET method\n";
       charlog_insert(&c_log, message);
-      //printf("Proxy does not implement this %s only the GET method\n", request_method);
+      reqtrace_outcome("unsupported");
       return;
    }
+   client_headers = req_buf + req.header_start;
    
-   Pthread_rwlock_rdlock(&lock); //locks to read
-   CachedItem *cached_item = find(buf, CACHE_LIST);
-   Pthread_rwlock_unlock(&lock); //unlock after reading
-   if (cached_item != NULL) { //we found the request we wanted
-      
-      Pthread_rwlock_wrlock(&lock); //writting when moving something to the front
+   //Split the uri into host, port and path, from the Host header if the client sent just a path
+   started = reqtrace_now();
+   HttpHeader *host_header = httpreq_header(&req, "Host");
+   if (http_split_uri(req.uri, &target) < 0 ||
+       (target.host.len == 0 && (host_header == NULL || http_split_host(host_header->value, &target) < 0))) {
+      reqtrace_outcome("error");
+      proxy_error(connfd, "400", "Bad Request");
+      return;
+   }
+   if (target.scheme.len > 0 && !view_is(target.scheme, "http")) { //the cache key and the request to the server are both plain HTTP
+      reqtrace_outcome("unsupported");
+      charlog_insert(&c_log, "Refused a URI that isn't http://\n");
+      proxy_error(connfd, "501", "Not Implemented");
+      return;
+   }
+   if (target.host.len + target.path.len + 32 >= MAXLINE) { //too long to key the cache with
+      reqtrace_outcome("error");
+      proxy_error(connfd, "414", "URI Too Long");
+      return;
+   }
+   memcpy(hostname, target.host.p, target.host.len);
+   hostname[target.host.len] = '\0';
+   canonical_url(url, target.host, target.port, target.path);
+   reqtrace_span(SPAN_PARSE, started);
+   reqtrace_url(url);
+   
+   now = time(NULL);
+   validators[0] = '\0';
+   started = reqtrace_now();
+   Pthread_rwlock_wrlock(&lock); //writting when moving something to the front
+   int keyed = cache_key(key, url, client_headers) == 0; //0 if the key is too long to cache under
+   CachedItem *cached_item = keyed ? find(key, CACHE_LIST) : NULL;
+   if (cached_item != NULL && now < cached_item->stale_until) { //fresh, or stale inside stale-while-revalidate
       move_to_front(cached_item->url, CACHE_LIST); //moves it to the front
+      if (now >= cached_item->expires && !cached_item->revalidating) {
+         cached_item->revalidating = revalidate = 1;
+      }
+      Body *head = cached_item->head, *body = cached_item->body;
+      size_t raw_size = cached_item->raw_size;
+      body_hold(&CACHE_LIST->bodies, head); //an eviction while we write can't free them now
+      body_hold(&CACHE_LIST->bodies, body);
+      char message2[MAXLINE];
+      sprintf(message2, "%s", cached_item->url); //the item itself may be gone once we unlock
       Pthread_rwlock_unlock(&lock);
-      
-      size_t to_be_written = cached_item->size; //size of the cached request
-      written = 0;
-      char *item_buf = cached_item->item_p;
-      while ((written = rio_writen(connfd, item_buf, to_be_written)) != to_be_written) {
-         item_buf += written;
-         to_be_written -= written;
+      reqtrace_span(SPAN_LOOKUP, started);
+      reqtrace_outcome("hit");
+   
+      char accept[MAXLINE];
+      int gzip_ok = header_value(client_headers, "Accept-Encoding", accept, sizeof(accept)) && encoding_accepts_gzip(accept);
+      started = reqtrace_now();
+      if (raw_size != 0 || !serve_range(connfd, head->data, head->size, body->data, body->size, client_headers)) {
+         serve_cached(connfd, head, body, raw_size, gzip_ok); //a gzipped body is sent whole, its offsets aren't the client's
       }
+      reqtrace_span(SPAN_CLIENT_WRITE, started);
+      body_release(&CACHE_LIST->bodies, head);
+      body_release(&CACHE_LIST->bodies, body);
       char *message = "Found a cached item!! Item is: ";
       charlog_insert(&c_log, message);
-      
-      char message2[MAXLINE];
-      sprintf(message2, "%s", cached_item->url);
       charlog_insert(&c_log, message2);
-      
+   
+      if (revalidate) { //client already has its answer, refresh behind its back
+         char *queued = strdup(key);
+         if (queued == NULL || !charlog_tryinsert(&r_queue, queued)) { //backlog's full, don't hold the worker, the next stale hit asks again
+            free(queued);
+            Pthread_rwlock_wrlock(&lock);
+            if ((cached_item = find(key, CACHE_LIST)) != NULL) {
+               cached_item->revalidating = 0;
+            }
+            Pthread_rwlock_unlock(&lock);
+         }
+      }
       return; //don't need to parse the uri cause it was cached
    }
+   if (cached_item != NULL) { //stale, ask the server whether our copy is still good
+      conditional_headers(cached_item->etag, cached_item->last_modified, validators);
+      stale_size = cached_item->size;
+      stale_body = item_copy(cached_item);
+   }
+   Pthread_rwlock_unlock(&lock);
+   reqtrace_span(SPAN_LOOKUP, started);
    
+   if (keyed && SHARED_CACHE != NULL) { //prefork workers keep everything in the shared segment instead
+      size_t shared_size;
+      time_t shared_stored;
+      started = reqtrace_now();
+      char *shared_item = shmcache_get(SHARED_CACHE, key, &shared_size, &shared_stored);
+      reqtrace_span(SPAN_SHARED, started);
+      if (shared_item != NULL) {
+         Freshness f;
+         freshness_parse(shared_item, shared_size, &f);
+         if (!f.no_cache && now < shared_stored + freshness_lifetime(&f, shared_stored)) {
+            reqtrace_outcome("shared");
+            started = reqtrace_now();
+            serve_response(connfd, shared_item, shared_size, client_headers);
+            reqtrace_span(SPAN_CLIENT_WRITE, started);
+            charlog_insert(&c_log, "Found item in shared memory\n");
+            free(shared_item);
+            return;
+         }
+         conditional_headers(f.etag, f.last_modified_str, validators);
+         stale_body = shared_item;
+         stale_size = shared_size;
+      }
+   }
    
-   //Parse_uri: get hostname, see what the port is set to, and get path from URI
-   memset(&path[0], 0, sizeof(path)); //Reset memory of path to 0
-   memset(&hostname[0], 0, sizeof(hostname)); //Reset memory of hostname to 0
+   if (keyed && stale_body == NULL && DISK_CACHE != NULL) { //missed in memory, try the disk tier before going to the server
+      size_t disk_size;
+      time_t disk_stored;
+      started = reqtrace_now();
+      char *disk_item = diskcache_get(DISK_CACHE, key, &disk_size, &disk_stored);
+      reqtrace_span(SPAN_DISK, started);
+      if (disk_item != NULL) {
+         Freshness f;
+         freshness_parse(disk_item, disk_size, &f);
+         if (!f.no_cache && now < disk_stored + freshness_lifetime(&f, disk_stored)) {
+            reqtrace_outcome("disk");
+            started = reqtrace_now();
+            serve_response(connfd, disk_item, disk_size, client_headers);
+            reqtrace_span(SPAN_CLIENT_WRITE, started);
+            charlog_insert(&c_log, "Found item on disk\n");
+            size_t raw_size = compress_response(&disk_item, &disk_size);
+            if (disk_size < MAX_OBJECT_SIZE) { //small enough to promote back into memory
+               Pthread_rwlock_wrlock(&lock);
+               if (find(key, CACHE_LIST) == NULL) {
+                  cache_URL(key, disk_item, disk_size, raw_size, disk_stored, CACHE_LIST);
+                  disk_item = NULL;
+               }
+               Pthread_rwlock_unlock(&lock);
+            }
+            free(disk_item);
+            return;
+         }
+         conditional_headers(f.etag, f.last_modified_str, validators);
+         stale_body = disk_item;
+         stale_size = disk_size;
+      }
+   }
    
-   parse_uri(uri, hostname, path, &port); //sets hostname, path and port from URI
+   //A URL a sibling owns goes through that sibling, which keeps the only copy. If it doesn't
+   //answer the query, or turns the request away, the server gets asked directly but nothing is
+   //kept here either. The query names the canonical URL, siblings' Vary tables can differ.
+   int owner = -1; //sibling the request goes through, -1 for none
+   int elsewhere = 0; //a sibling owns the URL, so this proxy doesn't store it
+   if (PEERS != NULL && keyed && stale_body == NULL && httpreq_header(&req, PEER_HEADER) == NULL &&
+       (owner = peer_owner(PEERS, url)) != PEERS->self) {
+      elsewhere = 1;
+      started = reqtrace_now();
+      int answer = peer_query(PEERS, owner, url, PEER_TIMEOUT_MS);
+      reqtrace_span(SPAN_PEER, started);
+      if (answer == PEER_DOWN) {
+         owner = -1;
+         charlog_insert(&c_log, "Sibling didn't answer, going to the server\n");
+      }
+      else {
+         charlog_insert(&c_log, answer == PEER_HIT ? "Sibling has it cached\n" : "Sibling will fetch it\n");
+      }
+   }
+   else {
+      owner = -1;
+   }
    
-   //Makes the request from the info from parsed URI so it can be sent to server
-   build_http_request(http_header, hostname, path, port, &rio_client);
+   //Without a copy to slice, pass a Range on so a seek into something big only moves the part asked for.
+   //bytes=0- is the whole thing anyway, fetched plain it can be cached.
+   char range[MAXLINE];
+   ByteRange wanted;
+   int ranged = stale_body == NULL && header_value(client_headers, "Range", range, sizeof(range)) &&
+                !(range_parse(range, &wanted) && range_from_start(&wanted));
    
-   //Connect to destination server with proxy server
    char conn_port[DEST_PORT_SIZE];
-   sprintf(conn_port, "%d", port); //writes port number to conn_port string
-   dst_serverfd = Open_clientfd(hostname, conn_port); //opens connection from proxy to dst server at hostname:port
-   
-   //Get and send info to the destination server
-   Rio_readinitb(&rio_server, dst_serverfd);
-   Rio_writen(dst_serverfd, http_header, sizeof(http_header));
-   
-   size_t size = 0; //gets the size of the object
-   size_t total_bytes = 0; //keeps track of total bytes to be written to cache
-   char object[MAX_OBJECT_SIZE]; //holds the response object to be cached
+   int status = 0; //status code the server answered with
+   ssize_t status_len = 0;
+   if (owner >= 0) { //the sibling is a proxy too, it gets the absolute URL and the client's Range as is
+      HttpUri via = target;
+      via.path.p = url;
+      via.path.len = strlen(url);
+      build_http_request(&request, &via, &req, PEER_HEADER ": 1\r\n", 1);
+      sprintf(conn_port, "%d", PEERS->ports[owner]);
+      if ((dst_serverfd = fetch_upstream("127.0.0.1", conn_port, request.iov, request.n, 0)) >= 0) {
+         Rio_readinitb(&rio_server, dst_serverfd);
+         status = read_status(&rio_server, status_line, &status_len);
+         if (status == 0 || status == 429 || status == 503) { //shed or limited by the sibling, not the server's answer
+            charlog_insert(&c_log, "Sibling turned the request away, going to the server\n");
+            Close(dst_serverfd);
+            dst_serverfd = -1;
+         }
+      }
+      if (dst_serverfd < 0) {
+         owner = -1; //went away since it answered, or is too busy
+      }
+   }
+   if (owner < 0) {
+      //Makes the request from the info from parsed URI so it can be sent to server
+      build_http_request(&request, &target, &req, validators, ranged);
    
-   while ((size = Rio_readlineb(&rio_server, read_buf, MAXLINE)) != 0) {
-      total_bytes += size;
-      //printf("Received %zu bytes...\n", size);
-      Rio_writen(connfd, read_buf, size); //forwards response to client
-      if (total_bytes < MAX_OBJECT_SIZE) {
-         strcat(object, read_buf); //if object is smaller than the max bytes concatinate the read_buf into it
+      //Connect to destination server with proxy server, send the request and wait for it to start answering
+      sprintf(conn_port, "%d", target.port); //writes port number to conn_port string
+      dst_serverfd = fetch_upstream(hostname, conn_port, request.iov, request.n, HEDGE_MODE);
+      if (dst_serverfd >= 0) { //get the answer from the destination server
+         Rio_readinitb(&rio_server, dst_serverfd);
+         status = read_status(&rio_server, status_line, &status_len);
+      }
+   }
+   if (dst_serverfd < 0) {
+      if (stale_body != NULL && stale_allowed(stale_body, stale_size)) { //stale beats nothing when the server is down
+         reqtrace_outcome("stale");
+         started = reqtrace_now();
+         serve_response(connfd, stale_body, stale_size, client_headers);
+         reqtrace_span(SPAN_CLIENT_WRITE, started);
+         charlog_insert(&c_log, "Server unreachable, served stale copy\n");
+      }
+      else if (dst_serverfd == UPSTREAM_TIMEOUT) {
+         reqtrace_outcome("error");
+         proxy_error(connfd, "504", "Gateway Timeout");
+      }
+      else {
+         reqtrace_outcome("error");
+         proxy_error(connfd, "502", "Bad Gateway");
       }
+      free(stale_body);
+      return;
+   }
+
+   if (stale_body != NULL && (status == 304 || (status == 0 && stale_allowed(stale_body, stale_size)))) { //our copy is still good (or all we've got)
+      reqtrace_outcome(status == 304 ? "revalidated" : "stale");
+      started = reqtrace_now();
+      serve_response(connfd, stale_body, stale_size, client_headers);
+      reqtrace_span(SPAN_CLIENT_WRITE, started);
+      if (status == 304) {
+         char headers[MAXBUF];
+         size_t headers_len = read_headers(&rio_server, status_line, status_len, headers, sizeof(headers));
+         charlog_insert(&c_log, "Revalidated cached item with a 304\n");
+         refresh_response(key, headers, headers_len, stale_body, stale_size);
+      }
+      else {
+         free(stale_body);
+      }
+      Close(dst_serverfd);
+      return;
    }
+   free(stale_body);
    
+   size_t total_bytes = 0; //keeps track of total bytes to be written to cache
+   reqtrace_outcome(owner >= 0 ? "peer" : "miss");
+   char *object = relay_response(&rio_server, connfd, status_line, status_len, &total_bytes);
+   Close(dst_serverfd);
    
-   if (total_bytes < MAX_OBJECT_SIZE) { //now copy it over to the cache
-      char *to_be_cached = (char*) Malloc(total_bytes);
-      strcpy(to_be_cached, object); //copy object into to_be_cached
-      
-      Pthread_rwlock_wrlock(&lock); //writting
-      charlog_insert(&c_log, "Caching URL: ");
-      char message2[MAXLINE];
-      sprintf(message2, "%s", buf);
-      charlog_insert(&c_log, message2);
-      cache_URL(buf, to_be_cached, total_bytes, CACHE_LIST);
-      Pthread_rwlock_unlock(&lock); //unlock
+   if (object != NULL && elsewhere) { //the sibling that owns it caches it, or will next time
+      free(object);
    }
-   
+   else if (object != NULL) { //now copy it over to the cache
+      started = reqtrace_now();
+      store_response(url, client_headers, object, total_bytes, now, 1);
+      reqtrace_span(SPAN_STORE, started);
+   }
+
 }
 
 /*
- * parse_uri - parse URI into hostname path and port
+ * fetch_upstream - connect to hostname:port, send the request in iov and
+ * wait for the first byte of the answer. With hedge, if nothing has come
+ * back by the p95 of recent requests the same request goes out again on a
+ * second connection, and whichever answers first is kept. Returns that
+ * socket, its reads timing out after IDLE_TIMEOUT, or UPSTREAM_DOWN or
+ * UPSTREAM_TIMEOUT.
  */
-void parse_uri(char *uri, char *hostname, char *path, int *port) {
-   char *proxy_substr = strstr(uri, "//"); //looks where the // is in the URI and holds pointer to it
-   char my_uri[MAXLINE]; //will hold the uri after the http:// the proxy request
-   memset(&my_uri[0], 0, sizeof(my_uri)); //Reset memory of my_uri to 0
-   char *uriline = my_uri; //holds everything after http://
-   char portnum[MAXLINE]; //holds the port number
-   int host_is_set = 0; //boolean that will change to one when the hostname is done
-   
-   char *message = "Thread in parse_uri\n";
-   charlog_insert(&c_log, message);
-   charlog_insert(&c_log, "Parsing URI: ");
-   charlog_insert(&c_log, uri);
-   charlog_insert(&c_log, "\n");
+int fetch_upstream(char *hostname, char *port, struct iovec *iov, int n, int hedge) {
+   int fds[2]; //the request, and the hedge if one goes out
+   long started[2]; //when each was sent
+   int sent = 1;
+   struct iovec again[n]; //writev_all uses up the iovecs it's given, keep a set for the hedge
    
-   *port = 80; //Default port is 80 if it isn't specified
+   memcpy(again, iov, n * sizeof(struct iovec));
+   started[0] = monotonic_ms();
+   long long span = reqtrace_now();
+   fds[0] = upstream_connect(hostname, port, CONNECT_TIMEOUT);
+   reqtrace_span(SPAN_CONNECT, span);
+   if (fds[0] < 0) {
+      return fds[0];
+   }
+   span = reqtrace_now();
+   int sent_ok = writev_all(fds[0], iov, n);
+   reqtrace_span(SPAN_SEND, span);
+   if (sent_ok < 0) { //hung up on us already, same as not answering
+      Close(fds[0]);
+      return UPSTREAM_DOWN;
+   }
    
-   if (proxy_substr != NULL) { //it will be null if there isn't http:// at the beginning
-      int i = 2; //go past the // to start after the http:// in proxy_substr
-      int j = 0; //used to start storing the rest of proxy_substr into uriline
-      for (; i < strlen(proxy_substr); i++) {
-         uriline[j++] = proxy_substr[i];
+   long wait = FIRST_BYTE_TIMEOUT;
+   long hedge_after = hedge ? latency_p95(&LATENCY) : -1;
+   if (hedge_after >= 0 && hedge_after < HEDGE_MIN_MS) {
+      hedge_after = HEDGE_MIN_MS;
+   }
+   if (hedge_after >= 0 && hedge_after < wait) {
+      wait = hedge_after;
+   }
+   span = reqtrace_now();
+   int winner = upstream_wait(fds, 1, wait);
+   reqtrace_span(SPAN_FIRST_BYTE, span);
+   if (winner == UPSTREAM_TIMEOUT && wait < FIRST_BYTE_TIMEOUT) { //slower than most, ask again
+      started[1] = monotonic_ms();
+      fds[1] = upstream_connect(hostname, port, CONNECT_TIMEOUT);
+      if (fds[1] >= 0 && writev_all(fds[1], again, n) == 0) {
+         sent = 2;
+         charlog_insert(&c_log, "Server is slow, hedged the request\n");
       }
+      else if (fds[1] >= 0) {
+         Close(fds[1]);
+      }
+      span = reqtrace_now();
+      winner = upstream_wait(fds, sent, FIRST_BYTE_TIMEOUT - (monotonic_ms() - started[0]));
+      reqtrace_span(SPAN_FIRST_BYTE, span);
    }
    
-   //Now see if there is a colon if it is there we need to change the port number
-   char *port_substr = strstr(uriline, ":"); //store : forward in port_substr
-   if (port_substr != NULL) { //means there was a : so there is a port number
-      int m = 1; //go past : so we are just looking at the port number now
-      int n = 0; //index into portnum array
-      while (1) {
-         if (port_substr[m] == '/') { //once / is hit all the numbers of the port have been seen
-            break;
-         }
-         portnum[n++] = port_substr[m++]; //store port number in port_substr into portnum
-      }
-      *port = atoi(portnum); //convert portnum char into an int and store in port
-      
-      m = 0; //used to index into hostname
-      n = 0; //used to index into uriline
-      
-      while (1) {
-         if (uriline[n] == ':') { //end of hostname
-            break;
-         }
-         hostname[m++] = uriline[n++]; //store the hostname in array
+   for (int i = 0; i < sent; i++) {
+      if (i != winner) {
+         Close(fds[i]);
       }
-      host_is_set = 1;
    }
+   if (winner < 0) {
+      return winner;
+   }
+   latency_add(&LATENCY, monotonic_ms() - started[winner]);
+   upstream_idle(fds[winner], IDLE_TIMEOUT);
+   return fds[winner];
+}
+
+/*
+ * read_status - read the status line of an answer into status_line.
+ * Returns its code, or 0 with *status_len 0 if the server hung up or
+ * stalled past IDLE_TIMEOUT first.
+ */
+int read_status(rio_t *rio_server, char *status_line, ssize_t *status_len) {
+   int status;
+   long long started = reqtrace_now();
    
-   char *path_substr = strstr(uriline, "/"); //takes out hostname to get the path
-   if (path_substr != NULL) {
-      int a = 0; //used to index into path array
-      int b = 0; //used to index into path_substr
-      
-      while (1) { //gets the path which goes to a null character
-         if (path_substr[b] == '\0') {
-            break;
+   *status_len = rio_readlineb(rio_server, status_line, MAXLINE);
+   reqtrace_span(SPAN_UPSTREAM, started);
+   if (*status_len <= 0 || sscanf(status_line, "HTTP/%*d.%*d %d", &status) != 1) {
+      *status_len = 0;
+      return 0;
+   }
+   return status;
+}
+
+/*
+ * relay_response - forward the rest of a response (after status_line, which
+ * has already been read) from the server to connfd and buffer it for the
+ * cache. connfd < 0 only buffers. Returns the Malloc'd response, or NULL
+ * if it grew past what any cache tier will hold.
+ */
+char *relay_response(rio_t *rio_server, int connfd, char *status_line, size_t status_len, size_t *total) {
+   char read_buf[MAXLINE]; //buffer read from for response
+   size_t size = status_len; //gets the size of the object
+   size_t total_bytes = 0; //keeps track of total bytes to be written to cache
+   size_t max_bytes = DISK_CACHE != NULL ? MAX_DISK_OBJECT_SIZE : COMPRESS_MODE ? MAX_COMPRESS_SIZE : MAX_OBJECT_SIZE; //biggest thing any tier will keep
+   size_t object_cap = MAXBUF; //bytes allocated for object so far
+   char *object = Malloc(object_cap); //holds the response object to be cached
+   
+   memcpy(read_buf, status_line, status_len);
+   while (size != 0) {
+      //printf("Received %zu bytes...\n", size);
+      if (connfd >= 0) {
+         long long span = reqtrace_now();
+         if (rio_writen(connfd, read_buf, size) < 0) { //client left, the cache can still have it
+            connfd = -1;
          }
-         path[a++] = path_substr[b++];
+         reqtrace_span(SPAN_CLIENT_WRITE, span);
       }
-      
-      if (!host_is_set) { //if host wasn't set do it now
-         int c = 0; //index for hostname array
-         int d = 0; // index for uriline array
-         
-         while (1) {
-            if (uriline[d] == '/') { //hostname has ended
-               break;
+      if (object != NULL && total_bytes + size <= max_bytes) {
+         if (total_bytes + size > object_cap) { //grow the object, responses can be binary so no strcat
+            while (total_bytes + size > object_cap) {
+               object_cap *= 2;
             }
-            hostname[c++] = uriline[d++];
+            object = Realloc(object, object_cap);
          }
+         memcpy(object + total_bytes, read_buf, size);
+      }
+      else if (object != NULL) { //too big for every tier, stop buffering it
+         free(object);
+         object = NULL;
+      }
+      total_bytes += size;
+      long long span = reqtrace_now();
+      ssize_t n = rio_readnb(rio_server, read_buf, MAXLINE);
+      reqtrace_span(SPAN_UPSTREAM, span);
+      if (n < 0) { //server stalled or reset, what we have is cut short and can't be cached
+         free(object);
+         object = NULL;
+         charlog_insert(&c_log, "Server stopped mid-response\n");
+         break;
       }
+      size = n;
    }
-   
+
+   *total = total_bytes;
+   return object;
 }
 
-void build_http_request(char *http_header, char *hostname, char *path, int port, rio_t *rio_client) {
-   char client_request[MAXLINE]; //holds the clients request into it
-   char request_header[MAXLINE]; //holds request
-   char host_header[MAXLINE]; //holds hostname header
-   char other_headers[MAXLINE]; //holds any additional headers
-   char *connection_header = "Connection: close\r\n"; //signifies the connection header
-   char *proxy_header = "Proxy-Connection: close\r\n"; //signifies the proxy header
-   char *host_header_format = "Host: %s\r\n"; //format of a host header
-   char *request_header_format = "GET %s HTTP/1.0\r\n"; //format of the request header with HTTP version set to 1.0
-   char *carriage_return = "\r\n"; //used to signal that headers are all done
-   char *connection_phrase = "Connection"; //the phrase to look for in a header for when it is a normal connection
-   char *user_agent_phrase = "User-Agent"; //the phrase to look for in a header for when it will be the user_agent header
-   char *proxy_connection_phrase = "Proxy-Connection"; //the phrase to look for in a header for when it is a proxy connection
-   char *host_phrase = "Host"; //the phrase to look for in a header for when it is a host header
-   int connection_len = strlen(connection_phrase); //used for how many chars a connection_phrase is to use with strncasecmp
-   int user_len = strlen(user_agent_phrase); //used for how many chars a user_agent_phrase is to use with strncasecmp
-   int proxy_len = strlen(proxy_connection_phrase); //used for how many chars a proxy_connection_phrase is to use with strncasecmp
-   int host_len = strlen(host_phrase); //used for how many chars a host_phrase is to use with strncasecmp
-   
-   sprintf(request_header, request_header_format, path); //format is written to request_header array with path included
-   //printf("request_header: %s\n", request_header); //prints the request header
-   
-   char *message = "Thread starting in build_http_request\n";
-   charlog_insert(&c_log, message);
+/*
+ * read_headers - read header lines up to and including the blank line into
+ * headers, after first (the status line already read). Returns the length.
+ */
+size_t read_headers(rio_t *rio_server, char *first, size_t first_len, char *headers, size_t cap) {
+   size_t len = first_len;
+   ssize_t n;
    
-   //reads at most MAXLINE chars and reads what is in rio_client and puts into client_request array
-   while (Rio_readlineb(rio_client, client_request, MAXLINE) > 0) {
-      if (!strcmp(client_request, carriage_return)) { //IF EOF is first thing in client_request break
+   memcpy(headers, first, first_len);
+   while (len + MAXLINE < cap && (n = rio_readlineb(rio_server, headers + len, MAXLINE)) > 0) {
+      len += n;
+      if (!strcmp(headers + len - n, "\r\n") || !strcmp(headers + len - n, "\n")) {
          break;
       }
-      
-      if (!strncasecmp(client_request, host_phrase, host_len)) { //compares host_phrase to the first host_len chars in client_request
-         strcpy(host_header, client_request); //copy what is in the client_request to host_header
-         //printf("HOST_HEADER: %s\n", host_header); //print host header
-         continue;
-      }
-      
-      //Checks if there are any other headers and puts them into other_headers
-      if (!strncasecmp(client_request, connection_phrase, connection_len) &&
-          !strncasecmp(client_request, proxy_connection_phrase, proxy_len) &&
-          !strncasecmp(client_request, user_agent_phrase, user_len)) {  //if there are connection, proxy and user agent headers store in other_headers
-         strcat(other_headers, client_request); //concatenates chars in client_request to chars already in other_headers array
-      }
-   }
-   
-   if (strlen(host_header) == 0) { //if for some reason the host wasn't set, set it here
-      sprintf(host_header, host_header_format, hostname); //format is written to host_header array with hostname included
    }
-   
-   //Build the HTTP header
-   sprintf(http_header, "%s%s%s%s%s%s%s", request_header, host_header, connection_header,
-           proxy_header, user_agent_hdr, other_headers,
-           carriage_return); //all the strings %s from all of the headers are stored in the http_header
-   charlog_insert(&c_log, "HTTP HEADER CREATED:\n");
-   charlog_insert(&c_log, http_header);
-   charlog_insert(&c_log, "\n");
-   //printf("HTTP_HEADERS: %s\n", http_header); //print http_header
+   return len;
 }
 
+/* Whether a stale copy may go out when the server can't say if it's still
+ good. must-revalidate (or proxy-revalidate) says it never may. */
+int stale_allowed(char *item, size_t size) {
+   Freshness f;
+   return freshness_parse(item, size, &f) >= 0 && !f.must_revalidate;
+}
 
-void *thread(void *vargp) {
-   //int connfd = *((int *)vargp); //holds connfdp from main thread
-   Pthread_detach(pthread_self()); //can't join or get the return value. it is separate from the main thread
-   //Free(vargp); //frees storage used to hold connfd which is the pointer to connfdp
-   while (1) {
+/*
+ * store_response - put a response for url fetched at stored into whichever
+ * tier fits it, replacing any copy already there. A Vary header in the
+ * response picks which of client_headers go into the key. An answer to a
+ * request with Authorization is only kept if the response says a shared
+ * cache may (public, s-maxage or must-revalidate). With scan (and -p), an
+ * HTML page's assets are queued for prefetching. Takes ownership of
+ * object.
+ */
+void store_response(char *url, char *client_headers, char *object, size_t size, time_t stored, int scan) {
+   Freshness f;
+   char key[MAXLINE];
+   
+   int head_len = freshness_parse(object, size, &f);
+   if (head_len < 0 || !freshness_cacheable(&f)) { //no-store, private, or an error
+      free(object);
+      return;
+   }
+   char auth[MAXLINE];
+   if (header_value(client_headers, "Authorization", auth, sizeof(auth)) && !f.shared) { //meant for that user alone
+      free(object);
+      return;
+   }
+   if (scan && PREFETCH_MODE && html_response(object, head_len)) { //while the page is still plain text
+      HttpUri page;
+      StrView url_view = {url, strlen(url)};
+      if (http_split_uri(url_view, &page) == 0) {
+         html_links(object + head_len, size - head_len, &page, PREFETCH_PER_PAGE, queue_prefetch, &page);
+      }
+   }
+   if (SHARED_CACHE != NULL) { //every worker process's cache, kept as the server sent it
+      Pthread_rwlock_wrlock(&lock);
+      vary_set(url, f.vary);
+      int keyed = cache_key(key, url, client_headers) == 0;
+      Pthread_rwlock_unlock(&lock);
+      if (keyed && size < MAX_OBJECT_SIZE) {
+         charlog_insert(&c_log, "Caching URL in shared memory\n");
+         shmcache_put(SHARED_CACHE, key, object, size, stored);
+      }
+      free(object);
+      return;
+   }
+   size_t raw_size = compress_response(&object, &size); //before the lock, deflate takes a while
+   
+   Pthread_rwlock_wrlock(&lock); //writting
+   vary_set(url, f.vary); //later lookups for url need to know what it varies on
+   int keyed = cache_key(key, url, client_headers) == 0;
+   if (keyed && size < MAX_OBJECT_SIZE) {
+      charlog_insert(&c_log, "Caching URL: ");
+      char message2[MAXLINE];
+      sprintf(message2, "%s", key);
+      charlog_insert(&c_log, message2);
+      cache_remove(key, CACHE_LIST); //drop the stale copy if there was one
+      size_t shared = CACHE_LIST->bodies.shared;
+      cache_URL(key, object, size, raw_size, stored, CACHE_LIST);
+      if (CACHE_LIST->bodies.shared != shared) {
+         charlog_insert(&c_log, "Body already cached under another key, sharing it\n");
+      }
+      Pthread_rwlock_unlock(&lock); //unlock
+      return;
+   }
+   Pthread_rwlock_unlock(&lock);
+   
+   if (!keyed || DISK_CACHE == NULL || !demote_tryinsert(&d_queue, key, object, size, stored)) { //only the disk tier can hold it
+      free(object);
+   }
+}
+
+/*
+ * refresh_response - a 304 came back for key, so body is good for another
+ * lifetime. headers are the 304's, their Cache-Control/Expires win over the
+ * stored ones. Takes ownership of body.
+ */
+void refresh_response(char *key, char *headers, size_t headers_len, char *body, size_t size) {
+   Freshness f;
+   time_t now = time(NULL);
+   
+   freshness_parse(headers, headers_len, &f);
+   if (SHARED_CACHE != NULL) { //storing it again is what restamps it there
+      shmcache_put(SHARED_CACHE, key, body, size, now);
+      free(body);
+      return;
+   }
+   Pthread_rwlock_wrlock(&lock);
+   CachedItem *item = find(key, CACHE_LIST);
+   if (item != NULL) { //still cached, just restamp it
+      set_freshness(item, now, &f);
+      move_to_front(key, CACHE_LIST);
+      Pthread_rwlock_unlock(&lock);
+      free(body);
+      return;
+   }
+   Pthread_rwlock_unlock(&lock);
+   
+   size_t raw_size = compress_response(&body, &size);
+   if (size < MAX_OBJECT_SIZE) { //evicted meanwhile (or came from disk), put it back
+      Pthread_rwlock_wrlock(&lock);
+      cache_remove(key, CACHE_LIST); //someone else may have put it back while we weren't looking
+      cache_URL(key, body, size, raw_size, now, CACHE_LIST);
+      Pthread_rwlock_unlock(&lock);
+      return;
+   }
+   if (DISK_CACHE == NULL || !demote_tryinsert(&d_queue, key, body, size, now)) {
+      free(body);
+   }
+}
+
+/*
+ * compress_response - in -z mode swap a compressible response's body for
+ * its gzip, as long as that gets it small enough for the memory cache.
+ * Returns the body's size before compression, or 0 if object was left as it
+ * was. Call it before taking the cache lock, deflate isn't cheap.
+ */
+size_t compress_response(char **object, size_t *size) {
+   Freshness f;
+   size_t gz_len;
+   
+   if (!COMPRESS_MODE || *size >= MAX_COMPRESS_SIZE) {
+      return 0;
+   }
+   int head_len = freshness_parse(*object, *size, &f);
+   if (head_len < 0 || !encoding_compressible(*object, head_len, *size - head_len)) {
+      return 0;
+   }
+   size_t body_len = *size - head_len;
+   char *gz = gzip_encode(*object + head_len, body_len, &gz_len);
+   if (gz == NULL) {
+      return 0;
+   }
+   if (head_len + gz_len >= MAX_OBJECT_SIZE) { //still too big for memory, the disk tier wants it as sent
+      free(gz);
+      return 0;
+   }
+   *object = Realloc(*object, head_len + gz_len); //only ever shrinks
+   memcpy(*object + head_len, gz, gz_len);
+   *size = head_len + gz_len;
+   free(gz);
+   return body_len;
+}
+
+/* Sends a cached response to the client. A client that hung up is its own
+ problem, so errors are ignored instead of exiting like Rio_writen. */
+void serve_item(int connfd, char *item, size_t size) {
+   rio_writen(connfd, item, size);
+}
+
+/* serve_item for a whole cached response, except that a Range in the
+ client's headers gets just its slice */
+void serve_response(int connfd, char *item, size_t size, char *client_headers) {
+   Freshness f;
+   
+   int head_len = freshness_parse(item, size, &f);
+   if (head_len < 0 || !serve_range(connfd, item, head_len, item + head_len, size - head_len, client_headers)) {
+      serve_item(connfd, item, size);
+   }
+}
+
+/*
+ * serve_range - answer a Range in client_headers from a cached response
+ * without copying the body: a 206 with the slice, or a 416 if the range
+ * starts past the end. Returns 0, having sent nothing, if there is no
+ * Range to honour (none, more than one range, not a 200, or an If-Range
+ * the response no longer matches) and the whole response should go out.
+ */
+int serve_range(int connfd, char *head, size_t head_len, char *body, size_t body_len, char *client_headers) {
+   char value[MAXLINE];
+   ByteRange r;
+   Freshness f;
+   size_t first, last;
+   
+   if (!header_value(client_headers, "Range", value, sizeof(value)) || !range_parse(value, &r)) {
+      return 0;
+   }
+   freshness_parse(head, head_len, &f);
+   if (f.status != 200) { //only a whole representation can be cut up
+      return 0;
+   }
+   if (header_value(client_headers, "If-Range", value, sizeof(value)) && !range_if_match(value, f.etag, f.last_modified_str)) {
+      return 0; //changed since the client got its first part, start it over
+   }
+   if (range_resolve(&r, body_len, &first, &last) == RANGE_UNSATISFIABLE) {
+      char response[MAXLINE];
+      serve_item(connfd, response, range_unsatisfiable(response, body_len));
+      return 1;
+   }
+   size_t part_head_len;
+   char *part_head = range_head(head, head_len, first, last, body_len, &part_head_len);
+   serve_parts(connfd, part_head, part_head_len, body + first, last - first + 1);
+   free(part_head);
+   return 1;
+}
+
+/* Same for an item served straight out of the body store. A gzipped body
+ goes out as is to clients that accept gzip and inflated for everyone else. */
+void serve_cached(int connfd, Body *head, Body *body, size_t raw_size, int gzip_ok) {
+   if (raw_size == 0) {
+      serve_parts(connfd, head->data, head->size, body->data, body->size);
+   }
+   else if (gzip_ok) {
+      size_t gz_head_len;
+      char *gz_head = gzip_head(head->data, head->size, body->size, &gz_head_len);
+      serve_parts(connfd, gz_head, gz_head_len, body->data, body->size);
+      free(gz_head);
+   }
+   else {
+      gzip_stream(connfd, head->data, head->size, body->data, body->size);
+   }
+}
+
+/* Writes head and body with one writev so the body doesn't sit behind Nagle
+ waiting for the headers to be acked. Errors are ignored like serve_item. */
+void serve_parts(int connfd, char *head, size_t head_len, char *body, size_t body_len) {
+   struct iovec iov[2];
+   
+   iov[0].iov_base = head;
+   iov[0].iov_len = head_len;
+   iov[1].iov_base = body;
+   iov[1].iov_len = body_len;
+   writev_all(connfd, iov, 2);
+}
+
+/* writev until all n slices are out, picking up after short writes. iov is
+ used up along the way. Returns -1 on an error. */
+int writev_all(int fd, struct iovec *iov, int n) {
+   int i = 0;
+   
+   while (i < n) {
+      while (i < n && iov[i].iov_len == 0) { //skip what's already written
+         i++;
+      }
+      if (i == n) {
+         break;
+      }
+      ssize_t written = writev(fd, iov + i, n - i);
+      if (written < 0 && errno == EINTR) {
+         continue;
+      }
+      if (written <= 0) {
+         return -1;
+      }
+      for (; i < n && (size_t) written >= iov[i].iov_len; i++) {
+         written -= iov[i].iov_len;
+         iov[i].iov_len = 0;
+      }
+      if (i < n) {
+         iov[i].iov_base = (char *) iov[i].iov_base + written;
+         iov[i].iov_len -= written;
+      }
+   }
+   return 0;
+}
+
+/* Sends a minimal error response when there's nothing better to give */
+void proxy_error(int connfd, char *status, char *msg) {
+   char response[MAXLINE];
+   sprintf(response, "HTTP/1.0 %s %s\r\nContent-type: text/plain\r\nContent-length: %d\r\nConnection: close\r\n\r\n%s\n",
+           status, msg, (int) strlen(msg) + 1, msg);
+   rio_writen(connfd, response, strlen(response));
+}
+
+/* Answers a connection that won't be queued and closes it, straight from the
+ accept loop, so nothing here may wait on the client */
+void turn_away(int connfd, char *status) {
+   char response[MAXLINE];
+   char discard[MAXBUF];
+   
+   recv(connfd, discard, sizeof(discard), MSG_DONTWAIT); //unread request bytes would make close send a reset
+   sprintf(response, "HTTP/1.0 %s\r\nRetry-After: 1\r\nContent-length: 0\r\nConnection: close\r\n\r\n", status);
+   send(connfd, response, strlen(response), MSG_DONTWAIT);
+   shutdown(connfd, SHUT_WR);
+   Close(connfd);
+}
+
+/* Request headers the proxy sets itself, or leaves to its own cache */
+static char *managed_headers[] = {
+   "Host",
+   "Connection",
+   "Proxy-Connection",
+   "User-Agent",
+   "Keep-Alive",
+   NULL
+};
+
+static int managed_header(StrView name, int ranged) {
+   if (view_is(name, "Range") || view_is(name, "If-Range")) { //only when the caller wants a part from upstream
+      return !ranged;
+   }
+   if (name.len > 3 && !strncasecmp(name.p, "If-", 3)) { //conditionals are for the proxy's cache to make
+      return 1;
+   }
+   if (view_is(name, PEER_HEADER)) { //only ever between siblings
+      return 1;
+   }
+   if (COMPRESS_MODE && view_is(name, "Accept-Encoding")) { //-z does its own encoding, fetch identity
+      return 1;
+   }
+   for (int i = 0; managed_headers[i] != NULL; i++) {
+      if (view_is(name, managed_headers[i])) {
+         return 1;
+      }
+   }
+   return 0;
+}
+
+/* Appends a slice to the request, growing the last one instead if it ends
+ right where this one starts (consecutive headers from the client) */
+static void request_add(UpstreamRequest *out, void *p, size_t len) {
+   if (len == 0) {
+      return;
+   }
+   if (out->n > 0) {
+      struct iovec *last = &out->iov[out->n - 1];
+      if ((char *) last->iov_base + last->iov_len == p) {
+         last->iov_len += len;
+         return;
+      }
+   }
+   out->iov[out->n].iov_base = p;
+   out->iov[out->n].iov_len = len;
+   out->n++;
+}
+
+static void request_add_str(UpstreamRequest *out, char *str) {
+   request_add(out, str, strlen(str));
+}
+
+/* Appends a client header line, as sent if it already ends in CRLF */
+static void request_add_header(UpstreamRequest *out, HttpHeader *h) {
+   if (h->line.len >= 2 && h->line.p[h->line.len - 2] == '\r') {
+      request_add(out, h->line.p, h->line.len);
+   }
+   else { //bare LF, send the header with a proper line ending
+      request_add(out, h->name.p, h->value.p + h->value.len - h->name.p);
+      request_add_str(out, "\r\n");
+   }
+}
+
+/*
+ * build_http_request - the request to send upstream for target: an HTTP/1.0
+ * GET, the client's Host (or target's), the proxy's own Connection,
+ * Proxy-Connection and User-Agent, every other header the client sent and
+ * then extra_headers. The client's Range and If-Range only go along if
+ * ranged, otherwise the whole response comes back to be cached. Nothing is
+ * copied, out points into req's buffer, target, extra_headers and constant
+ * strings, so they have to outlive it.
+ */
+void build_http_request(UpstreamRequest *out, HttpUri *target, HttpRequest *req, char *extra_headers, int ranged) {
+   HttpHeader *host = httpreq_header(req, "Host");
+   long long started = reqtrace_now();
+   
+   char *message = "Thread starting in build_http_request\n";
+   charlog_insert(&c_log, message);
+   
+   out->n = 0;
+   request_add_str(out, "GET ");
+   request_add(out, target->path.p, target->path.len);
+   request_add_str(out, " HTTP/1.0\r\n");
+   if (host != NULL) {
+      request_add_header(out, host);
+   }
+   else {
+      int v6 = memchr(target->host.p, ':', target->host.len) != NULL;
+      request_add_str(out, v6 ? "Host: [" : "Host: ");
+      request_add(out, target->host.p, target->host.len);
+      request_add_str(out, v6 ? "]" : "");
+      if (target->port != 80) {
+         request_add(out, out->port, sprintf(out->port, ":%d", target->port));
+      }
+      request_add_str(out, "\r\n");
+   }
+   request_add_str(out, "Connection: close\r\nProxy-Connection: close\r\n");
+   request_add_str(out, (char *) user_agent_hdr);
+   
+   for (int i = 0; i < req->nheaders; i++) { //the rest of the client's headers, straight out of its buffer
+      if (!managed_header(req->headers[i].name, ranged)) {
+         request_add_header(out, &req->headers[i]);
+      }
+   }
+   request_add_str(out, extra_headers);
+   request_add_str(out, "\r\n");
+   charlog_insert(&c_log, "HTTP request built\n");
+   reqtrace_span(SPAN_BUILD, started);
+}
+
+/*
+ * read_request - read from connfd until req has the whole request line and
+ * header block, which end up in buf followed by a NUL. Whatever came in
+ * after them is moved up past the NUL and *extra says how much. Returns the
+ * length, 0 if the client hung up first, or REQ_ERROR if it isn't a request
+ * or doesn't fit in cap bytes.
+ */
+int read_request(int connfd, HttpRequest *req, char *buf, size_t cap, size_t *extra) {
+   size_t len = 0;
+   int rc;
+   
+   httpreq_init(req);
+   while ((rc = httpreq_parse(req, buf, len)) == REQ_PARTIAL) {
+      if (len == cap - 1) { //headers bigger than the whole buffer
+         return REQ_ERROR;
+      }
+      ssize_t n = read(connfd, buf + len, cap - 1 - len);
+      if (n < 0 && errno == EINTR) {
+         continue;
+      }
+      if (n <= 0) {
+         return 0;
+      }
+      len += n;
+   }
+   *extra = 0;
+   if (rc > 0) {
+      *extra = len - rc; //a GET has no body, but a CONNECT client may not wait for our answer
+      memmove(buf + rc + 1, buf + rc, *extra); //len < cap, so there's room for the NUL
+      buf[rc] = '\0';
+   }
+   return rc;
+}
+
+TunnelLoop TUNNELS; //every open CONNECT tunnel, relayed by tunnelthread
+
+/*
+ * connect_tunnel - answer CONNECT host:port by connecting to it and handing
+ * both sockets to the tunnel thread. The worker is free again as soon as the
+ * 200 is out. early is anything the client sent after its request.
+ */
+void connect_tunnel(int connfd, HttpRequest *req, char *early, size_t early_len) {
+   HttpUri target;
+   char hostname[MAXLINE]; //target's host with a NUL on the end for upstream_connect
+   char port[16];
+   char *established = "HTTP/1.0 200 Connection established\r\n\r\n";
+   
+   if (memchr(req->uri.p, ':', req->uri.len) == NULL || http_split_host(req->uri, &target) < 0 ||
+       target.host.len >= TUNNEL_TARGET_LEN - 8) { //authority-form, and the port isn't optional
+      proxy_error(connfd, "400", "Bad Request");
+      return;
+   }
+   memcpy(hostname, target.host.p, target.host.len);
+   hostname[target.host.len] = '\0';
+   sprintf(port, "%d", target.port);
+   
+   int serverfd = upstream_connect(hostname, port, CONNECT_TIMEOUT); //a dead target mustn't hold the worker
+   if (serverfd == UPSTREAM_TIMEOUT) {
+      proxy_error(connfd, "504", "Gateway Timeout");
+      return;
+   }
+   if (serverfd < 0) {
+      proxy_error(connfd, "502", "Bad Gateway");
+      return;
+   }
+   if (rio_writen(connfd, established, strlen(established)) < 0) {
+      Close(serverfd);
+      return;
+   }
+   int clientfd = dup(connfd); //the worker closes connfd when we return, the tunnel keeps its own
+   char name[TUNNEL_TARGET_LEN];
+   sprintf(name, "%.*s:%d", (int) target.host.len, target.host.p, target.port); //host length was checked above
+   if (clientfd < 0 || tunnel_add(&TUNNELS, clientfd, serverfd, name, early, early_len) < 0) {
+      if (clientfd >= 0) {
+         Close(clientfd);
+      }
+      Close(serverfd); //the client sees the tunnel close before anything came through it
+      charlog_insert(&c_log, "Couldn't set up the tunnel, dropped a CONNECT\n");
+      return;
+   }
+   charlog_insert(&c_log, "Opened a CONNECT tunnel\n");
+}
+
+/* Logs what a tunnel carried when it closes. Only the tunnel thread calls
+ this, one close at a time, so one static buffer for the message will do. */
+void tunnel_closed(Tunnel *t, char *why, void *arg) {
+   static char message[MAXLINE];
+   sprintf(message, "Tunnel to %s closed (%s) after %ld seconds: %zu bytes up, %zu bytes down\n",
+           t->target, why, (long) (time(NULL) - t->opened), t->up.bytes, t->down.bytes);
+   charlog_insert(&c_log, message);
+}
+
+/*
+ * header_value - find header name (any case) in a block of header lines and
+ * copy its value, without blanks around it, into value. Returns 0 if absent.
+ */
+int header_value(char *headers, char *name, char *value, size_t len) {
+   size_t name_len = strlen(name);
+   char *line = headers;
+   
+   while (*line != '\0') {
+      char *eol = strchr(line, '\n');
+      if (eol == NULL) {
+         eol = line + strlen(line);
+      }
+      if (!strncasecmp(line, name, name_len) && line[name_len] == ':') {
+         char *v = line + name_len + 1, *end = eol;
+         while (v < end && (*v == ' ' || *v == '\t')) {
+            v++;
+         }
+         while (end > v && (end[-1] == '\r' || end[-1] == ' ' || end[-1] == '\t')) {
+            end--;
+         }
+         size_t n = (size_t) (end - v) < len - 1 ? (size_t) (end - v) : len - 1;
+         memcpy(value, v, n);
+         value[n] = '\0';
+         return 1;
+      }
+      line = *eol != '\0' ? eol + 1 : eol;
+   }
+   return 0;
+}
+
+void *thread(void *vargp) {
+   //int connfd = *((int *)vargp); //holds connfdp from main thread
+   Pthread_detach(pthread_self()); //can't join or get the return value. it is separate from the main thread
+   //Free(vargp); //frees storage used to hold connfd which is the pointer to connfdp
+   while (1) {
       int connfd = sbuf_remove(&sbuf);
+      if (connfd < 0) { //ctrl-c, interruptthread is waiting for us to finish
+         V(&stopped);
+         return NULL;
+      }
       char *string = "Starting new thread request with connection fd: ";
       size_t len = strlen(string);
       char message[len];
       sprintf(message, "%s %i\n", string, connfd);
       charlog_insert(&c_log, message);
       //charlog_insert(&c_log, "Starting up a thread request");
+      reqtrace_begin();
       http_proxy(connfd); //fires up a HTTP proxy server request
       Close(connfd); //always need to close connfd when done otherwise resources are depleted
+      reqtrace_end();
    }
    //return NULL;
 }
 
 void *loggingthread(void *vargp) {
-   fp = fopen("log.txt", "w");
+   fp = fopen("log.txt", SHARED_CACHE != NULL ? "a" : "w"); //prefork workers share one log, main truncated it
    if (fp == NULL) {
       printf("Error! Couldn't write to file\n");
       exit(1);
@@ -656,15 +1660,307 @@ void *loggingthread(void *vargp) {
    }
 }
 
-void interrupt_handler(int num){
-   cache_destruct(CACHE_LIST);
-   Free(CACHE_LIST);
-   CACHE_LIST = NULL;
-   if (fp != NULL) {
-      fclose(fp);
+void *diskthread(void *vargp) {
+   Pthread_detach(pthread_self());
+   while (1) {
+      DiskJob job = demote_remove(&d_queue);
+      if (diskcache_put(DISK_CACHE, job.key, job.item, job.size, job.stored) < 0) {
+         charlog_insert(&c_log, "ERROR: couldn't write object to disk cache\n");
+      }
+      free(job.key);
+      free(job.item);
+   }
+}
+
+/* Queues path on the page's own server for the prefetch thread. A full
+ queue means prefetching is behind, the link is dropped rather than waited on. */
+void queue_prefetch(char *path, void *arg) {
+   HttpUri *page = arg;
+   char url[MAXLINE];
+   StrView path_view = {path, strlen(path)};
+   
+   if (page->host.len + path_view.len + 32 >= MAXLINE) {
+      return;
+   }
+   canonical_url(url, page->host, page->port, path_view);
+   char *queued = strdup(url);
+   if (!charlog_tryinsert(&p_queue, queued)) {
+      free(queued);
+   }
+}
+
+/*
+ * prefetchthread - fetch queued links into the cache, the way a browser with
+ * no special headers would ask for them. Skips what's already cached, waits
+ * while clients are queued for a worker, and stops for the rest of the
+ * minute once PREFETCH_BUDGET bytes have come in, so prefetching can't
+ * flush the cache of what clients actually asked for.
+ */
+void *prefetchthread(void *vargp) {
+   time_t window = 0; //minute the budget is being spent in
+   size_t spent = 0; //bytes prefetched in it
+   
+   Pthread_detach(pthread_self());
+   while (1) {
+      char *url = charlog_remove(&p_queue);
+      char key[MAXLINE], hostname[MAXLINE], conn_port[DEST_PORT_SIZE];
+      char request[2 * MAXLINE], status_line[MAXLINE];
+      HttpUri target;
+      time_t now = time(NULL);
+      
+      if (now / 60 != window) {
+         window = now / 60;
+         spent = 0;
+      }
+      while (sbuf_waited(&sbuf) > 0) { //clients come first
+         usleep(10000);
+      }
+      Pthread_rwlock_rdlock(&lock);
+      int cached = cache_key(key, url, "") < 0 || find(key, CACHE_LIST) != NULL;
+      Pthread_rwlock_unlock(&lock);
+      cached = cached || (SHARED_CACHE != NULL && shmcache_contains(SHARED_CACHE, key));
+      int owned = PEERS == NULL || peer_owner(PEERS, url) == PEERS->self; //a sibling's to fetch, if anyone asks
+      StrView url_view = {url, strlen(url)};
+      if (cached || !owned || spent >= PREFETCH_BUDGET || http_split_uri(url_view, &target) < 0) {
+         free(url);
+         continue;
+      }
+      
+      memcpy(hostname, target.host.p, target.host.len);
+      hostname[target.host.len] = '\0';
+      sprintf(conn_port, "%d", target.port);
+      sprintf(request, "GET %.*s HTTP/1.0\r\nHost: %s\r\nConnection: close\r\nProxy-Connection: close\r\n%s\r\n",
+              (int) target.path.len, target.path.p, hostname, user_agent_hdr);
+      struct iovec iov = {request, strlen(request)};
+      int fd = fetch_upstream(hostname, conn_port, &iov, 1, 0);
+      if (fd >= 0) {
+         rio_t rio_server;
+         Rio_readinitb(&rio_server, fd);
+         ssize_t n = rio_readlineb(&rio_server, status_line, MAXLINE);
+         if (n > 0) {
+            size_t total;
+            char *object = relay_response(&rio_server, -1, status_line, n, &total);
+            spent += total;
+            if (object != NULL) {
+               charlog_insert(&c_log, "Prefetched a linked asset\n");
+               store_response(url, "", object, total, now, 0); //one level deep, a prefetched page isn't scanned
+            }
+         }
+         Close(fd);
+      }
+      free(url);
+   }
+}
+
+/* Copies the Vary'd "name: value" lines of a cache key into out (MAXLINE),
+ minus any the proxy manages itself, as build_http_request filters a
+ client's headers. Under -z that drops Accept-Encoding so the server still
+ sends identity. */
+static void vary_request_lines(char *out, char *lines) {
+   char *eol;
+   
+   *out = '\0';
+   for (; (eol = strstr(lines, "\r\n")) != NULL; lines = eol + 2) {
+      char *colon = memchr(lines, ':', eol - lines);
+      StrView name = {lines, colon != NULL ? (size_t) (colon - lines) : 0};
+      if (colon != NULL && !managed_header(name, 0)) {
+         strncat(out, lines, eol + 2 - lines);
+      }
+   }
+}
+
+/*
+ * revalidatethread - refreshes items that were served stale under
+ * stale-while-revalidate, so the client that found them never waits
+ */
+void *revalidatethread(void *vargp) {
+   Pthread_detach(pthread_self());
+   while (1) {
+      char *key = charlog_remove(&r_queue);
+      char url[MAXLINE], hostname[MAXLINE], conn_port[DEST_PORT_SIZE];
+      char validators[MAXLINE], request[4 * MAXLINE], status_line[MAXLINE], sent_lines[MAXLINE];
+      char *body = NULL;
+      size_t body_size = 0;
+      int status = 0;
+      HttpUri target;
+      
+      Pthread_rwlock_rdlock(&lock); //take a copy of what we're revalidating
+      CachedItem *item = find(key, CACHE_LIST);
+      if (item != NULL) {
+         conditional_headers(item->etag, item->last_modified, validators);
+         body_size = item->size;
+         body = item_copy(item);
+      }
+      Pthread_rwlock_unlock(&lock);
+      if (body == NULL) { //evicted while it sat in the queue
+         free(key);
+         continue;
+      }
+      
+      //the key is the canonical url, then the Vary'd request header lines if there were any
+      char *vary_lines = strstr(key, "\r\n");
+      size_t url_len = vary_lines != NULL ? (size_t) (vary_lines - key) : strlen(key);
+      memcpy(url, key, url_len);
+      url[url_len] = '\0';
+      vary_lines = vary_lines != NULL ? vary_lines + 2 : "";
+      vary_request_lines(sent_lines, vary_lines); //the key keeps them all, the server only gets what a client's request would pass on
+      
+      StrView url_view = {url, url_len};
+      http_split_uri(url_view, &target); //canonical_url made it, it splits
+      memcpy(hostname, target.host.p, target.host.len);
+      hostname[target.host.len] = '\0';
+      sprintf(conn_port, "%d", target.port);
+      sprintf(request, "GET %.*s HTTP/1.0\r\nHost: %s\r\nConnection: close\r\nProxy-Connection: close\r\n%s%s%s\r\n",
+              (int) target.path.len, target.path.p, hostname, user_agent_hdr, sent_lines, validators);
+      
+      struct iovec iov = {request, strlen(request)};
+      int fd = fetch_upstream(hostname, conn_port, &iov, 1, 0); //nobody is waiting on it, no need to hedge
+      if (fd >= 0) {
+         rio_t rio_server;
+         Rio_readinitb(&rio_server, fd);
+         ssize_t n = rio_readlineb(&rio_server, status_line, MAXLINE);
+         if (n > 0 && sscanf(status_line, "HTTP/%*d.%*d %d", &status) == 1 && status == 304) {
+            char headers[MAXBUF];
+            size_t len = read_headers(&rio_server, status_line, n, headers, sizeof(headers));
+            refresh_response(key, headers, len, body, body_size);
+            body = NULL;
+         }
+         else if (n > 0) { //changed upstream, replace it
+            size_t total;
+            char *object = relay_response(&rio_server, -1, status_line, n, &total);
+            if (object != NULL) {
+               store_response(url, vary_lines, object, total, time(NULL), 0);
+            }
+            status = 200;
+         }
+      }
+      if (fd >= 0) {
+         Close(fd);
+      }
+      if (status == 0) { //couldn't reach the server, let the next stale hit try again
+         Pthread_rwlock_wrlock(&lock);
+         if ((item = find(key, CACHE_LIST)) != NULL) {
+            item->revalidating = 0;
+         }
+         Pthread_rwlock_unlock(&lock);
+      }
+      free(body);
+      free(key);
+   }
+}
+
+void *tunnelthread(void *vargp) {
+   Pthread_detach(pthread_self());
+   tunnel_run(&TUNNELS); //never comes back
+   return NULL;
+}
+
+/* peer_serve callback, a sibling wants to know whether the canonical URL
+ key is cached here. An object stored under Vary lines counts as a miss,
+ the request comes through this proxy either way. */
+int peer_cached(char *key, void *arg) {
+   Pthread_rwlock_rdlock(&lock);
+   CachedItem *item = find(key, CACHE_LIST);
+   int hit = item != NULL && time(NULL) < item->stale_until; //what http_proxy would serve without asking the server
+   Pthread_rwlock_unlock(&lock);
+   if (!hit && SHARED_CACHE != NULL) {
+      hit = shmcache_contains(SHARED_CACHE, key);
+   }
+   return hit;
+}
+
+void *peerthread(void *vargp) {
+   Pthread_detach(pthread_self());
+   peer_serve(PEERS, peer_cached, NULL); //never comes back
+   return NULL;
+}
+
+/*
+ * prefork - with -w, run the proxy as that many worker processes, each
+ * with its own threads accepting on the same listenfd and all sharing
+ * SHARED_CACHE. The first process stays behind and only starts a new
+ * worker whenever one dies, so a crash costs the connections that worker
+ * had rather than the whole proxy. Returns in each worker.
+ */
+void prefork(int workers) {
+   pid_t parent = getpid();
+   
+   for (int i = 0; i < workers; i++) {
+      if (Fork() == 0) {
+         prctl(PR_SET_PDEATHSIG, SIGTERM); //workers go when the parent does
+         if (getppid() != parent) { //it already went
+            exit(0);
+         }
+         return;
+      }
+   }
+   while (1) {
+      int status;
+      pid_t pid = wait(&status);
+      if (pid < 0) {
+         if (errno == EINTR) {
+            continue;
+         }
+         unix_error("wait error");
+      }
+      fprintf(stderr, "Worker %d died, starting another\n", (int) pid);
+      if (Fork() == 0) {
+         prctl(PR_SET_PDEATHSIG, SIGTERM);
+         if (getppid() != parent) {
+            exit(0);
+         }
+         return;
+      }
+   }
+}
+
+/* Writes the workers' finished request traces out every TRACE_EXPORT_SECS */
+void *tracethread(void *vargp) {
+   FILE *tfp = fopen(TRACE_PATH, SHARED_CACHE != NULL ? "a" : "w"); //prefork workers share one file like the log
+   if (tfp == NULL) {
+      fprintf(stderr, "Couldn't write traces to %s: %s\n", TRACE_PATH, strerror(errno));
+      exit(1);
+   }
+   Pthread_detach(pthread_self());
+   while (1) {
+      sleep(TRACE_EXPORT_SECS);
+      if (reqtrace_export(tfp) > 0) {
+         fflush(tfp);
+      }
+   }
+}
+
+void *snapshotthread(void *vargp) {
+   Pthread_detach(pthread_self());
+   while (1) {
+      sleep(SNAPSHOT_INTERVAL);
+      if (cache_snapshot(CACHE_LIST, SNAPSHOT_PATH) < 0) {
+         charlog_insert(&c_log, "ERROR: couldn't write cache snapshot\n");
+      }
+   }
+}
+
+/* SIGINT is blocked in every thread and this one waits for it, so the
+ shutdown runs as ordinary code rather than in a signal handler. Each worker
+ is handed a -1 behind the connections already queued and finishes what it
+ has first; once they have all stopped the snapshot is written and exit
+ closes the rest. Appended disk objects are durable already. */
+void *interruptthread(void *vargp) {
+   sigset_t *mask = vargp;
+   int num;
+   
+   Pthread_detach(pthread_self());
+   sigwait(mask, &num); //only fails for a bad mask
+   charlog_insert(&c_log, "Ctrl-c, stopping the workers\n");
+   for (int i = 0; i < NTHREADS; i++) {
+      sbuf_insert(&sbuf, -1);
+   }
+   for (int i = 0; i < NTHREADS; i++) {
+      P(&stopped);
+   }
+   if (SNAPSHOT_PATH != NULL && cache_snapshot(CACHE_LIST, SNAPSHOT_PATH) < 0) {
+      fprintf(stderr, "Couldn't write cache snapshot %s\n", SNAPSHOT_PATH);
    }
-   sbuf_deinit(&sbuf);
-   charlog_deinit(&c_log);
    exit(0);
 }
 
@@ -673,22 +1969,195 @@ int main(int argc, char** argv) {
    socklen_t clientlen;  //Holds how big the client's socket is
    struct sockaddr_storage clientaddr;  //holds the client's address
    pthread_t tid;  //holds the thread id
+   char *disk_dir = NULL; //directory for the on-disk cache tier, -d
+   char *peer_ports = NULL; //-P, ports of the sibling proxies on this host
+   int workers = 1; //-w, processes sharing one cache
+   int trace_every = 1; //-T, keep the trace of one request in this many
+   long trace_slow = 0; //-T, and of every request at least this many ms slow
+   static sigset_t mask; //SIGINT, blocked in every thread and taken by interruptthread
+   int opt;
+   int queue_target = QUEUE_TARGET_MS; //-q, 0 never sheds
+   double rate = 0, burst = 0; //-r, per client connections a second and how many may come at once
+   static struct option long_opts[] = {
+      {"cache-dir", required_argument, NULL, 'd'},
+      {"snapshot", required_argument, NULL, 's'},
+      {"snapshot-interval", required_argument, NULL, 'i'},
+      {"compress", no_argument, NULL, 'z'},
+      {"queue-target", required_argument, NULL, 'q'},
+      {"rate-limit", required_argument, NULL, 'r'},
+      {"timeouts", required_argument, NULL, 't'},
+      {"hedge", no_argument, NULL, 'H'},
+      {"prefetch", no_argument, NULL, 'p'},
+      {"peers", required_argument, NULL, 'P'},
+      {"workers", required_argument, NULL, 'w'},
+      {"trace", required_argument, NULL, 'T'},
+      {NULL, 0, NULL, 0}
+   };
    
-   listenfd = Open_listenfd(argv[1]); //opens a listenfd with csapp wrapper
+   while ((opt = getopt_long(argc, argv, "d:s:i:zq:r:t:HpP:w:T:", long_opts, NULL)) != -1) {
+      switch (opt) {
+         case 'd':
+            disk_dir = optarg;
+            break;
+         case 's':
+            SNAPSHOT_PATH = optarg;
+            break;
+         case 'i':
+            SNAPSHOT_INTERVAL = atoi(optarg);
+            break;
+         case 'z':
+            COMPRESS_MODE = 1;
+            break;
+         case 'q':
+            queue_target = atoi(optarg);
+            break;
+         case 'r':
+            if (sscanf(optarg, "%lf:%lf", &rate, &burst) < 1 || rate <= 0) {
+               optind = argc;
+            }
+            break;
+         case 't': { //connect[:first byte[:idle]] in seconds, any left out keep their defaults
+            double t[3] = {CONNECT_TIMEOUT / 1000.0, FIRST_BYTE_TIMEOUT / 1000.0, IDLE_TIMEOUT / 1000.0};
+            if (sscanf(optarg, "%lf:%lf:%lf", &t[0], &t[1], &t[2]) < 1 || t[0] <= 0 || t[1] <= 0 || t[2] <= 0) {
+               optind = argc;
+            }
+            CONNECT_TIMEOUT = t[0] * 1000;
+            FIRST_BYTE_TIMEOUT = t[1] * 1000;
+            IDLE_TIMEOUT = t[2] * 1000;
+            break;
+         }
+         case 'H':
+            HEDGE_MODE = 1;
+            break;
+         case 'p':
+            PREFETCH_MODE = 1;
+            break;
+         case 'P':
+            peer_ports = optarg;
+            break;
+         case 'w':
+            workers = atoi(optarg);
+            break;
+         case 'T': { //file[:every[:slow ms]], by default every request is kept
+            char *colon = strchr(optarg, ':');
+            if (colon != NULL) {
+               *colon = '\0';
+               if (sscanf(colon + 1, "%d:%ld", &trace_every, &trace_slow) < 1 || trace_every < 1 || trace_slow < 0) {
+                  optind = argc;
+               }
+            }
+            TRACE_PATH = optarg;
+            break;
+         }
+         default:
+            optind = argc; //falls into the usage message below
+            break;
+      }
+   }
+   if (workers < 1 || (workers > 1 && (disk_dir != NULL || SNAPSHOT_PATH != NULL))) { //those tiers belong to one process
+      optind = argc;
+   }
+   if (optind >= argc) {
+      fprintf(stderr, "usage: %s <port> [-d cachedir] [-s snapshotfile [-i seconds]] [-z] [-q ms] [-r rate[:burst]] [-t connect[:firstbyte[:idle]]] [-H] [-p] [-P port,port,...] [-w workers] [-T tracefile[:every[:slowms]]]\n", argv[0]);
+      exit(1);
+   }
+   
+   listenfd = Open_listenfd(argv[optind]); //opens a listenfd with csapp wrapper
    CACHE_LIST = (CacheList*) Malloc(sizeof(CacheList)); //creates cache to use
-   cache_init(CACHE_LIST); //inits list
-   signal(SIGINT, interrupt_handler); //calls this when ctrl-c is types
+   cache_init(CACHE_LIST, MAX_CACHE_SIZE, MAX_OBJECT_SIZE); //inits list
+   CACHE_LIST->evicting = demote; //the disk tier gets a chance at whatever memory lets go of
+   Signal(SIGPIPE, SIG_IGN); //a peer hanging up mid-write is an error return, not the end of the proxy
+   
+   if (SNAPSHOT_PATH != NULL) { //warm the memory cache back up from the last run
+      int restored = snapshot_load(SNAPSHOT_PATH, cache_restore, CACHE_LIST);
+      if (restored >= 0) {
+         printf("Restored %d cached objects from %s\n", restored, SNAPSHOT_PATH);
+      }
+   }
+   
+   if (disk_dir != NULL) { //rebuild the disk index before taking any connections
+      DISK_CACHE = (DiskCache*) Malloc(sizeof(DiskCache));
+      if (diskcache_open(DISK_CACHE, disk_dir) < 0) {
+         fprintf(stderr, "Couldn't open disk cache %s: %s\n", disk_dir, strerror(errno));
+         exit(1);
+      }
+   }
+   
+   if (peer_ports != NULL) { //before any connections, a sibling may ask straight away
+      PEERS = (PeerGroup*) Malloc(sizeof(PeerGroup));
+      if (peer_init(PEERS, peer_ports, atoi(argv[optind])) < 0) {
+         fprintf(stderr, "Bad sibling list %s, or UDP port %s is taken\n", peer_ports, argv[optind]);
+         exit(1);
+      }
+   }
+   
+   if (rate > 0) { //a second's worth twice over unless told otherwise, shared by every -w worker
+      if ((RATE_TABLE = rate_create(rate, burst > 0 ? burst : 2 * rate)) == NULL) {
+         unix_error("rate_create error");
+      }
+   }
+   
+   if (workers > 1) { //everything from here on is per process
+      SHARED_CACHE = (ShmCache*) Malloc(sizeof(ShmCache));
+      if (shmcache_create(SHARED_CACHE, MAX_CACHE_SIZE) < 0) {
+         unix_error("shmcache_create error");
+      }
+      fclose(fopen("log.txt", "w")); //the workers append to it
+      if (TRACE_PATH != NULL) {
+         truncate(TRACE_PATH, 0); //may not be there yet, the workers create it
+      }
+      prefork(workers);
+   }
    
    sbuf_init(&sbuf, SBUFSIZE);
+   Sem_init(&stopped, 0, 0);
    charlog_init(&c_log, CBUFSIZE);
+   demote_init(&d_queue, DBUFSIZE);
+   charlog_init(&r_queue, CBUFSIZE);
+   charlog_init(&p_queue, PBUFSIZE);
+   latency_init(&LATENCY);
+   if (tunnel_init(&TUNNELS, TUNNEL_IDLE_TIMEOUT, tunnel_closed, NULL) < 0) {
+      unix_error("tunnel_init error");
+   }
+   sigemptyset(&mask);
+   sigaddset(&mask, SIGINT);
+   pthread_sigmask(SIG_BLOCK, &mask, NULL); //main and every thread made from here on, only sigwait sees it
    Pthread_create(&tid, NULL, loggingthread, NULL); //makes the logging thread
+   if (DISK_CACHE != NULL) {
+      Pthread_create(&tid, NULL, diskthread, NULL); //makes the thread that writes demoted objects
+   }
+   Pthread_create(&tid, NULL, revalidatethread, NULL); //makes the stale-while-revalidate thread
+   Pthread_create(&tid, NULL, tunnelthread, NULL); //makes the thread that relays every CONNECT tunnel
+   if (PEERS != NULL) {
+      Pthread_create(&tid, NULL, peerthread, NULL); //makes the thread that answers siblings' queries
+   }
+   if (PREFETCH_MODE) {
+      Pthread_create(&tid, NULL, prefetchthread, NULL); //makes the thread that fetches what pages link to
+   }
+   if (TRACE_PATH != NULL) {
+      reqtrace_init(trace_every, trace_slow);
+      Pthread_create(&tid, NULL, tracethread, NULL); //makes the thread that writes request traces out
+   }
    for (int i = 0; i < NTHREADS; i++) { //Creates worker threads
       Pthread_create(&tid, NULL, thread, NULL);
    }
+   if (SNAPSHOT_PATH != NULL && SNAPSHOT_INTERVAL > 0) {
+      Pthread_create(&tid, NULL, snapshotthread, NULL); //makes the periodic snapshot writer
+   }
+   Pthread_create(&tid, NULL, interruptthread, &mask); //makes the thread that shuts down on ctrl-c
    while (1) {
       clientlen = sizeof(struct sockaddr_storage);
       connfd = Accept(listenfd, (SA *) &clientaddr, &clientlen);
-      sbuf_insert(&sbuf, connfd); //Insert connfd into buffer
+      if (RATE_TABLE != NULL && !rate_allow(RATE_TABLE, (SA *) &clientaddr, monotonic_ms())) { //this client is over its share
+         turn_away(connfd, "429 Too Many Requests");
+         charlog_insert(&c_log, "Client over its rate limit, sent a 429\n");
+         continue;
+      }
+      if ((queue_target > 0 && sbuf_waited(&sbuf) > queue_target) || !sbuf_tryinsert(&sbuf, connfd)) { //workers are behind
+         turn_away(connfd, "503 Service Unavailable");
+         charlog_insert(&c_log, "Queue over its latency target, sent a 503\n");
+         continue;
+      }
       
       /* For parts 1 and 2 since the sbuf is allocated all of the connfds made will be on the heap
        so we don't need these anymore */
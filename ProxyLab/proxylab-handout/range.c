@@ -0,0 +1,156 @@
+/*
+ * range.c - Range and If-Range requests answered from cached responses
+ *
+ * A cached 200 already has the whole body, so a client that only wants
+ * part of it (a video player seeking, a download resuming) can be sent that
+ * slice of the cached bytes with a rewritten header block. Only a single
+ * bytes range is handled; anything fancier gets the whole response, which
+ * RFC 7233 allows a server to send instead.
+ */
+#include <limits.h>
+#include "range.h"
+
+/* Reads the digits at *s into *n and moves *s past them, 0 if there were none */
+static int read_number(char **s, long *n) {
+   char *p = *s;
+   long v = 0;
+   
+   if (*p < '0' || *p > '9') {
+      return 0;
+   }
+   while (*p >= '0' && *p <= '9') {
+      if (v > (LONG_MAX - 9) / 10) { //bigger than any body we could have
+         return 0;
+      }
+      v = v * 10 + (*p++ - '0');
+   }
+   *n = v;
+   *s = p;
+   return 1;
+}
+
+/*
+ * range_parse - read "bytes=first-last", "bytes=first-" or "bytes=-suffix"
+ * into r. Returns 0 for anything else, including several ranges, and the
+ * caller should then ignore the Range header altogether.
+ */
+int range_parse(char *value, ByteRange *r) {
+   char *s = value;
+   
+   if (strncasecmp(s, "bytes", 5) != 0) {
+      return 0;
+   }
+   s += 5;
+   while (*s == ' ' || *s == '\t') {
+      s++;
+   }
+   if (*s++ != '=') {
+      return 0;
+   }
+   while (*s == ' ' || *s == '\t') {
+      s++;
+   }
+   
+   r->first = r->last = -1;
+   if (*s == '-') { //the last so many bytes
+      s++;
+      if (!read_number(&s, &r->last)) {
+         return 0;
+      }
+   }
+   else {
+      if (!read_number(&s, &r->first) || *s++ != '-') {
+         return 0;
+      }
+      if (*s >= '0' && *s <= '9' && (!read_number(&s, &r->last) || r->last < r->first)) {
+         return 0;
+      }
+   }
+   while (*s == ' ' || *s == '\t') {
+      s++;
+   }
+   return *s == '\0'; //a comma means more ranges follow
+}
+
+/* Whether r asks for everything from the first byte on, which a plain
+ 200 answers just as well */
+int range_from_start(ByteRange *r) {
+   return r->first == 0 && r->last < 0;
+}
+
+/*
+ * range_resolve - the bytes r covers in a body of total bytes, clipped to
+ * the end of it. RANGE_UNSATISFIABLE if none of them exist.
+ */
+int range_resolve(ByteRange *r, size_t total, size_t *first, size_t *last) {
+   if (total == 0) {
+      return RANGE_UNSATISFIABLE;
+   }
+   if (r->first < 0) { //suffix
+      if (r->last == 0) {
+         return RANGE_UNSATISFIABLE;
+      }
+      *first = (size_t) r->last < total ? total - r->last : 0;
+      *last = total - 1;
+      return RANGE_OK;
+   }
+   if ((size_t) r->first >= total) {
+      return RANGE_UNSATISFIABLE;
+   }
+   *first = r->first;
+   *last = r->last < 0 || (size_t) r->last >= total ? total - 1 : (size_t) r->last;
+   return RANGE_OK;
+}
+
+/*
+ * range_if_match - whether the If-Range validator still names the cached
+ * response, so the range may be sent. An entity tag has to match etag
+ * strongly, a weak one never does; a date has to be the Last-Modified
+ * value exactly.
+ */
+int range_if_match(char *if_range, char *etag, char *last_modified) {
+   if (if_range[0] == '"') {
+      return etag[0] == '"' && !strcmp(if_range, etag);
+   }
+   if (!strncmp(if_range, "W/", 2)) {
+      return 0;
+   }
+   return last_modified[0] != '\0' && !strcmp(if_range, last_modified);
+}
+
+/*
+ * range_head - the headers to send with bytes first to last of a body of
+ * total bytes: the original ones with a 206 status line and Content-Range
+ * and Content-Length for the slice in place of their own. Malloc'd.
+ */
+char *range_head(char *head, size_t head_len, size_t first, size_t last, size_t total, size_t *out_len) {
+   char *out = Malloc(head_len + MAXLINE);
+   char *end = head + head_len;
+   char *line = memchr(head, '\n', head_len); //the status line is replaced
+   size_t n;
+   
+   line = line != NULL ? line + 1 : end;
+   n = sprintf(out, "%.8s 206 Partial Content\r\n", head_len >= 8 && !strncmp(head, "HTTP/", 5) ? head : "HTTP/1.0");
+   while (line < end) {
+      char *eol = memchr(line, '\n', end - line);
+      eol = eol != NULL ? eol + 1 : end;
+      if (*line == '\r' || *line == '\n') { //blank line, the new headers go in front of it
+         break;
+      }
+      if (strncasecmp(line, "Content-Length:", 15) != 0 && strncasecmp(line, "Content-Range:", 14) != 0) {
+         memcpy(out + n, line, eol - line);
+         n += eol - line;
+      }
+      line = eol;
+   }
+   n += sprintf(out + n, "Content-Range: bytes %zu-%zu/%zu\r\nContent-Length: %zu\r\n\r\n",
+                first, last, total, last - first + 1);
+   *out_len = n;
+   return out;
+}
+
+/* Writes the 416 for a range that starts past the end of a total byte body */
+size_t range_unsatisfiable(char *buf, size_t total) {
+   return sprintf(buf, "HTTP/1.0 416 Range Not Satisfiable\r\nContent-Range: bytes */%zu\r\n"
+                  "Content-Length: 0\r\nConnection: close\r\n\r\n", total);
+}
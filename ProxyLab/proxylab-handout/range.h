@@ -0,0 +1,26 @@
+/*
+ * range.h - Range and If-Range requests answered from cached responses
+ */
+#ifndef __RANGE_H__
+#define __RANGE_H__
+
+#include <stddef.h>
+#include "csapp.h"
+
+#define RANGE_OK 0 //first and last are the bytes to send
+#define RANGE_UNSATISFIABLE -1 //starts past the end, answer 416
+
+/* One byte range from a Range header, before the body size is known */
+typedef struct {
+   long first; //first byte asked for, -1 for a suffix range
+   long last; //last byte asked for, -1 if open ended; the suffix length for a suffix range
+} ByteRange;
+
+int range_parse(char *value, ByteRange *r); //0 unless value is a single bytes range
+int range_from_start(ByteRange *r); //bytes=0-, the whole body anyway
+int range_resolve(ByteRange *r, size_t total, size_t *first, size_t *last);
+int range_if_match(char *if_range, char *etag, char *last_modified);
+char *range_head(char *head, size_t head_len, size_t first, size_t last, size_t total, size_t *out_len);
+size_t range_unsatisfiable(char *buf, size_t total); //a whole 416 response, buf needs MAXLINE
+
+#endif /* __RANGE_H__ */
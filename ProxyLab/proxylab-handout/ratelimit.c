@@ -0,0 +1,119 @@
+/*
+ * ratelimit.c - per-client token buckets for the proxy's accept loop
+ *
+ * Every client address gets a bucket of burst tokens that refills at rate
+ * per second, and each connection it opens spends one. A client with an
+ * empty bucket is turned away before it takes a slot in the connection
+ * queue, so one greedy client only ever slows itself down.
+ *
+ * Buckets live in a fixed table, probed a few slots from the address's
+ * hash. A bucket that has refilled to full is no different from no bucket,
+ * so any full one may be handed to a new client. If every probed slot is
+ * busy the client simply isn't limited; that takes more than RATE_SLOTS
+ * clients all active at once.
+ *
+ * With -w every worker process accepts on the same socket, so the table
+ * is mapped shared before the fork and a client's rate holds across all
+ * of them rather than once per worker. A robust, process-shared mutex
+ * guards it; a worker dying with it held leaves at worst one bucket
+ * half topped up, so the next one just carries on.
+ */
+#include "ratelimit.h"
+
+/*
+ * rate_create - map an empty table, shared with any process forked after.
+ * Call it before forking.
+ */
+RateTable *rate_create(double rate, double burst) {
+   pthread_mutexattr_t attr;
+   RateTable *rt = mmap(NULL, sizeof(RateTable), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+   
+   if (rt == MAP_FAILED) {
+      return NULL;
+   }
+   pthread_mutexattr_init(&attr); //the mapping starts zeroed, which is every slot free
+   pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+   pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+   pthread_mutex_init(&rt->mutex, &attr);
+   pthread_mutexattr_destroy(&attr);
+   rt->rate = rate;
+   rt->burst = burst < 1 ? 1 : burst;
+   return rt;
+}
+
+/* Tops b up for the time since it was last looked at */
+static void refill(RateTable *rt, RateBucket *b, long now_ms) {
+   b->tokens += (now_ms - b->last) * rt->rate / 1000.0;
+   if (b->tokens > rt->burst) {
+      b->tokens = rt->burst;
+   }
+   b->last = now_ms;
+}
+
+/*
+ * rate_allow - whether the client at sa may open another connection now.
+ * Spends one of its tokens if so. Addresses other than IPv4/IPv6 always
+ * pass.
+ */
+int rate_allow(RateTable *rt, struct sockaddr *sa, long now_ms) {
+   unsigned char *addr;
+   size_t len;
+   RateBucket *b = NULL;
+   int allowed = 1;
+   
+   if (sa->sa_family == AF_INET) {
+      addr = (unsigned char *) &((struct sockaddr_in *) sa)->sin_addr;
+      len = 4;
+   }
+   else if (sa->sa_family == AF_INET6) {
+      addr = (unsigned char *) &((struct sockaddr_in6 *) sa)->sin6_addr;
+      len = 16;
+   }
+   else {
+      return 1;
+   }
+   
+   unsigned int h = 2166136261u; //FNV-1a
+   for (size_t i = 0; i < len; i++) {
+      h = (h ^ addr[i]) * 16777619u;
+   }
+   if (pthread_mutex_lock(&rt->mutex) == EOWNERDEAD) { //a worker died mid-update, the numbers are still numbers
+      pthread_mutex_consistent(&rt->mutex);
+   }
+   for (int i = 0; i < RATE_PROBE; i++) {
+      RateBucket *slot = &rt->slots[(h + i) % RATE_SLOTS];
+      if (slot->family == sa->sa_family && !memcmp(slot->addr, addr, len)) { //seen it before
+         b = slot;
+         refill(rt, b, now_ms);
+         break;
+      }
+      if (b == NULL) {
+         if (slot->family != 0) {
+            refill(rt, slot, now_ms);
+         }
+         if (slot->family == 0 || slot->tokens >= rt->burst) { //free, or as good as
+            b = slot;
+         }
+      }
+   }
+   if (b == NULL) { //table's too busy to track it
+      pthread_mutex_unlock(&rt->mutex);
+      return 1;
+   }
+   if (b->family != sa->sa_family || memcmp(b->addr, addr, len)) { //a new client takes over the slot
+      memset(b->addr, 0, sizeof(b->addr));
+      memcpy(b->addr, addr, len);
+      b->family = sa->sa_family;
+      b->tokens = rt->burst;
+      b->last = now_ms;
+   }
+   if (b->tokens < 1) {
+      rt->limited++;
+      allowed = 0;
+   }
+   else {
+      b->tokens -= 1;
+   }
+   pthread_mutex_unlock(&rt->mutex);
+   return allowed;
+}
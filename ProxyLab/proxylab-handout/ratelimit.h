@@ -0,0 +1,31 @@
+/*
+ * ratelimit.h - per-client token buckets for the proxy's accept loop
+ */
+#ifndef __RATELIMIT_H__
+#define __RATELIMIT_H__
+
+#include "csapp.h"
+
+#define RATE_SLOTS 4096 //clients tracked at once
+#define RATE_PROBE 8 //slots tried for a client before it goes untracked
+
+/* One client address and what it has left to spend */
+typedef struct {
+   int family; //AF_INET or AF_INET6, 0 for a free slot
+   unsigned char addr[16]; //the address, IPv4 uses the first 4 bytes
+   double tokens; //connections the client may still open right now
+   long last; //ms when tokens was last topped up
+} RateBucket;
+
+typedef struct {
+   pthread_mutex_t mutex; //process shared and robust, every -w worker's accept loop spends from the same buckets
+   double rate; //tokens a bucket gets back per second
+   double burst; //most tokens a bucket holds
+   long limited; //connections turned away so far
+   RateBucket slots[RATE_SLOTS]; //open addressed by a hash of the address
+} RateTable;
+
+RateTable *rate_create(double rate, double burst); //NULL if the shared mapping couldn't be made
+int rate_allow(RateTable *rt, struct sockaddr *sa, long now_ms); //1 and a token spent, or 0 if over the limit
+
+#endif /* __RATELIMIT_H__ */
@@ -0,0 +1,147 @@
+/*
+ * reqtrace.c - per-request latency spans, for finding where slow requests go
+ *
+ * A worker starts a record when it picks up a connection and adds the
+ * time spent in each phase (reading the request, the cache lookups,
+ * connecting to the server, its first byte, writing to the client...) as
+ * it goes, from CLOCK_MONOTONIC. The record in progress is the thread's
+ * own, so timing a phase is two clock reads and an add. A finished record
+ * goes into the worker's ring if it is sampled: one request in every N,
+ * plus every request slower than the slow threshold, so the slow ones
+ * tracetop is after are always there however thin the sampling. A thread
+ * writes the rings to the trace file every TRACE_EXPORT_SECS.
+ *
+ * Each line of the file is one request:
+ *    wall_ms total_us outcome url phase=us phase=us ...
+ * with only the phases it went through. Lines starting with # are notes.
+ */
+#include "reqtrace.h"
+
+const char *span_names[SPAN_COUNT] = {
+   "read", "parse", "lookup", "shared", "disk", "peer", "build",
+   "connect", "send", "first_byte", "upstream", "client_write", "store"
+};
+
+static int enabled; //reqtrace_init was called
+static int sample_every; //keep one request in this many
+static long long slow_ns; //and every one at least this slow, 0 for no threshold
+static unsigned long requests; //finished so far, for picking the 1 in N
+static TraceRing *rings; //every worker's, newest first
+static pthread_mutex_t rings_mutex = PTHREAD_MUTEX_INITIALIZER; //guards the list, not the rings
+
+static __thread TraceRing *ring; //this worker's
+static __thread TraceRecord current; //the request this worker is on
+static __thread int active; //whether current is being filled in
+
+void reqtrace_init(int every, long slow_ms) {
+   sample_every = every > 0 ? every : 1;
+   slow_ns = slow_ms * 1000000LL;
+   enabled = 1;
+}
+
+long long reqtrace_now(void) {
+   struct timespec ts;
+   
+   if (!enabled) {
+      return 0;
+   }
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Starts a record for the request this thread is about to handle */
+void reqtrace_begin(void) {
+   struct timespec ts;
+   
+   if (!enabled) {
+      return;
+   }
+   if (ring == NULL) { //first request on this thread
+      ring = Calloc(1, sizeof(TraceRing));
+      pthread_mutex_lock(&rings_mutex);
+      ring->next = rings;
+      rings = ring;
+      pthread_mutex_unlock(&rings_mutex);
+   }
+   memset(&current, 0, sizeof(current));
+   strcpy(current.url, "-");
+   current.outcome = "none";
+   clock_gettime(CLOCK_REALTIME, &ts);
+   current.wall_ms = ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+   current.start_ns = reqtrace_now();
+   active = 1;
+}
+
+/* Adds the time since start to span. Threads that aren't on a request
+ (prefetching, revalidating) come through here too and are ignored. */
+void reqtrace_span(int span, long long start) {
+   if (active) {
+      current.span_ns[span] += reqtrace_now() - start;
+   }
+}
+
+void reqtrace_url(char *url) {
+   if (active) {
+      snprintf(current.url, sizeof(current.url), "%s", url);
+   }
+}
+
+void reqtrace_outcome(const char *outcome) {
+   if (active) {
+      current.outcome = outcome;
+   }
+}
+
+/* Finishes the record and keeps it if it's sampled and the ring has room */
+void reqtrace_end(void) {
+   if (!active) {
+      return;
+   }
+   active = 0;
+   current.total_ns = reqtrace_now() - current.start_ns;
+   unsigned long n = __sync_add_and_fetch(&requests, 1);
+   if (n % sample_every != 0 && (slow_ns == 0 || current.total_ns < slow_ns)) {
+      return;
+   }
+   unsigned head = ring->head;
+   if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == TRACE_RING) { //export thread is behind
+      ring->dropped++;
+      return;
+   }
+   ring->records[head % TRACE_RING] = current;
+   __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE); //the record is all there before the export thread sees it
+}
+
+/*
+ * reqtrace_export - write every record waiting in the rings to fp, one
+ * line each, and a note for any that were dropped since the last time.
+ * Only one thread may call it.
+ */
+int reqtrace_export(FILE *fp) {
+   int count = 0;
+   
+   pthread_mutex_lock(&rings_mutex);
+   TraceRing *r = rings;
+   pthread_mutex_unlock(&rings_mutex); //rings are only ever added in front of this one
+   for (; r != NULL; r = r->next) {
+      unsigned head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+      for (unsigned tail = r->tail; tail != head; tail++) {
+         TraceRecord *t = &r->records[tail % TRACE_RING];
+         fprintf(fp, "%lld %lld %s %s", t->wall_ms, t->total_ns / 1000, t->outcome, t->url);
+         for (int s = 0; s < SPAN_COUNT; s++) {
+            if (t->span_ns[s] > 0) {
+               fprintf(fp, " %s=%lld", span_names[s], t->span_ns[s] / 1000);
+            }
+         }
+         fputc('\n', fp);
+         count++;
+      }
+      __atomic_store_n(&r->tail, head, __ATOMIC_RELEASE);
+      unsigned long dropped = r->dropped; //a stale read only puts the note off until next time
+      if (dropped != r->reported) {
+         fprintf(fp, "# %lu requests dropped, trace ring full\n", dropped - r->reported);
+         r->reported = dropped;
+      }
+   }
+   return count;
+}
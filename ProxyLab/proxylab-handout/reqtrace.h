@@ -0,0 +1,65 @@
+/*
+ * reqtrace.h - per-request latency spans, for finding where slow requests go
+ */
+#ifndef __REQTRACE_H__
+#define __REQTRACE_H__
+
+#include <stdio.h>
+#include "csapp.h"
+
+#define TRACE_RING 256 //finished requests each worker holds until the export thread takes them
+#define TRACE_URL_LEN 160 //bytes of URL kept with each request, the rest is cut off
+#define TRACE_EXPORT_SECS 1 //how often the proxy writes the rings out
+
+/* Phases of a request, in the order http_proxy goes through them */
+enum {
+   SPAN_READ, //read_request, the client sending its headers
+   SPAN_PARSE, //splitting the URI and making the canonical URL
+   SPAN_LOOKUP, //memory cache, lock wait included
+   SPAN_SHARED, //prefork shared memory cache
+   SPAN_DISK, //disk tier
+   SPAN_PEER, //asking a sibling proxy
+   SPAN_BUILD, //build_http_request
+   SPAN_CONNECT, //connecting to the server (or the sibling)
+   SPAN_SEND, //writing the request to it
+   SPAN_FIRST_BYTE, //waiting for it to start answering
+   SPAN_UPSTREAM, //reading the rest of the answer
+   SPAN_CLIENT_WRITE, //writing to the client, from the cache or as the answer comes in
+   SPAN_STORE, //putting the answer in the cache
+   SPAN_COUNT
+};
+
+/* One finished request */
+typedef struct {
+   long long start_ns; //monotonic, when a worker picked it up
+   long long wall_ms; //Unix time then, to line it up with log.txt
+   long long total_ns; //until the worker was done with it
+   long long span_ns[SPAN_COUNT]; //time in each phase, a phase that came up more than once summed
+   const char *outcome; //how it was answered, "hit", "miss" and so on
+   char url[TRACE_URL_LEN];
+} TraceRecord;
+
+/* A worker's finished requests. Only the worker moves head and only the
+ export thread moves tail, so neither takes a lock. */
+typedef struct TraceRing TraceRing;
+struct TraceRing {
+   TraceRecord records[TRACE_RING];
+   unsigned head; //next slot the worker fills
+   unsigned tail; //next slot the export thread reads
+   unsigned long dropped; //requests lost to a full ring
+   unsigned long reported; //of those, already noted in the export
+   TraceRing *next; //every worker's ring, for the export thread
+};
+
+extern const char *span_names[SPAN_COUNT];
+
+void reqtrace_init(int every, long slow_ms); //keep 1 in every requests and all over slow_ms, 0 for none
+long long reqtrace_now(void); //monotonic ns, 0 with tracing off
+void reqtrace_begin(void);
+void reqtrace_span(int span, long long start); //start from reqtrace_now, up to now goes to span
+void reqtrace_url(char *url);
+void reqtrace_outcome(const char *outcome); //a constant string
+void reqtrace_end(void);
+int reqtrace_export(FILE *fp); //writes and empties every ring, returns how many requests
+
+#endif /* __REQTRACE_H__ */
@@ -0,0 +1,353 @@
+/*
+ * shmcache.c - a response cache in shared memory, for prefork workers
+ *
+ * With -w the proxy runs as several worker processes so one crashing
+ * doesn't take the others down, but a CacheList on each one's heap would
+ * give each its own small cache. This one lives in a MAP_SHARED segment
+ * mapped before the fork, so every worker sees the same objects under the
+ * same LRU order and N workers hit as often as one process would.
+ *
+ * Nothing in the segment is a pointer: entries and blocks are found by
+ * index, so the layout doesn't care where it is mapped. Each entry's key
+ * and response sit in a chain of fixed size blocks, which keeps allocation
+ * a free list pop and can't fragment. There are enough blocks that the
+ * byte capacity runs out before they do. A hash index finds keys and a
+ * doubly linked list keeps the LRU order, both by index.
+ *
+ * Which request headers a URL's responses vary on is learned by whichever
+ * worker fetched it, so those names are kept in the segment too, in a
+ * small table probed from the URL's hash. Otherwise each worker would
+ * build its own keys for the URL and miss what the others stored.
+ *
+ * One robust, process-shared mutex guards it all. Lookups copy the
+ * response out while holding it, which for an object under 100KB is a
+ * memcpy. If a worker dies holding the mutex the next one to take it
+ * can't trust the lists, so it empties the cache and carries on.
+ */
+#include "shmcache.h"
+
+/* FNV-1a */
+static uint32_t key_hash(char *key) {
+   uint32_t h = 2166136261u;
+   while (*key) {
+      h ^= (unsigned char) *key++;
+      h *= 16777619u;
+   }
+   return h;
+}
+
+/* Empties the cache: every entry and block back on its free list */
+static void shm_reset(ShmCache *sc) {
+   ShmHeader *h = sc->h;
+   
+   h->used = 0;
+   h->first = h->last = 0;
+   memset(h->buckets, 0, sizeof(h->buckets));
+   for (uint32_t i = 0; i < SHM_ENTRIES; i++) {
+      h->entries[i].hash_next = i + 2 <= SHM_ENTRIES ? i + 2 : 0;
+   }
+   h->free_entries = 1;
+   for (uint32_t i = 0; i < h->nblocks; i++) {
+      sc->links[i] = i + 2 <= h->nblocks ? i + 2 : 0;
+   }
+   h->free_blocks = 1;
+   h->free_count = h->nblocks;
+   memset(h->vary, 0, sizeof(h->vary));
+}
+
+static void shm_lock(ShmCache *sc) {
+   if (pthread_mutex_lock(&sc->h->mutex) == EOWNERDEAD) { //a worker died halfway through changing something
+      shm_reset(sc);
+      pthread_mutex_consistent(&sc->h->mutex);
+   }
+}
+
+static void shm_unlock(ShmCache *sc) {
+   pthread_mutex_unlock(&sc->h->mutex);
+}
+
+/*
+ * shmcache_create - map a shared segment for capacity bytes of keys and
+ * responses and set it up empty. Call it before forking.
+ */
+int shmcache_create(ShmCache *sc, size_t capacity) {
+   pthread_mutexattr_t attr;
+   uint32_t nblocks = capacity / SHM_BLOCK + SHM_ENTRIES; //each entry wastes less than a block at the end of its chain
+   size_t links_at = sizeof(ShmHeader);
+   size_t blocks_at = links_at + nblocks * sizeof(uint32_t);
+   
+   sc->map_size = blocks_at + (size_t) nblocks * SHM_BLOCK;
+   void *base = mmap(NULL, sc->map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+   if (base == MAP_FAILED) {
+      return -1;
+   }
+   sc->h = base;
+   sc->links = (uint32_t *) ((char *) base + links_at);
+   sc->blocks = (char *) base + blocks_at;
+   
+   pthread_mutexattr_init(&attr);
+   pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+   pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+   pthread_mutex_init(&sc->h->mutex, &attr);
+   pthread_mutexattr_destroy(&attr);
+   sc->h->capacity = capacity;
+   sc->h->nblocks = nblocks;
+   shm_reset(sc);
+   return 0;
+}
+
+/* Copies len bytes starting off bytes into e's chain out to dst */
+static void chain_read(ShmCache *sc, ShmEntry *e, size_t off, char *dst, size_t len) {
+   uint32_t b = e->first_block;
+   
+   for (; off >= SHM_BLOCK; off -= SHM_BLOCK) {
+      b = sc->links[b - 1];
+   }
+   while (len > 0) {
+      size_t n = SHM_BLOCK - off < len ? SHM_BLOCK - off : len;
+      memcpy(dst, sc->blocks + (size_t) (b - 1) * SHM_BLOCK + off, n);
+      dst += n;
+      len -= n;
+      off = 0;
+      b = sc->links[b - 1];
+   }
+}
+
+/* Copies len bytes from src into e's chain starting off bytes in */
+static void chain_write(ShmCache *sc, ShmEntry *e, size_t off, char *src, size_t len) {
+   uint32_t b = e->first_block;
+   
+   for (; off >= SHM_BLOCK; off -= SHM_BLOCK) {
+      b = sc->links[b - 1];
+   }
+   while (len > 0) {
+      size_t n = SHM_BLOCK - off < len ? SHM_BLOCK - off : len;
+      memcpy(sc->blocks + (size_t) (b - 1) * SHM_BLOCK + off, src, n);
+      src += n;
+      len -= n;
+      off = 0;
+      b = sc->links[b - 1];
+   }
+}
+
+/* Whether e's key is key, which is key_len bytes */
+static int chain_matches(ShmCache *sc, ShmEntry *e, char *key, size_t key_len) {
+   uint32_t b = e->first_block;
+   
+   if (e->key_len != key_len) {
+      return 0;
+   }
+   for (size_t off = 0; off < key_len; off += SHM_BLOCK) {
+      size_t n = key_len - off < SHM_BLOCK ? key_len - off : SHM_BLOCK;
+      if (memcmp(sc->blocks + (size_t) (b - 1) * SHM_BLOCK, key + off, n) != 0) {
+         return 0;
+      }
+      b = sc->links[b - 1];
+   }
+   return 1;
+}
+
+/* The entry cached under key, 0 if there isn't one. Caller holds the mutex. */
+static uint32_t shm_find(ShmCache *sc, char *key, uint32_t hash) {
+   size_t key_len = strlen(key);
+   uint32_t i = sc->h->buckets[hash % SHM_BUCKETS];
+   
+   while (i != 0) {
+      ShmEntry *e = &sc->h->entries[i - 1];
+      if (e->hash == hash && chain_matches(sc, e, key, key_len)) {
+         return i;
+      }
+      i = e->hash_next;
+   }
+   return 0;
+}
+
+/* Takes entry i off the LRU list */
+static void lru_unlink(ShmHeader *h, uint32_t i) {
+   ShmEntry *e = &h->entries[i - 1];
+   
+   if (e->prev != 0) {
+      h->entries[e->prev - 1].next = e->next;
+   }
+   else {
+      h->first = e->next;
+   }
+   if (e->next != 0) {
+      h->entries[e->next - 1].prev = e->prev;
+   }
+   else {
+      h->last = e->prev;
+   }
+}
+
+/* Puts entry i at the front of the LRU list */
+static void lru_push(ShmHeader *h, uint32_t i) {
+   ShmEntry *e = &h->entries[i - 1];
+   
+   e->prev = 0;
+   e->next = h->first;
+   if (h->first != 0) {
+      h->entries[h->first - 1].prev = i;
+   }
+   h->first = i;
+   if (h->last == 0) {
+      h->last = i;
+   }
+}
+
+/* Drops entry i from the index and the LRU list and frees its blocks */
+static void shm_remove(ShmCache *sc, uint32_t i) {
+   ShmHeader *h = sc->h;
+   ShmEntry *e = &h->entries[i - 1];
+   uint32_t *link = &h->buckets[e->hash % SHM_BUCKETS];
+   
+   while (*link != i) {
+      link = &h->entries[*link - 1].hash_next;
+   }
+   *link = e->hash_next;
+   lru_unlink(h, i);
+   
+   uint32_t last = e->first_block, count = 1;
+   while (sc->links[last - 1] != 0) {
+      last = sc->links[last - 1];
+      count++;
+   }
+   sc->links[last - 1] = h->free_blocks;
+   h->free_blocks = e->first_block;
+   h->free_count += count;
+   h->used -= e->key_len + e->size;
+   
+   e->hash_next = h->free_entries;
+   h->free_entries = i;
+}
+
+/*
+ * shmcache_get - a Malloc'd copy of the response cached under key, with
+ * its size and when it was stored, or NULL. A hit moves it to the front.
+ */
+char *shmcache_get(ShmCache *sc, char *key, size_t *size, time_t *stored) {
+   char *copy = NULL;
+   
+   shm_lock(sc);
+   uint32_t i = shm_find(sc, key, key_hash(key));
+   if (i != 0) {
+      ShmEntry *e = &sc->h->entries[i - 1];
+      copy = Malloc(e->size ? e->size : 1);
+      chain_read(sc, e, e->key_len, copy, e->size);
+      *size = e->size;
+      *stored = e->stored;
+      lru_unlink(sc->h, i);
+      lru_push(sc->h, i);
+   }
+   shm_unlock(sc);
+   return copy;
+}
+
+/* Whether anything is cached under key, without counting it as a use */
+int shmcache_contains(ShmCache *sc, char *key) {
+   shm_lock(sc);
+   int found = shm_find(sc, key, key_hash(key)) != 0;
+   shm_unlock(sc);
+   return found;
+}
+
+/*
+ * shmcache_put - cache a copy of size bytes of item under key, replacing
+ * what was there and evicting least recently used entries until it fits.
+ * Too big for the whole cache and it is quietly not cached.
+ */
+void shmcache_put(ShmCache *sc, char *key, char *item, size_t size, time_t stored) {
+   ShmHeader *h;
+   size_t key_len = strlen(key);
+   size_t total = key_len + size;
+   uint32_t need = (total + SHM_BLOCK - 1) / SHM_BLOCK;
+   uint32_t hash = key_hash(key);
+   
+   if (total > sc->h->capacity || total == 0) {
+      return;
+   }
+   shm_lock(sc);
+   h = sc->h;
+   uint32_t old = shm_find(sc, key, hash);
+   if (old != 0) {
+      shm_remove(sc, old);
+   }
+   while (h->last != 0 && (h->used + total > h->capacity || h->free_count < need || h->free_entries == 0)) {
+      shm_remove(sc, h->last);
+   }
+   
+   uint32_t i = h->free_entries;
+   ShmEntry *e = &h->entries[i - 1];
+   h->free_entries = e->hash_next;
+   e->hash = hash;
+   e->key_len = key_len;
+   e->size = size;
+   e->stored = stored;
+   e->first_block = h->free_blocks;
+   
+   uint32_t b = e->first_block; //the chain is the first need blocks off the free list
+   for (uint32_t n = 1; n < need; n++) {
+      b = sc->links[b - 1];
+   }
+   h->free_blocks = sc->links[b - 1];
+   sc->links[b - 1] = 0;
+   h->free_count -= need;
+   chain_write(sc, e, 0, key, key_len);
+   chain_write(sc, e, key_len, item, size);
+   h->used += total;
+   
+   e->hash_next = h->buckets[hash % SHM_BUCKETS];
+   h->buckets[hash % SHM_BUCKETS] = i;
+   lru_push(h, i);
+   shm_unlock(sc);
+}
+
+/* The slot holding url's names, or if there's none the first free slot
+ probed, or failing that the first probed. Caller holds the mutex. */
+static ShmVary *vary_slot(ShmCache *sc, uint32_t hash, int *found) {
+   ShmVary *free_slot = NULL;
+   
+   for (int i = 0; i < SHM_VARY_PROBE; i++) {
+      ShmVary *v = &sc->h->vary[(hash + i) % SHM_VARY];
+      if (v->names[0] != '\0' && v->hash == hash) {
+         *found = 1;
+         return v;
+      }
+      if (v->names[0] == '\0' && free_slot == NULL) {
+         free_slot = v;
+      }
+   }
+   *found = 0;
+   return free_slot != NULL ? free_slot : &sc->h->vary[hash % SHM_VARY];
+}
+
+/* Copies the Vary names any worker recorded for url into names */
+int shmcache_vary_get(ShmCache *sc, char *url, char *names) {
+   int found;
+   
+   shm_lock(sc);
+   ShmVary *v = vary_slot(sc, key_hash(url), &found);
+   if (found) {
+      memcpy(names, v->names, SHM_VARY_LEN);
+   }
+   shm_unlock(sc);
+   return found;
+}
+
+/* Records names for url for every worker, pushing out another URL's if
+ every probed slot is taken. Names too long for a slot are cut short. */
+void shmcache_vary_set(ShmCache *sc, char *url, char *names) {
+   uint32_t hash = key_hash(url);
+   int found;
+   
+   shm_lock(sc);
+   ShmVary *v = vary_slot(sc, hash, &found);
+   if (names[0] != '\0') {
+      v->hash = hash;
+      snprintf(v->names, SHM_VARY_LEN, "%s", names);
+   }
+   else if (found) {
+      v->names[0] = '\0';
+   }
+   shm_unlock(sc);
+}
@@ -0,0 +1,67 @@
+/*
+ * shmcache.h - a response cache in shared memory, for prefork workers
+ */
+#ifndef __SHMCACHE_H__
+#define __SHMCACHE_H__
+
+#include <stdint.h>
+#include "csapp.h"
+
+#define SHM_BLOCK 1024 //bytes per block, an entry's key and response fill a chain of them
+#define SHM_ENTRIES 2048 //most objects the cache can hold, whatever their size
+#define SHM_BUCKETS 4096 //hash index buckets
+#define SHM_VARY 1024 //URLs whose Vary header names the workers share
+#define SHM_VARY_PROBE 8 //slots tried for a URL's names
+#define SHM_VARY_LEN 256 //room for one URL's names, the proxy's VALIDATOR_LEN
+
+/* Links are indexes plus one, so 0 means none and the segment works at any address */
+typedef struct {
+   uint32_t hash; //hash of the key, checked before the key itself
+   uint32_t hash_next; //next entry in the same bucket, or the next free entry
+   uint32_t prev; //more recently used neighbour
+   uint32_t next; //less recently used neighbour
+   uint32_t first_block; //key then response, spread over a chain of blocks
+   uint32_t key_len; //bytes of key at the start of the chain
+   size_t size; //bytes of response after the key
+   time_t stored; //when the response came back from the server
+} ShmEntry;
+
+/* One URL's Vary header names, found by the URL's hash alone. A collision
+ can only add lines to a key that starts with the URL, never merge two URLs. */
+typedef struct {
+   uint32_t hash; //hash of the URL
+   char names[SHM_VARY_LEN]; //lowercased and comma separated, empty for a free slot
+} ShmVary;
+
+/* The start of the segment, everything else in it hangs off this */
+typedef struct {
+   pthread_mutex_t mutex; //process shared and robust, so a worker dying with it held doesn't wedge the rest
+   size_t capacity; //bytes of keys and responses the cache may hold
+   size_t used; //bytes of keys and responses it holds
+   uint32_t first; //most recently used entry
+   uint32_t last; //least recently used, evicted first
+   uint32_t free_entries; //unused entries, chained through hash_next
+   uint32_t free_blocks; //unused blocks, chained through the block links
+   uint32_t free_count; //blocks on free_blocks
+   uint32_t nblocks; //blocks in the segment
+   uint32_t buckets[SHM_BUCKETS]; //hash index, first entry in each bucket
+   ShmEntry entries[SHM_ENTRIES];
+   ShmVary vary[SHM_VARY]; //what each URL varies on, so every worker keys it the same way
+} ShmHeader;
+
+/* One process's view of the segment. Made before fork, so every worker shares it. */
+typedef struct {
+   ShmHeader *h; //start of the mapping
+   uint32_t *links; //next block in each block's chain
+   char *blocks; //the blocks themselves
+   size_t map_size; //bytes mapped
+} ShmCache;
+
+int shmcache_create(ShmCache *sc, size_t capacity); //-1 if the segment couldn't be mapped
+char *shmcache_get(ShmCache *sc, char *key, size_t *size, time_t *stored); //Malloc'd copy, NULL on a miss
+int shmcache_contains(ShmCache *sc, char *key);
+void shmcache_put(ShmCache *sc, char *key, char *item, size_t size, time_t stored);
+int shmcache_vary_get(ShmCache *sc, char *url, char *names); //1 and SHM_VARY_LEN bytes of names if url varies
+void shmcache_vary_set(ShmCache *sc, char *url, char *names); //"" forgets url
+
+#endif /* __SHMCACHE_H__ */
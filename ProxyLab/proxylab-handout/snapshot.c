@@ -0,0 +1,146 @@
+/*
+ * snapshot.c - single file image of the proxy's memory cache for warm restarts
+ *
+ * The image is built in memory first (the caller copies the cache into it
+ * while holding its lock, which is a memcpy of at most MAX_CACHE_SIZE) and
+ * then written to <path>.tmp and renamed over <path>, so a crash mid-write
+ * never leaves a half snapshot behind. Loading maps the file and hands
+ * pointers into the mapping to a callback, nothing is read() or parsed
+ * beyond the record headers.
+ */
+#include "snapshot.h"
+
+static void snapshot_reserve(Snapshot *snap, size_t more) {
+   if (snap->len + more <= snap->cap) {
+      return;
+   }
+   while (snap->len + more > snap->cap) {
+      snap->cap *= 2;
+   }
+   snap->buf = Realloc(snap->buf, snap->cap);
+}
+
+/* Start an empty image with room for about hint bytes of records */
+void snapshot_init(Snapshot *snap, size_t hint) {
+   SnapHeader hdr;
+
+   snap->cap = sizeof(SnapHeader) + (hint ? hint : MAXBUF);
+   snap->buf = Malloc(snap->cap);
+   snap->len = sizeof(SnapHeader);
+
+   memset(&hdr, 0, sizeof(hdr));
+   hdr.magic = SNAPSHOT_MAGIC;
+   hdr.version = SNAPSHOT_VERSION;
+   memcpy(snap->buf, &hdr, sizeof(hdr));
+}
+
+/* Append one entry, its response given as the header block and the body
+ (stored back to back). Entries must be added least recently used first. */
+void snapshot_add(Snapshot *snap, char *key, void *head, size_t head_len, void *body, size_t body_len, time_t stored) {
+   SnapRecord rec;
+   SnapHeader *hdr;
+
+   rec.key_len = strlen(key) + 1;
+   rec.body_len = head_len + body_len;
+   rec.stored = stored;
+   snapshot_reserve(snap, sizeof(rec) + rec.key_len + rec.body_len);
+   memcpy(snap->buf + snap->len, &rec, sizeof(rec));
+   memcpy(snap->buf + snap->len + sizeof(rec), key, rec.key_len);
+   memcpy(snap->buf + snap->len + sizeof(rec) + rec.key_len, head, head_len);
+   memcpy(snap->buf + snap->len + sizeof(rec) + rec.key_len + head_len, body, body_len);
+   snap->len += sizeof(rec) + rec.key_len + rec.body_len;
+
+   hdr = (SnapHeader *) snap->buf;
+   hdr->count++;
+   hdr->bytes = snap->len - sizeof(SnapHeader);
+}
+
+void snapshot_free(Snapshot *snap) {
+   free(snap->buf);
+   snap->buf = NULL;
+   snap->len = snap->cap = 0;
+}
+
+/*
+ * snapshot_save - write the image to path.tmp, fsync it and rename it over
+ * path. Returns -1 and leaves path untouched on any error.
+ */
+int snapshot_save(Snapshot *snap, char *path) {
+   char tmp[MAXLINE];
+   int fd;
+
+   if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int) sizeof(tmp)) {
+      return -1;
+   }
+   if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, DEF_MODE)) < 0) {
+      return -1;
+   }
+   if (rio_writen(fd, snap->buf, snap->len) != (ssize_t) snap->len || fsync(fd) < 0) {
+      close(fd);
+      unlink(tmp);
+      return -1;
+   }
+   close(fd);
+   if (rename(tmp, path) < 0) {
+      unlink(tmp);
+      return -1;
+   }
+   return 0;
+}
+
+/*
+ * snapshot_load - map the snapshot at path and call fn for every record in
+ * least to most recently used order. key and item point into the mapping and
+ * are only valid during the call. Returns the number of records or -1 if the
+ * file is missing or not a snapshot. A record running off the end of the
+ * file stops the load, everything before it is still handed out.
+ */
+int snapshot_load(char *path, snapshot_fn *fn, void *arg) {
+   struct stat st;
+   SnapHeader hdr;
+   char *map;
+   size_t off;
+   int fd, n = 0;
+
+   if ((fd = open(path, O_RDONLY)) < 0) {
+      return -1;
+   }
+   if (fstat(fd, &st) < 0 || st.st_size < (off_t) sizeof(SnapHeader)) {
+      close(fd);
+      return -1;
+   }
+   map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if (map == MAP_FAILED) {
+      return -1;
+   }
+   madvise(map, st.st_size, MADV_WILLNEED); //start faulting the whole file in now
+
+   memcpy(&hdr, map, sizeof(hdr));
+   if (hdr.magic != SNAPSHOT_MAGIC || hdr.version != SNAPSHOT_VERSION) {
+      munmap(map, st.st_size);
+      return -1;
+   }
+
+   off = sizeof(SnapHeader);
+   for (uint32_t i = 0; i < hdr.count; i++) {
+      SnapRecord rec;
+      if (off + sizeof(rec) > (size_t) st.st_size) {
+         break;
+      }
+      memcpy(&rec, map + off, sizeof(rec));
+      if (rec.key_len == 0 || off + sizeof(rec) + rec.key_len + rec.body_len > (size_t) st.st_size) {
+         break;
+      }
+      char *key = map + off + sizeof(rec);
+      if (key[rec.key_len - 1] != '\0') {
+         break;
+      }
+      fn(key, key + rec.key_len, rec.body_len, rec.stored, arg);
+      off += sizeof(rec) + rec.key_len + rec.body_len;
+      n++;
+   }
+
+   munmap(map, st.st_size);
+   return n;
+}
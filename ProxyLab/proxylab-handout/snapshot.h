@@ -0,0 +1,44 @@
+/*
+ * snapshot.h - single file image of the proxy's memory cache for warm restarts
+ */
+#ifndef __SNAPSHOT_H__
+#define __SNAPSHOT_H__
+
+#include <stdint.h>
+#include "csapp.h"
+
+#define SNAPSHOT_MAGIC 0x50534e50 //"PNSP" at the start of a snapshot file
+#define SNAPSHOT_VERSION 2
+
+/* File header, followed by count records in least to most recently used order */
+typedef struct {
+   uint32_t magic; //always SNAPSHOT_MAGIC
+   uint32_t version; //SNAPSHOT_VERSION the file was written with
+   uint32_t count; //number of records
+   uint32_t unused; //keeps the records 8 byte aligned
+   uint64_t bytes; //bytes of records following the header
+} SnapHeader;
+
+/* Each record is this, then key_len bytes of key (NUL included), then the body */
+typedef struct {
+   uint32_t key_len; //length of the key including its NUL
+   uint32_t body_len; //length of the body
+   int64_t stored; //when the proxy got the response from the server
+} SnapRecord;
+
+/* In-memory image being built up before it is written out */
+typedef struct {
+   char *buf; //header and records exactly as they go to disk
+   size_t len; //bytes used in buf
+   size_t cap; //bytes allocated for buf
+} Snapshot;
+
+typedef void snapshot_fn(char *key, void *item, size_t size, time_t stored, void *arg);
+
+void snapshot_init(Snapshot *snap, size_t hint);
+void snapshot_add(Snapshot *snap, char *key, void *head, size_t head_len, void *body, size_t body_len, time_t stored);
+int snapshot_save(Snapshot *snap, char *path); //write to path atomically, -1 on error
+void snapshot_free(Snapshot *snap);
+int snapshot_load(char *path, snapshot_fn *fn, void *arg); //number of records loaded or -1
+
+#endif /* __SNAPSHOT_H__ */
@@ -1,38 +1,101 @@
 /*
  * adder.c - a minimal CGI program that adds two numbers together
+ *
+ * Run by Tiny as a long-lived worker (TINY_CGI_WORKER set, see
+ * ../cgipool.h) it answers one request after another on its standard
+ * input instead of the one in QUERY_STRING. Built as adder.so it is a
+ * Tiny plugin instead (see ../plugin.h), and isn't run at all.
  */
 /* $begin adder */
+#include <stdint.h>
 #include "csapp.h"
+#include "plugin.h"
 
-int main(void) {
-    char *buf, *p;
-    char arg1[MAXLINE], arg2[MAXLINE], content[MAXLINE];
+/*
+ * add - the response body for query "n1&n2" into content, MAXLINE bytes
+ */
+static void add(char *query, char *content) {
+    char *p;
+    char arg1[MAXLINE], arg2[MAXLINE];
     int n1=0, n2=0;
 
     /* Extract the two arguments */
-    if ((buf = getenv("QUERY_STRING")) != NULL) {
-	p = strchr(buf, '&');
+    if (query != NULL && (p = strchr(query, '&')) != NULL) {
 	*p = '\0';
-	strcpy(arg1, buf);
+	strcpy(arg1, query);
 	strcpy(arg2, p+1);
 	n1 = atoi(arg1);
 	n2 = atoi(arg2);
     }
 
     /* Make the response body */
-    sprintf(content, "Welcome to add.com: ");
-    sprintf(content, "%sTHE Internet addition portal.\r\n<p>", content);
-    sprintf(content, "%sThe answer is: %d + %d = %d\r\n<p>", 
-	    content, n1, n2, n1 + n2);
-    sprintf(content, "%sThanks for visiting!\r\n", content);
-  
-    /* Generate the HTTP response */
-    printf("Connection: close\r\n");
-    printf("Content-length: %d\r\n", (int)strlen(content));
-    printf("Content-type: text/html\r\n\r\n");
-    printf("%s", content);
-    fflush(stdout);
+    snprintf(content, MAXLINE, "Welcome to add.com: "
+	     "THE Internet addition portal.\r\n<p>"
+	     "The answer is: %d + %d = %d\r\n<p>"
+	     "Thanks for visiting!\r\n", n1, n2, n1 + n2);
+}
 
+/*
+ * respond - the CGI response for query, headers and body, into out,
+ * MAXBUF bytes
+ */
+static void respond(char *query, char *out) {
+    char content[MAXLINE];
+    int n;
+
+    add(query, content);
+    n = snprintf(out, MAXBUF, "Connection: close\r\n"
+		 "Content-length: %d\r\n"
+		 "Content-type: text/html\r\n\r\n", (int)strlen(content));
+    snprintf(out + n, MAXBUF - n, "%s", content);
+}
+
+/* Tiny's entry point when this is adder.so */
+int tiny_handle(const char *query, tiny_response_t *res) {
+    char args[MAXLINE], content[MAXLINE];
+
+    snprintf(args, sizeof(args), "%s", query); /* add writes into it */
+    add(args, content);
+    return tiny_write(res, content, strlen(content));
+}
+
+/* Reads or writes all n bytes at buf on fd, 0 if it couldn't */
+static int whole(int fd, void *buf, size_t n, int writing) {
+    char *p = buf;
+
+    while (n > 0) {
+	ssize_t done = writing ? write(fd, p, n) : read(fd, p, n);
+	if (done < 0 && errno == EINTR)
+	    continue;
+	if (done <= 0)
+	    return 0;
+	p += done;
+	n -= done;
+    }
+    return 1;
+}
+
+int main(void) {
+    char query[MAXLINE], out[MAXBUF];
+    uint32_t len;
+
+    if (getenv("TINY_CGI_WORKER") == NULL) { /* Run once, as CGI */
+	respond(getenv("QUERY_STRING"), out);
+	printf("%s", out);
+	fflush(stdout);
+	exit(0);
+    }
+
+    /* Answer Tiny until it closes the socket */
+    while (whole(STDIN_FILENO, &len, sizeof(len), 0) && len < MAXLINE &&
+	   whole(STDIN_FILENO, query, len, 0)) {
+	query[len] = '\0';
+	respond(query, out);
+	len = strlen(out);
+	if (!whole(STDIN_FILENO, &len, sizeof(len), 1) ||
+	    !whole(STDIN_FILENO, out, len, 1))
+	    break;
+    }
     exit(0);
 }
 /* $end adder */
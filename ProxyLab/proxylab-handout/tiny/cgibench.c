@@ -0,0 +1,224 @@
+/*
+ * cgibench.c - how fast Tiny answers a dynamic request, run three ways
+ *
+ * Starts ./tiny -c in turn as plain CGI (a fork and exec per request),
+ * with -p (pooled CGI workers) and with -l (the program's plugin, called
+ * in process), and for each has client threads request the same dynamic
+ * URI for a while. Prints requests per second and mean latency. With -k
+ * the clients keep connections open where Tiny lets them, which only a
+ * plugin's responses do; otherwise every request is a new connection.
+ *
+ * usage: ./cgibench [-t threads] [-s seconds] [-k] [-u uri] [port]
+ */
+#include "csapp.h"
+
+#define BENCH_THREADS 4
+#define BENCH_SECS 3
+#define BENCH_URI "/cgi-bin/adder?1&2"
+#define BENCH_PORT "15099"
+
+typedef struct {
+	long		requests;
+	long		errors;	/* connections refused or answers cut off */
+	double		latency;	/* seconds, summed over requests */
+} result_t;
+
+char	       *port = BENCH_PORT, *uri = BENCH_URI;
+int		keepalive;
+double		deadline;
+
+double
+now(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * fetch - one request on *fd, connecting first if it's -1. Leaves *fd
+ * open if the answer had a length and Tiny kept the connection. Returns
+ * 0 for a whole answer.
+ */
+int
+fetch(int *fd)
+{
+	char		buf       [MAXBUF], req[MAXLINE];
+	size_t		have = 0, end = 0;
+	long		length = -1;
+	int		closing = !keepalive;
+	ssize_t		n;
+
+	if (*fd < 0 && (*fd = open_clientfd("localhost", port)) < 0)
+		return -1;
+	n = snprintf(req, sizeof(req), "GET %s HTTP/1.1\r\nHost: localhost\r\n%s\r\n",
+		     uri, keepalive ? "" : "Connection: close\r\n");
+	if (rio_writen(*fd, req, n) != n)
+		goto fail;
+
+	/* Headers */
+	while (end == 0)
+	{
+		if (have == sizeof(buf) - 1 || (n = read(*fd, buf + have, sizeof(buf) - 1 - have)) <= 0)
+			goto fail;
+		have += n;
+		buf[have] = '\0';
+		char	       *blank = strstr(buf, "\r\n\r\n");
+		if (blank != NULL)
+			end = blank + 4 - buf;
+	}
+	for (char *line = buf; line < buf + end; line = strchr(line, '\n') + 1)
+	{
+		if (!strncasecmp(line, "Content-length:", 15))
+			length = atol(line + 15);
+		else if (!strncasecmp(line, "Connection: close", 17))
+			closing = 1;
+	}
+
+	/* Body, by its length or to the end of the connection */
+	have -= end;
+	while (length < 0 || have < length)
+	{
+		if ((n = read(*fd, buf, sizeof(buf))) < 0)
+			goto fail;
+		if (n == 0)
+		{
+			if (length >= 0)
+				goto fail;
+			closing = 1;
+			break;
+		}
+		have += n;
+	}
+	if (closing || length < 0)
+	{
+		close(*fd);
+		*fd = -1;
+	}
+	return 0;
+
+fail:
+	close(*fd);
+	*fd = -1;
+	return -1;
+}
+
+void           *
+client(void *vargp)
+{
+	result_t       *r = vargp;
+	int		fd = -1;
+	double		t;
+
+	while ((t = now()) < deadline)
+	{
+		if (fetch(&fd) < 0)
+		{
+			r->errors++;
+			continue;
+		}
+		r->requests++;
+		r->latency += now() - t;
+	}
+	if (fd >= 0)
+		close(fd);
+	return NULL;
+}
+
+/*
+ * bench - start Tiny with mode's flag, load it for secs with nthreads
+ * clients, and print how it did
+ */
+void
+bench(char *name, char *flag, int nthreads, int secs)
+{
+	pthread_t      *tids = Malloc(nthreads * sizeof(pthread_t));
+	result_t       *results = Calloc(nthreads, sizeof(result_t));
+	result_t	all = {0, 0, 0};
+	pid_t		pid;
+	int		fd = -1, tries;
+	double		start;
+
+	if ((pid = Fork()) == 0)
+	{
+		int		null = Open("/dev/null", O_WRONLY, 0);
+
+		Dup2(null, STDOUT_FILENO);
+		Dup2(null, STDERR_FILENO);
+		execl("./tiny", "tiny", port, "-c", flag, (char *)NULL);
+		_exit(127);
+	}
+	for (tries = 0; tries < 100 && (fd = open_clientfd("localhost", port)) < 0; tries++)
+		usleep(20000);	/* until it's listening */
+	if (fd < 0)
+	{
+		fprintf(stderr, "Tiny didn't start on port %s\n", port);
+		kill(pid, SIGTERM);
+		exit(1);
+	}
+	close(fd);
+	fd = -1;
+	if (fetch(&fd) < 0)	/* starts the workers, loads the plugin */
+		fprintf(stderr, "%s: warm up request failed\n", name);
+	if (fd >= 0)
+		close(fd);
+
+	start = now();
+	deadline = start + secs;
+	for (int i = 0; i < nthreads; i++)
+		Pthread_create(&tids[i], NULL, client, &results[i]);
+	for (int i = 0; i < nthreads; i++)
+	{
+		Pthread_join(tids[i], NULL);
+		all.requests += results[i].requests;
+		all.errors += results[i].errors;
+		all.latency += results[i].latency;
+	}
+	printf("%-8s %12.0f %12.1f %8ld\n", name, all.requests / (now() - start),
+	       all.requests ? all.latency / all.requests * 1e6 : 0, all.errors);
+	fflush(stdout);
+
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+	Free(tids);
+	Free(results);
+}
+
+int
+main(int argc, char **argv)
+{
+	int		nthreads = BENCH_THREADS, secs = BENCH_SECS, opt;
+
+	while ((opt = getopt(argc, argv, "t:s:ku:")) != -1)
+	{
+		switch (opt)
+		{
+		case 't':
+			nthreads = atoi(optarg);
+			break;
+		case 's':
+			secs = atoi(optarg);
+			break;
+		case 'k':
+			keepalive = 1;
+			break;
+		case 'u':
+			uri = optarg;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-t threads] [-s seconds] [-k] [-u uri] [port]\n", argv[0]);
+			exit(1);
+		}
+	}
+	if (optind < argc)
+		port = argv[optind];
+	Signal(SIGPIPE, SIG_IGN);
+
+	printf("%s, %d threads, %d s each%s\n", uri, nthreads, secs, keepalive ? ", keep-alive" : "");
+	printf("%-8s %12s %12s %8s\n", "mode", "requests/s", "latency us", "errors");
+	bench("cgi", NULL, nthreads, secs);
+	bench("pooled", "-p", nthreads, secs);
+	bench("plugin", "-l", nthreads, secs);
+	return 0;
+}
@@ -0,0 +1,181 @@
+/*
+ * cgipool.c - long-lived CGI workers, so a dynamic request costs no fork
+ *
+ * serve_dynamic forks and execs the CGI program for every request, which
+ * costs far more than anything the program then does. With -p, Tiny
+ * starts a few workers for each program the first time it's asked for
+ * and hands requests to them over a socket instead (the protocol is in
+ * cgipool.h), the way FastCGI does. A request waits for a free worker if
+ * they're all busy.
+ *
+ * A worker that dies is started again on the next request that needs it,
+ * and the request it failed on falls back to a fork, as long as none of
+ * the answer had reached the client yet. A program that doesn't speak the
+ * protocol looks like a new worker that fails without sending a reply;
+ * after CGI_TRIES of those in a row, with no reply from any worker in
+ * between, it always forks. One bad query or crash only costs a worker.
+ */
+#include <stdint.h>
+#include "cgipool.h"
+
+static cgi_pool_t *pools;
+static int	pool_size;	/* workers per program, 0 with pooling off */
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void 
+cgipool_init(int nworkers)
+{
+	pool_size = nworkers;
+}
+
+/* The pool for path, made if it's new. Caller holds the mutex. */
+static cgi_pool_t *
+find_pool(char *path)
+{
+	cgi_pool_t     *p;
+	int		n;
+
+	for (p = pools; p != NULL; p = p->next)
+		if (!strcmp(p->path, path))
+			return p;
+	p = Calloc(1, sizeof(cgi_pool_t));
+	p->path = strdup(path);
+	for (n = 0; environ[n] != NULL; n++)
+		;
+	p->envp = Malloc((n + 2) * sizeof(char *));	/* made here, the child of a threaded fork mustn't malloc */
+	memcpy(p->envp, environ, n * sizeof(char *));
+	p->envp[n] = "TINY_CGI_WORKER=1";
+	p->envp[n + 1] = NULL;
+	p->fds = Malloc(pool_size * sizeof(int));
+	p->pids = Malloc(pool_size * sizeof(pid_t));
+	p->idle = Malloc(pool_size * sizeof(int));
+	for (n = 0; n < pool_size; n++)
+	{
+		p->fds[n] = -1;
+		p->idle[n] = n;
+	}
+	p->nidle = pool_size;
+	pthread_cond_init(&p->ready, NULL);
+	p->next = pools;
+	pools = p;
+	return p;
+}
+
+/* Starts worker w, 0 if it's running */
+static int 
+spawn(cgi_pool_t * p, int w)
+{
+	int		sv        [2];
+	char	       *argv[] = {p->path, NULL};
+	pid_t		pid;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0)
+		return -1;
+	if ((pid = fork()) == 0)
+	{
+		dup2(sv[1], STDIN_FILENO);
+		dup2(STDERR_FILENO, STDOUT_FILENO);	/* a stray printf mustn't reach a client */
+		execve(p->path, argv, p->envp);
+		_exit(127);
+	}
+	close(sv[1]);
+	if (pid < 0)
+	{
+		close(sv[0]);
+		return -1;
+	}
+	p->fds[w] = sv[0];
+	p->pids[w] = pid;
+	return 0;
+}
+
+static void 
+retire(cgi_pool_t * p, int w)
+{
+	close(p->fds[w]);
+	kill(p->pids[w], SIGKILL);
+	waitpid(p->pids[w], NULL, 0);
+	p->fds[w] = -1;
+}
+
+/*
+ * exchange - send query to the worker on wfd and copy its answer to the
+ * client on fd. The answer is read to the end even if the client has
+ * gone, so the worker is ready for the next one. -1 if the worker failed;
+ * *replied says whether it had started a reply, *relayed whether any of
+ * that got to the client.
+ */
+static int 
+exchange(int wfd, char *query, int fd, int *replied, int *relayed)
+{
+	uint32_t	len = strlen(query);
+	char		buf       [MAXBUF];
+	struct iovec	iov[2] = {{&len, sizeof(len)}, {query, len}};
+	struct msghdr	msg = {.msg_iov = iov,.msg_iovlen = 2};
+	int		client = 1;
+
+	if (sendmsg(wfd, &msg, MSG_NOSIGNAL) != sizeof(len) + len)
+		return -1;
+	if (rio_readn(wfd, &len, sizeof(len)) != sizeof(len))
+		return -1;
+	*replied = 1;
+	while (len > 0)
+	{
+		ssize_t		n = read(wfd, buf, len < sizeof(buf) ? len : sizeof(buf));
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		if (client && rio_writen(fd, buf, n) != n)
+			client = 0;
+		*relayed = 1;
+		len -= n;
+	}
+	return 0;
+}
+
+/*
+ * cgipool_run - answer a request for the CGI program filename with
+ * cgiargs, after the status line, on a pooled worker. 0 if it did; -1 if
+ * pooling is off or the program can't be pooled, and the caller should
+ * run it the old way.
+ */
+int 
+cgipool_run(char *filename, char *cgiargs, int fd)
+{
+	cgi_pool_t     *p;
+	int		w, ok, fresh, replied = 0, relayed = 0;
+
+	if (pool_size == 0)
+		return -1;
+	pthread_mutex_lock(&mutex);
+	p = find_pool(filename);
+	while (p->nidle == 0 && !p->broken)
+		pthread_cond_wait(&p->ready, &mutex);
+	if (p->broken)
+	{
+		pthread_mutex_unlock(&mutex);
+		return -1;
+	}
+	w = p->idle[--p->nidle];
+	pthread_mutex_unlock(&mutex);
+
+	fresh = p->fds[w] < 0;
+	if (fresh && spawn(p, w) < 0)
+		ok = fresh = 0;	/* out of processes or descriptors, that's not the program */
+	else
+		ok = exchange(p->fds[w], cgiargs, fd, &replied, &relayed) == 0;
+	if (!ok && p->fds[w] >= 0)
+		retire(p, w);	/* started again by the next request for it */
+
+	pthread_mutex_lock(&mutex);
+	if (replied)
+		p->silent = 0;
+	else if (fresh && ++p->silent >= CGI_TRIES)
+		p->broken = 1;
+	p->idle[p->nidle++] = w;
+	pthread_cond_broadcast(&p->ready);	/* broadcast, broken wakes everyone */
+	pthread_mutex_unlock(&mutex);
+	return ok || relayed ? 0 : -1;
+}
@@ -0,0 +1,39 @@
+/*
+ * cgipool.h - long-lived CGI workers, so a dynamic request costs no fork
+ *
+ * A worker is the CGI program itself, run with TINY_CGI_WORKER=1 in its
+ * environment and a Unix stream socket to Tiny as its standard input. It
+ * answers requests on that socket one at a time for as long as it runs:
+ *
+ *   request:  uint32_t length, then that many bytes of QUERY_STRING
+ *   response: uint32_t length, then that many bytes of CGI output, the
+ *             headers that follow Tiny's status line and then the body
+ *
+ * Lengths are in host byte order; both ends are on the same machine.
+ */
+#ifndef __CGIPOOL_H__
+#define __CGIPOOL_H__
+
+#include "csapp.h"
+
+#define CGI_WORKERS 4		/* workers per program, -p with no count */
+#define CGI_TRIES 3		/* new workers in a row that may fail without replying before the program isn't pooled */
+
+typedef struct cgi_pool cgi_pool_t;
+struct cgi_pool {
+	char	       *path;	/* the program, as parse_uri made it */
+	char	      **envp;	/* Tiny's environment plus TINY_CGI_WORKER */
+	int	       *fds;	/* Tiny's end of each worker's socket, -1 if it isn't running */
+	pid_t	       *pids;
+	int	       *idle;	/* workers no request is using, as a stack */
+	int		nidle;
+	int		silent;	/* new workers in a row that failed without replying, to tell a program that can't do this */
+	int		broken;	/* CGI_TRIES of them did, run it the old way */
+	pthread_cond_t	ready;	/* signalled when nidle goes up */
+	cgi_pool_t     *next;
+};
+
+void		cgipool_init(int nworkers);	/* 0 leaves every CGI program to fork per request */
+int		cgipool_run(char *filename, char *cgiargs, int fd);	/* -1 if the caller should fork */
+
+#endif				/* __CGIPOOL_H__ */
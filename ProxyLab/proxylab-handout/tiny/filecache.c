@@ -0,0 +1,285 @@
+/*
+ * filecache.c - open files and their stat results, kept for hot static files
+ *
+ * Serving a static file used to cost a stat, an open and a close (and an
+ * mmap before sendfile) on every request. This keeps the last
+ * FILECACHE_MAX regular files Tiny served open, with their stat results,
+ * so a request for a hot file makes no filesystem calls at all: the
+ * lookup is a hash probe under a mutex and the body goes out with
+ * sendfile from the cached descriptor at an explicit offset, which
+ * several workers can do at once. The response headers are made once,
+ * when the file is opened, so a hit doesn't format them either.
+ *
+ * Every cached file has an inotify watch. A thread reads the events and
+ * drops any file that is written, truncated, has its attributes changed
+ * or is unlinked or renamed away (both change the link count, which is an
+ * attribute change), so the next request opens it afresh. Requests
+ * already sending a dropped file hold a reference and finish with the
+ * old descriptor. If inotify isn't available nothing is cached.
+ *
+ * A miss adds the watch before it opens the file, and notes how many
+ * events the thread has handled. A change after the open makes an event
+ * that either comes in before the entry is published, and the count has
+ * moved so the entry isn't cached, or after, and finds the entry and
+ * drops it. While a miss is opening, its watch is on the pending list,
+ * so dropping another path to the same file doesn't remove the watch
+ * from under it.
+ */
+#include <sys/inotify.h>
+#include "filecache.h"
+
+#define FC_EVENTS (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF)
+
+static fc_entry_t *buckets[FILECACHE_BUCKETS];
+static fc_entry_t *first;	/* most recently used */
+static fc_entry_t *last;	/* least recently used, dropped first */
+static int	count;
+static int	ifd = -1;	/* inotify instance, -1 when caching is off */
+static fc_header_fn header_fn;
+static unsigned long events;	/* inotify events handled */
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* A miss between adding its watch and publishing its entry */
+typedef struct fc_pending fc_pending_t;
+struct fc_pending {
+	int		wd;
+	fc_pending_t   *next;
+};
+static fc_pending_t *pending;
+
+/* FNV-1a */
+static unsigned int 
+path_hash(char *path)
+{
+	unsigned int	h = 2166136261u;
+
+	while (*path)
+	{
+		h ^= (unsigned char)*path++;
+		h *= 16777619u;
+	}
+	return h % FILECACHE_BUCKETS;
+}
+
+static void 
+release(fc_entry_t * e)
+{
+	if (--e->refs == 0)
+	{
+		close(e->fd);
+		free(e->header);
+		free(e->path);
+		free(e);
+	}
+}
+
+/* Whether a cached file or a miss still needs wd. Caller holds the mutex. */
+static int 
+watch_used(int wd)
+{
+	fc_entry_t     *e;
+	fc_pending_t   *p;
+
+	for (e = first; e; e = e->next)	/* two paths to one file share a watch */
+		if (e->wd == wd)
+			return 1;
+	for (p = pending; p; p = p->next)
+		if (p->wd == wd)
+			return 1;
+	return 0;
+}
+
+/* Takes e out of the cache and drops the cache's reference. Caller holds the mutex. */
+static void 
+drop(fc_entry_t * e)
+{
+	fc_entry_t    **link = &buckets[path_hash(e->path)];
+
+	while (*link != e)
+		link = &(*link)->hnext;
+	*link = e->hnext;
+	if (e->prev)
+		e->prev->next = e->next;
+	else
+		first = e->next;
+	if (e->next)
+		e->next->prev = e->prev;
+	else
+		last = e->prev;
+	count--;
+
+	if (!watch_used(e->wd))
+		inotify_rm_watch(ifd, e->wd);
+	release(e);
+}
+
+/* Drops everything watched through wd. Caller holds the mutex. */
+static void 
+drop_watch(int wd)
+{
+	fc_entry_t     *e = first;
+
+	while (e)
+	{
+		fc_entry_t     *next = e->next;
+
+		if (e->wd == wd)
+			drop(e);
+		e = next;
+	}
+}
+
+static void    *
+watcher(void *vargp)
+{
+	char		buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+
+	Pthread_detach(pthread_self());
+	while (1)
+	{
+		ssize_t		n = read(ifd, buf, sizeof(buf));
+		char	       *p;
+
+		if (n <= 0)
+		{
+			if (n < 0 && errno == EINTR)
+				continue;
+			return NULL;
+		}
+		pthread_mutex_lock(&mutex);
+		for (p = buf; p < buf + n; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len)
+		{
+			struct inotify_event *ev = (struct inotify_event *)p;
+
+			drop_watch(ev->wd);	/* IN_IGNORED too, an entry mustn't outlive its watch */
+			events++;
+		}
+		pthread_mutex_unlock(&mutex);
+	}
+}
+
+/*
+ * filecache_init - start watching for changes. make_header makes the
+ * response headers kept with each file. Without inotify the cache stays
+ * off and filecache_get always returns NULL.
+ */
+void 
+filecache_init(fc_header_fn make_header)
+{
+	pthread_t	tid;
+
+	header_fn = make_header;
+	if ((ifd = inotify_init1(IN_CLOEXEC)) < 0)
+		return;
+	Pthread_create(&tid, NULL, watcher, NULL);
+}
+
+/*
+ * filecache_get - the open file at path with its stat results, opening
+ * and caching it if it isn't already. NULL if it can't be opened or isn't
+ * a regular file; the caller then does what it would have without a
+ * cache. Hand the entry back with filecache_put.
+ */
+fc_entry_t     *
+filecache_get(char *path)
+{
+	fc_entry_t     *e;
+	unsigned int	h = path_hash(path);
+
+	if (ifd < 0)
+		return NULL;
+	pthread_mutex_lock(&mutex);
+	for (e = buckets[h]; e; e = e->hnext)
+	{
+		if (!strcmp(e->path, path))
+		{
+			if (e != first)
+			{	/* to the front */
+				e->prev->next = e->next;
+				if (e->next)
+					e->next->prev = e->prev;
+				else
+					last = e->prev;
+				e->prev = NULL;
+				e->next = first;
+				first->prev = e;
+				first = e;
+			}
+			e->refs++;
+			pthread_mutex_unlock(&mutex);
+			return e;
+		}
+	}
+
+	/* A miss. The watch goes on under the mutex, so drop can't take it off until it's pending */
+	fc_pending_t	me, **link;
+	unsigned long	seen = events;
+	if ((me.wd = inotify_add_watch(ifd, path, FC_EVENTS)) < 0)
+	{
+		pthread_mutex_unlock(&mutex);
+		return NULL;
+	}
+	me.next = pending;
+	pending = &me;
+	pthread_mutex_unlock(&mutex);
+
+	/* Open it without the mutex held */
+	e = Malloc(sizeof(fc_entry_t));
+	if ((e->fd = open(path, O_RDONLY | O_CLOEXEC)) < 0 || fstat(e->fd, &e->st) < 0 || !S_ISREG(e->st.st_mode))
+	{
+		if (e->fd >= 0)
+			close(e->fd);
+		free(e);
+		e = NULL;
+	}
+	if (e != NULL)
+	{
+		char		buf       [MAXBUF];
+
+		e->header_len = header_fn(buf, sizeof(buf), path, &e->st);
+		e->header = Malloc(e->header_len);
+		memcpy(e->header, buf, e->header_len);
+		e->path = strdup(path);
+		e->wd = me.wd;
+		e->refs = 2;	/* the cache's and the caller's */
+	}
+
+	pthread_mutex_lock(&mutex);
+	for (link = &pending; *link != &me; link = &(*link)->next)
+		;
+	*link = me.next;
+	fc_entry_t     *dup;
+	for (dup = buckets[h]; dup; dup = dup->hnext)
+		if (!strcmp(dup->path, path))
+			break;
+	if (e == NULL || dup != NULL || events != seen)
+	{			/* not a file, another worker cached it first, or it may have changed since the open */
+		if (!watch_used(me.wd))
+			inotify_rm_watch(ifd, me.wd);
+		if (e != NULL)
+			e->refs = 1;	/* good for this request, which is as old as the open */
+		pthread_mutex_unlock(&mutex);
+		return e;
+	}
+	e->hnext = buckets[h];
+	buckets[h] = e;
+	e->prev = NULL;
+	e->next = first;
+	if (first)
+		first->prev = e;
+	first = e;
+	if (!last)
+		last = e;
+	if (++count > FILECACHE_MAX)	/* after e is in, so its watch counts as used */
+		drop(last);
+	pthread_mutex_unlock(&mutex);
+	return e;
+}
+
+void 
+filecache_put(fc_entry_t * e)
+{
+	pthread_mutex_lock(&mutex);
+	release(e);
+	pthread_mutex_unlock(&mutex);
+}
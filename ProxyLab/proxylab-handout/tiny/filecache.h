@@ -0,0 +1,33 @@
+/*
+ * filecache.h - open files and their stat results, kept for hot static files
+ */
+#ifndef __FILECACHE_H__
+#define __FILECACHE_H__
+
+#include "csapp.h"
+
+#define FILECACHE_MAX 256	/* files kept open at once */
+#define FILECACHE_BUCKETS 1024	/* hash buckets, by path */
+
+/* Makes a file's response headers into buf, returns their length */
+typedef int	(*fc_header_fn) (char *buf, size_t size, char *path, struct stat * st);
+
+typedef struct fc_entry fc_entry_t;
+struct fc_entry {
+	char	       *path;	/* as parse_uri made it */
+	int		fd;	/* open for reading, shared by every request */
+	struct stat	st;	/* from when it was opened */
+	char	       *header;	/* response headers, made then too */
+	int		header_len;
+	int		wd;	/* inotify watch on the file */
+	int		refs;	/* the cache's own, while cached, plus one per request serving it */
+	fc_entry_t     *hnext;	/* next in the same bucket */
+	fc_entry_t     *prev;	/* more recently used */
+	fc_entry_t     *next;	/* less recently used */
+};
+
+void		filecache_init(fc_header_fn make_header);
+fc_entry_t     *filecache_get(char *path);	/* held entry for a regular file, or NULL */
+void		filecache_put(fc_entry_t * e);	/* done with what filecache_get returned */
+
+#endif				/* __FILECACHE_H__ */
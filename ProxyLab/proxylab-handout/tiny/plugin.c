@@ -0,0 +1,68 @@
+/*
+ * plugin.c - dynamic handlers Tiny loads with dlopen and calls in process
+ *
+ * Even a pooled CGI worker costs two trips over a socket and a context
+ * switch each way. A handler loaded into Tiny costs a function call. The
+ * first request for a CGI path looks for name.so beside it and loads it
+ * with dlopen; the answer, handler or not, is kept for every request
+ * after that, so Tiny has to be restarted to see a plugin that's added or
+ * rebuilt. Loaded plugins are never unloaded, a thread may be in one.
+ */
+#include <dlfcn.h>
+#include "plugin.h"
+
+static plugin_t *plugins;
+static int	count;		/* paths on plugins */
+static int	loading;	/* -l was given */
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void 
+plugin_init(int enabled)
+{
+	loading = enabled;
+}
+
+tiny_handler_t 
+plugin_find(char *filename)
+{
+	plugin_t       *p;
+	char		sofile    [MAXLINE];
+	void	       *dl;
+
+	if (!loading)
+		return NULL;
+	pthread_mutex_lock(&mutex);
+	for (p = plugins; p != NULL; p = p->next)
+	{
+		if (!strcmp(p->path, filename))
+		{
+			pthread_mutex_unlock(&mutex);
+			return p->handle;
+		}
+	}
+
+	/* First time, loaded under the mutex so it's only loaded once */
+	p = Malloc(sizeof(plugin_t));
+	p->path = strdup(filename);
+	p->handle = NULL;
+	snprintf(sofile, sizeof(sofile), "%s.so", filename);
+	if (access(sofile, F_OK) == 0)
+	{
+		if ((dl = dlopen(sofile, RTLD_NOW | RTLD_LOCAL)) == NULL)
+			fprintf(stderr, "Tiny couldn't load %s: %s\n", sofile, dlerror());
+		else if ((p->handle = (tiny_handler_t) dlsym(dl, PLUGIN_SYMBOL)) == NULL)
+			fprintf(stderr, "%s has no %s\n", sofile, PLUGIN_SYMBOL);
+	}
+	if (p->handle == NULL && count >= PLUGIN_MAX)
+	{			/* don't let made up paths fill memory */
+		pthread_mutex_unlock(&mutex);
+		free(p->path);
+		Free(p);
+		return NULL;
+	}
+	p->next = plugins;
+	plugins = p;
+	count++;
+	pthread_mutex_unlock(&mutex);
+	return p->handle;
+}
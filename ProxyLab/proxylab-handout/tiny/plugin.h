@@ -0,0 +1,82 @@
+/*
+ * plugin.h - dynamic handlers Tiny loads with dlopen and calls in process
+ *
+ * With -l, a request for cgi-bin/name goes to the shared object
+ * cgi-bin/name.so if there is one, instead of a CGI program. It exports
+ *
+ *   int tiny_handle(const char *query, tiny_response_t *res);
+ *
+ * which Tiny calls with the query (what CGI would get in QUERY_STRING).
+ * It writes the body with tiny_write or tiny_printf and may change the
+ * status and content type; Tiny sends the status line and headers. It
+ * returns 0, or -1 for Tiny to answer 500 instead. Several threads can
+ * be in it at once.
+ */
+#ifndef __PLUGIN_H__
+#define __PLUGIN_H__
+
+#include "csapp.h"
+
+#define PLUGIN_SYMBOL "tiny_handle"
+#define PLUGIN_MAX 256		/* CGI paths whose lack of a plugin is remembered */
+
+typedef struct {
+	int		status;	/* 200 to start with */
+	const char     *reason;	/* "OK" to start with */
+	const char     *content_type;	/* "text/html" to start with */
+	char	       *body;	/* malloc'd, grown by tiny_write */
+	size_t		len;
+	size_t		cap;
+} tiny_response_t;
+
+typedef int	(*tiny_handler_t) (const char *query, tiny_response_t * res);
+
+/* Adds n bytes to the body, -1 if there's no memory for them */
+static inline int 
+tiny_write(tiny_response_t * res, const void *buf, size_t n)
+{
+	if (res->len + n > res->cap)
+	{
+		size_t		cap = res->cap ? res->cap : 1024;
+		char	       *body;
+
+		while (cap < res->len + n)
+			cap *= 2;
+		if ((body = realloc(res->body, cap)) == NULL)
+			return -1;
+		res->body = body;
+		res->cap = cap;
+	}
+	memcpy(res->body + res->len, buf, n);
+	res->len += n;
+	return 0;
+}
+
+/* Adds up to MAXBUF - 1 bytes of formatted text to the body */
+static inline int 
+tiny_printf(tiny_response_t * res, const char *fmt,...)
+{
+	char		buf       [MAXBUF];
+	va_list		ap;
+	int		n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	if (n < 0)
+		return -1;
+	return tiny_write(res, buf, n < (int)sizeof(buf) ? n : (int)sizeof(buf) - 1);
+}
+
+/* Tiny's side */
+typedef struct plugin plugin_t;
+struct plugin {
+	char	       *path;	/* the program path the handler stands in for */
+	tiny_handler_t	handle;	/* NULL if there's no plugin for it */
+	plugin_t       *next;
+};
+
+void		plugin_init(int enabled);
+tiny_handler_t	plugin_find(char *filename);	/* the handler for a CGI path, or NULL */
+
+#endif				/* __PLUGIN_H__ */
@@ -2,16 +2,90 @@
 /*
  * tiny.c - A simple, iterative HTTP/1.0 Web server that uses the GET method
  * to serve static and dynamic content.
+ *
+ * With -c, Tiny runs concurrently instead: one thread accepts connections
+ * and reads requests off them with epoll, and a pool of worker threads
+ * does the file I/O and writes the responses. A slow client only holds up
+ * the event loop for as long as a nonblocking read takes, and nothing is
+ * printed per request, so it can keep up with a proxy under load.
+ *
+ * With -c, connections persist when the client asks (HTTP/1.1 by
+ * default, HTTP/1.0 with Connection: keep-alive), with pipelined requests
+ * answered in order, until an error, a CGI response, or KEEPALIVE_SECS
+ * without a request. The iterative server serves nobody else while it
+ * has a connection, so it only keeps one open for requests the client
+ * has already pipelined behind the one it's answering.
+ *
+ * With -p, CGI programs that can run as long-lived workers (see
+ * cgipool.h) are kept running, a few per program, instead of being
+ * forked for every request. With -l, a program with a plugin beside it
+ * (see plugin.h) isn't run at all; its handler is called in process.
  */
 #define __MAC_OS_X
+#include <sys/epoll.h>
+#include <netinet/tcp.h>
+#include <sys/uio.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 #include "csapp.h"
+#include "filecache.h"
+#include "cgipool.h"
+#include "plugin.h"
+
+/* In <sys/socket.h> only under _GNU_SOURCE, which csapp.h's gai_error clashes with */
+int		accept4(int sockfd, struct sockaddr *addr, socklen_t *addrlen, int flags);
+
+#define DEFAULT_WORKERS 8	/* -c with no count */
+#define CONN_BUF 8192		/* longest request line and headers in -c mode */
+#define MAXEVENTS 256		/* epoll events taken per wait */
+#define QUEUE_SIZE 4096		/* requests read and waiting for a worker */
+#define KEEPALIVE_SECS 5	/* a persistent connection with no request this long is closed */
+
+/* A connection in -c mode, read into by the event loop until its headers are in */
+typedef struct conn conn_t;
+struct conn {
+	int		fd;
+	int		busy;	/* with a worker, so not idle however long that takes */
+	time_t		last;	/* when it was accepted or last answered */
+	conn_t	       *prev;	/* every open connection, for the idle sweep */
+	conn_t	       *next;
+	size_t		len;	/* bytes of request in buf, pipelined ones too */
+	char		buf[CONN_BUF + 1];	/* room for a NUL */
+};
+
+/* Requests with all their headers read, waiting for a worker */
+typedef struct {
+	conn_t	       *conns[QUEUE_SIZE];
+	int		head;	/* next to hand out */
+	int		count;
+	pthread_mutex_t	mutex;
+	pthread_cond_t	ready;	/* signalled when count goes up */
+} workqueue_t;
+
+int		quiet;		/* -c: don't print every request */
+int		epfd;		/* -c: the event loop's epoll instance */
+workqueue_t	work;
+conn_t	       *conns;		/* -c: every open connection */
+pthread_mutex_t	conns_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 void		doit      (int fd);
-void		read_requesthdrs(rio_t * rp);
+int		respond   (int fd, char *method, char *uri, int persist);
+void		serve_concurrent(int listenfd, int nworkers);
+void		conn_readable(conn_t * c);
+void		conn_unlink(conn_t * c);
+void		conn_close(conn_t * c);
+void		sweep_idle(void);
+size_t		request_end(char *buf);
+void	       *worker   (void *vargp);
+int		read_requesthdrs(rio_t * rp, int persist);
+int		persist_header(char *line, int persist);
 int		parse_uri  (char *uri, char *filename, char *cgiargs);
-void		serve_static(int fd, char *filename, int filesize);
+int		serve_static(int fd, char *filename, struct stat * sbuf, fc_entry_t * e, int persist);
+int		static_header(char *buf, size_t size, char *filename, struct stat * sbuf);
 void		get_filetype(char *filename, char *filetype);
 void		serve_dynamic(int fd, char *filename, char *cgiargs);
+int		serve_plugin(int fd, tiny_handler_t handle, char *cgiargs, int persist);
 void 
 clienterror(int fd, char *cause, char *errnum,
 	    char *shortmsg, char *longmsg);
@@ -19,22 +93,45 @@ clienterror(int fd, char *cause, char *errnum,
 int 
 main(int argc, char **argv)
 {
-	int		listenfd  , connfd;
+	int		listenfd  , connfd, nworkers = 0, cgiworkers = 0, plugins = 0;
 	char		hostname  [MAXLINE], port[MAXLINE];
 	socklen_t	clientlen;
 	struct sockaddr_storage clientaddr;
 
 	/* Check command line args */
-	if (argc != 2)
+	for (int i = 2; i < argc; i++)
 	{
-		fprintf(stderr, "usage: %s <port>\n", argv[0]);
+		char	       *opt = argv[i];
+		int		n = 0;
+
+		if (i + 1 < argc && isdigit((unsigned char)argv[i + 1][0]))
+			n = atoi(argv[++i]);	/* a count after the flag */
+		if (!strcmp(opt, "-c"))
+			nworkers = n > 0 ? n : DEFAULT_WORKERS;
+		else if (!strcmp(opt, "-p"))
+			cgiworkers = n > 0 ? n : CGI_WORKERS;
+		else if (!strcmp(opt, "-l") && n == 0)
+			plugins = 1;
+		else
+			argc = 1;
+	}
+	if (argc < 2)
+	{
+		fprintf(stderr, "usage: %s <port> [-c [workers]] [-p [cgi_workers]] [-l]\n", argv[0]);
 		exit(1);
 	}
 	listenfd = Open_listenfd(argv[1]);
+	fcntl(listenfd, F_SETFD, FD_CLOEXEC);	/* CGI workers outlive requests, they mustn't hold the port */
+	filecache_init(static_header);
+	cgipool_init(cgiworkers);
+	plugin_init(plugins);
+	if (nworkers > 0)
+		serve_concurrent(listenfd, nworkers);
 	while (1)
 	{
 		clientlen = sizeof(clientaddr);
-		connfd = Accept(listenfd, (SA *) & clientaddr, &clientlen);
+		if ((connfd = accept4(listenfd, (SA *) & clientaddr, &clientlen, SOCK_CLOEXEC)) < 0)	/* nor a client's connection */
+			unix_error("Accept error");
 //line: netp: tiny:accept
 			Getnameinfo((SA *) & clientaddr, clientlen, hostname, MAXLINE,
 				    port, MAXLINE, 0);
@@ -48,45 +145,94 @@ main(int argc, char **argv)
 /* $end tinymain */
 
 /*
- * doit - handle one HTTP request/response transaction
+ * doit - handle the HTTP request/response transactions on a connection:
+ * the first, and any the client pipelined behind it that are already in
+ * the rio buffer. Waiting for more would hold up every other client.
  */
 /* $begin doit */
 void 
 doit(int fd)
 {
-	int		is_static;
-	struct stat	sbuf;
 	char		buf       [MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
-	char		filename  [MAXLINE], cgiargs[MAXLINE];
 	rio_t		rio;
+	int		persist;
+	struct timeval	idle = {KEEPALIVE_SECS, 0};
+
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &idle, sizeof(idle));	/* a client that stalls times the read out */
 
 	/* Read request line and headers */
 	Rio_readinitb(&rio, fd);
-	if (!Rio_readlineb(&rio, buf, MAXLINE))
+	do
+	{
+		if (rio_readlineb(&rio, buf, MAXLINE) <= 0)
 //line: netp: doit:readrequest
-			return;
-	printf("%s", buf);
-	sscanf(buf, "%s %s %s", method, uri, version);
+				return;
+		printf("%s", buf);
+		method[0] = uri[0] = version[0] = '\0';
+		sscanf(buf, "%s %s %s", method, uri, version);
 //line: netp: doit:parserequest
-		if (strcasecmp(method, "GET"))
-	{
+			if (strcasecmp(method, "GET"))
+		{
 //line: netp: doit:beginrequesterr
-			clienterror(fd, method, "501", "Not Implemented",
-				    "Tiny does not implement this method");
-		return;
-} //line: netp: doit:endrequesterr
-		read_requesthdrs(&rio);
+				clienterror(fd, method, "501", "Not Implemented",
+					    "Tiny does not implement this method");
+			return;
+	} //line: netp: doit:endrequesterr
+			if ((persist = read_requesthdrs(&rio, !strcmp(version, "HTTP/1.1"))) < 0)
 //line: netp: doit:readrequesthdrs
+				return;
+		persist = persist && rio.rio_cnt > 0;	/* only for a request that's already here */
+	} while (respond(fd, method, uri, persist));
+}
+/* $end doit */
+
+/*
+ * respond - answer a request for uri whose headers have all been read.
+ * Returns whether the connection can take another request: only if the
+ * client asked for that with persist and a static file went out whole.
+ */
+int 
+respond(int fd, char *method, char *uri, int persist)
+{
+	int		is_static;
+	struct stat	sbuf;
+	char		filename  [MAXLINE], cgiargs[MAXLINE];
+
+	if (strcasecmp(method, "GET"))
+	{
+		clienterror(fd, method, "501", "Not Implemented",
+			    "Tiny does not implement this method");
+		return 0;
+	}
 
 	/* Parse URI from GET request */
 		is_static = parse_uri(uri, filename, cgiargs);
 //line: netp: doit:staticcheck
+		if (is_static)
+	{			/* A hot file is already open, with its stat */
+		fc_entry_t     *e = filecache_get(filename);
+
+		if (e != NULL && (S_IRUSR & e->st.st_mode))
+		{
+			persist = serve_static(fd, filename, &e->st, e, persist);
+			filecache_put(e);
+			return persist;
+		}
+		if (e != NULL)
+			filecache_put(e);
+	} else
+	{			/* A plugin needs no stat, it isn't a file Tiny runs */
+		tiny_handler_t	handle = plugin_find(filename);
+
+		if (handle != NULL)
+			return serve_plugin(fd, handle, cgiargs, persist);
+	}
 		if (stat(filename, &sbuf) < 0)
 	{
 //line: netp: doit:beginnotfound
 			clienterror(fd, filename, "404", "Not found",
 				    "Tiny couldn't find this file");
-		return;
+		return 0;
 } //line: netp: doit:endnotfound
 
 		if (is_static)
@@ -96,9 +242,9 @@ doit(int fd)
 	//line: netp: doit:readable
 				clienterror(fd, filename, "403", "Forbidden",
 					    "Tiny couldn't read the file");
-			return;
+			return 0;
 		}
-		serve_static(fd, filename, sbuf.st_size);
+		return serve_static(fd, filename, &sbuf, NULL, persist);
 //line: netp: doit:servestatic
 	} else
 	{			/* Serve dynamic content */
@@ -107,35 +253,294 @@ doit(int fd)
 	//line: netp: doit:executable
 				clienterror(fd, filename, "403", "Forbidden",
 				       "Tiny couldn't run the CGI program");
-			return;
+			return 0;
 		}
 		serve_dynamic(fd, filename, cgiargs);
 //line: netp: doit:servedynamic
 	}
+	return 0;		/* CGI output has no length, its end is the connection's */
+}
+
+/*
+ * serve_concurrent - the -c main loop. Never returns.
+ */
+void 
+serve_concurrent(int listenfd, int nworkers)
+{
+	struct epoll_event ev, events[MAXEVENTS];
+	pthread_t	tid;
+
+	quiet = 1;
+	Signal(SIGPIPE, SIG_IGN);	/* a client that leaves early only costs its own connection */
+	fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) | O_NONBLOCK);
+	if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+		unix_error("epoll_create1 error");
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;	/* NULL is the listening socket */
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, listenfd, &ev) < 0)
+		unix_error("epoll_ctl error");
+
+	pthread_mutex_init(&work.mutex, NULL);
+	pthread_cond_init(&work.ready, NULL);
+	for (int i = 0; i < nworkers; i++)
+		Pthread_create(&tid, NULL, worker, NULL);
+
+	while (1)
+	{
+		int		n = epoll_wait(epfd, events, MAXEVENTS, 1000);	/* at least a sweep a second */
+
+		for (int i = 0; i < n; i++)
+		{
+			conn_t	       *c = events[i].data.ptr;
+
+			if (c != NULL)
+			{
+				conn_readable(c);
+				continue;
+			}
+			/* Take every connection that's waiting */
+			int		fd;
+			while ((fd = accept4(listenfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)	/* a worker forking meanwhile mustn't inherit it */
+			{
+				int		one = 1;
+
+				setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+				c = Malloc(sizeof(conn_t));
+				c->fd = fd;
+				c->len = 0;
+				c->busy = 0;
+				c->last = time(NULL);
+				pthread_mutex_lock(&conns_mutex);
+				c->prev = NULL;
+				c->next = conns;
+				if (conns)
+					conns->prev = c;
+				conns = c;
+				pthread_mutex_unlock(&conns_mutex);
+				ev.events = EPOLLIN | EPOLLONESHOT;	/* only one thread looks at a connection at a time */
+				ev.data.ptr = c;
+				if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+					conn_close(c);
+			}
+		}
+		sweep_idle();	/* after the batch, so none of its events are for a freed connection */
+	}
+}
+
+/*
+ * conn_readable - read what has arrived on c. Once the blank line after
+ * the headers is in, the request goes to a worker; until then c waits for
+ * more. A client that hangs up or sends more than CONN_BUF of headers is
+ * dropped, as is one that takes KEEPALIVE_SECS to send a request.
+ */
+void 
+conn_readable(conn_t * c)
+{
+	struct epoll_event ev;
+	ssize_t		n;
+
+	while ((n = read(c->fd, c->buf + c->len, CONN_BUF - c->len)) > 0)
+		c->len += n;
+	c->buf[c->len] = '\0';
+	if (request_end(c->buf) > 0)
+	{
+		pthread_mutex_lock(&work.mutex);
+		if (work.count == QUEUE_SIZE)
+		{		/* workers are that far behind, shed it */
+			pthread_mutex_unlock(&work.mutex);
+			conn_close(c);
+			return;
+		}
+		c->busy = 1;	/* the sweep only runs on this thread, so no lock */
+		work.conns[(work.head + work.count++) % QUEUE_SIZE] = c;
+		pthread_cond_signal(&work.ready);
+		pthread_mutex_unlock(&work.mutex);
+		return;
+	}
+	if (n == 0 || (n < 0 && errno != EAGAIN) || c->len == CONN_BUF)
+	{
+		conn_close(c);
+		return;
+	}
+	ev.events = EPOLLIN | EPOLLONESHOT;
+	ev.data.ptr = c;
+	epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+/*
+ * conn_unlink - take c off the list of open connections. The caller
+ * holds conns_mutex.
+ */
+void 
+conn_unlink(conn_t * c)
+{
+	if (c->prev)
+		c->prev->next = c->next;
+	else
+		conns = c->next;
+	if (c->next)
+		c->next->prev = c->prev;
+}
+
+void 
+conn_close(conn_t * c)
+{
+	pthread_mutex_lock(&conns_mutex);
+	conn_unlink(c);
+	pthread_mutex_unlock(&conns_mutex);
+	close(c->fd);		/* also takes it out of epfd */
+	Free(c);
+}
+
+/*
+ * sweep_idle - close the connections that have waited KEEPALIVE_SECS for
+ * a request. Runs on the event loop's thread, between batches of events.
+ */
+void 
+sweep_idle(void)
+{
+	static time_t	swept;
+	time_t		now = time(NULL);
+	conn_t	       *c, *next;
+
+	if (now == swept)
+		return;
+	swept = now;
+	pthread_mutex_lock(&conns_mutex);
+	for (c = conns; c != NULL; c = next)
+	{
+		next = c->next;
+		if (!c->busy && now - c->last >= KEEPALIVE_SECS)
+		{
+			conn_unlink(c);
+			close(c->fd);
+			Free(c);
+		}
+	}
+	pthread_mutex_unlock(&conns_mutex);
+}
+
+/*
+ * request_end - where the first request in buf ends, just past the blank
+ * line after its headers, or 0 if that isn't in yet
+ */
+size_t 
+request_end(char *buf)
+{
+	char	       *crlf = strstr(buf, "\r\n\r\n"), *lf = strstr(buf, "\n\n");
+
+	if (crlf != NULL && (lf == NULL || crlf < lf))
+		return crlf + 4 - buf;
+	if (lf != NULL)
+		return lf + 2 - buf;
+	return 0;
+}
+
+/*
+ * worker - take connections the event loop has read a request on and
+ * answer it, and any pipelined behind it, with blocking writes. A
+ * connection that persists goes back to the event loop for more.
+ */
+void           *
+worker(void *vargp)
+{
+	char		method    [MAXLINE], uri[MAXLINE], version[MAXLINE];
+	struct epoll_event ev;
+
+	Pthread_detach(pthread_self());
+	while (1)
+	{
+		pthread_mutex_lock(&work.mutex);
+		while (work.count == 0)
+			pthread_cond_wait(&work.ready, &work.mutex);
+		conn_t	       *c = work.conns[work.head];
+		work.head = (work.head + 1) % QUEUE_SIZE;
+		work.count--;
+		pthread_mutex_unlock(&work.mutex);
+
+		fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) & ~O_NONBLOCK);
+		size_t		end;
+		while ((end = request_end(c->buf)) > 0)
+		{
+			int		persist = 0;
+			char	       *line;
+
+			version[0] = '\0';
+			if (sscanf(c->buf, "%8191s %8191s %8191s", method, uri, version) >= 2)
+			{
+				persist = !strcmp(version, "HTTP/1.1");
+				for (line = strchr(c->buf, '\n'); line != NULL && line + 1 < c->buf + end; line = strchr(line, '\n'))
+					persist = persist_header(++line, persist);
+				persist = respond(c->fd, method, uri, persist);
+			}
+			if (!persist)
+				break;
+			c->len -= end;	/* on to the next request, if it's in */
+			memmove(c->buf, c->buf + end, c->len + 1);
+		}
+		if (end > 0)
+		{
+			conn_close(c);
+			continue;
+		}
+		fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) | O_NONBLOCK);
+		pthread_mutex_lock(&conns_mutex);
+		c->busy = 0;	/* before it's rearmed, or the event loop's busy = 1 could be undone */
+		c->last = time(NULL);
+		pthread_mutex_unlock(&conns_mutex);
+		ev.events = EPOLLIN | EPOLLONESHOT;
+		ev.data.ptr = c;
+		epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+	}
+	return NULL;
 }
 /* $end doit */
 
 /*
- * read_requesthdrs - read HTTP request headers
+ * read_requesthdrs - read HTTP request headers. Returns whether the
+ * client wants the connection kept open, from persist, what its HTTP
+ * version implies, and any Connection header, or -1 if it hung up or
+ * went idle partway through.
  */
 /* $begin read_requesthdrs */
-void 
-read_requesthdrs(rio_t * rp)
+int 
+read_requesthdrs(rio_t * rp, int persist)
 {
 	char		buf       [MAXLINE];
 
-	Rio_readlineb(rp, buf, MAXLINE);
+	if (rio_readlineb(rp, buf, MAXLINE) <= 0)
+		return -1;
 	printf("%s", buf);
-	while (strcmp(buf, "\r\n"))
+	while (strcmp(buf, "\r\n") && strcmp(buf, "\n"))
 	{
 //line: netp: readhdrs:checkterm
-			Rio_readlineb(rp, buf, MAXLINE);
+			persist = persist_header(buf, persist);
+		if (rio_readlineb(rp, buf, MAXLINE) <= 0)
+			return -1;
 		printf("%s", buf);
 	}
-	return;
+	return persist;
 }
 /* $end read_requesthdrs */
 
+/*
+ * persist_header - whether the connection stays open after this request,
+ * given one of its header lines and what was decided before it
+ */
+int 
+persist_header(char *line, int persist)
+{
+	if (strncasecmp(line, "Connection:", 11))
+		return persist;
+	for (line += 11; *line == ' ' || *line == '\t'; line++)
+		;
+	if (!strncasecmp(line, "close", 5))
+		return 0;
+	if (!strncasecmp(line, "keep-alive", 10))
+		return 1;
+	return persist;
+}
+
 /*
  * parse_uri - parse URI into filename and CGI args return 0 if dynamic
  * content, 1 if static
@@ -182,40 +587,105 @@ parse_uri(char *uri, char *filename, char *cgiargs)
 /* $end parse_uri */
 
 /*
- * serve_static - copy a file back to the client
+ * serve_static - copy a file back to the client. On Linux the headers go
+ * out with MSG_MORE and the body follows with sendfile, straight from the
+ * page cache to the socket, so the two share packets without corking.
+ * With e, the file comes from the file cache: already open, only read at
+ * explicit offsets, and with its headers made when it was opened. The
+ * Connection header goes on the end, keep-alive if persist. Returns
+ * whether the connection can be used again: persist, and it all went out.
  */
 /* $begin serve_static */
-void 
-serve_static(int fd, char *filename, int filesize)
+int 
+serve_static(int fd, char *filename, struct stat * sbuf, fc_entry_t * e, int persist)
 {
-	int		srcfd;
-	char           *srcp, filetype[MAXLINE], buf[MAXBUF];
+	int		srcfd, hdrlen, sent = 0;
+	off_t		filesize = sbuf->st_size;
+	char		buf       [MAXBUF], *hdr = buf;
+	char	       *conn = persist ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+#ifndef __linux__
+	char           *srcp;
+#endif
 
-	/* Send response headers to client */
-	get_filetype(filename, filetype);
-//line: netp: servestatic:getfiletype
-		sprintf(buf, "HTTP/1.0 200 OK\r\n");
-//line: netp: servestatic:beginserve
-		sprintf(buf, "%sServer: Tiny Web Server\r\n", buf);
-	sprintf(buf, "%sConnection: close\r\n", buf);
-	sprintf(buf, "%sContent-length: %d\r\n", buf, filesize);
-	sprintf(buf, "%sContent-type: %s\r\n\r\n", buf, filetype);
-	Rio_writen(fd, buf, strlen(buf));
-//line: netp: servestatic:endserve
+	if (e != NULL)
+	{
+		srcfd = e->fd;
+		hdr = e->header;
+		hdrlen = e->header_len;
+	} else
+	{
+		srcfd = Open(filename, O_RDONLY, 0);
+//line: netp: servestatic:open
+			hdrlen = static_header(buf, sizeof(buf), filename, sbuf);
+	}
+	if (!quiet)
+	{
 		printf("Response headers:\n");
-	printf("%s", buf);
+		printf("%.*s%s", hdrlen, hdr, conn);
+	}
 
-	/* Send response body to client */
-	srcfd = Open(filename, O_RDONLY, 0);
-//line: netp: servestatic:open
+#ifdef __linux__
+	/* Send response headers and body to client */
+	off_t		offset = 0;
+	struct iovec	iov[2] = {{hdr, hdrlen}, {conn, strlen(conn)}};
+	struct msghdr	msg = {.msg_iov = iov,.msg_iovlen = 2};
+
+	if (sendmsg(fd, &msg, filesize > 0 ? MSG_MORE : 0) == hdrlen + iov[1].iov_len)
+	{			/* a client that left isn't worth exiting over */
+		while (offset < filesize)
+		{
+			ssize_t		n = sendfile(fd, srcfd, &offset, filesize - offset);
+
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)	/* client left, or the file shrank under us */
+				break;
+		}
+		sent = offset == filesize;
+	}
+	if (e == NULL)
+		Close(srcfd);
+#else
+	rio_writen(fd, hdr, hdrlen);
+	rio_writen(fd, conn, strlen(conn));
 		srcp = Mmap(0, filesize, PROT_READ, MAP_PRIVATE, srcfd, 0);
 //line: netp: servestatic:mmap
+		if (e == NULL)
 		Close(srcfd);
 //line: netp: servestatic:close
-		Rio_writen(fd, srcp, filesize);
+		sent = rio_writen(fd, srcp, filesize) == filesize;
 //line: netp: servestatic:write
 		Munmap(srcp, filesize);
 //line: netp: servestatic:munmap
+#endif
+	return persist && sent;
+}
+
+/*
+ * static_header - make the response headers for a static file, with its
+ * stat for the length and the validators, in one go: all but Connection,
+ * which depends on the request, and the blank line after it. Returns
+ * their length.
+ */
+int 
+static_header(char *buf, size_t size, char *filename, struct stat * sbuf)
+{
+	char		filetype  [MAXLINE], modified[64];
+	struct tm	tm;
+
+	get_filetype(filename, filetype);
+//line: netp: servestatic:getfiletype
+		strftime(modified, sizeof(modified), "%a, %d %b %Y %H:%M:%S GMT",
+			 gmtime_r(&sbuf->st_mtime, &tm));
+	return snprintf(buf, size,
+			"HTTP/1.1 200 OK\r\n"
+			"Server: Tiny Web Server\r\n"
+			"Content-length: %lld\r\n"
+			"Content-type: %s\r\n"
+			"Last-Modified: %s\r\n"
+			"ETag: \"%llx-%llx\"\r\n",
+			(long long)sbuf->st_size, filetype, modified,
+			(long long)sbuf->st_size, (long long)sbuf->st_mtime);
 }
 
 /*
@@ -238,37 +708,104 @@ get_filetype(char *filename, char *filetype)
 /* $end serve_static */
 
 /*
- * serve_dynamic - run a CGI program on behalf of the client
+ * serve_dynamic - run a CGI program on behalf of the client. With -c the
+ * fork is from a threaded process, where the child may only make
+ * async-signal-safe calls until it execs, so its environment is made
+ * before the fork.
  */
 /* $begin serve_dynamic */
 void 
 serve_dynamic(int fd, char *filename, char *cgiargs)
 {
 	char		buf       [MAXLINE], *emptylist[] = {NULL};
+	char	      **envp, *query;
+	pid_t		pid;
+	int		n, i;
 
 	/* Return first part of HTTP response */
 	sprintf(buf, "HTTP/1.0 200 OK\r\n");
-	Rio_writen(fd, buf, strlen(buf));
+	rio_writen(fd, buf, strlen(buf));
 	sprintf(buf, "Server: Tiny Web Server\r\n");
-	Rio_writen(fd, buf, strlen(buf));
+	rio_writen(fd, buf, strlen(buf));
+
+	if (cgipool_run(filename, cgiargs, fd) == 0)
+		return;		/* a pooled worker answered */
 
-	if (Fork() == 0)
+	/* Real server would set all CGI vars here */
+	for (n = 0; environ[n] != NULL; n++)
+		;
+	envp = Malloc((n + 2) * sizeof(char *));
+	query = Malloc(strlen("QUERY_STRING=") + strlen(cgiargs) + 1);
+	sprintf(query, "QUERY_STRING=%s", cgiargs);
+	for (n = i = 0; environ[i] != NULL; i++)
+		if (strncmp(environ[i], "QUERY_STRING=", 13))
+			envp[n++] = environ[i];
+	envp[n++] = query;
+	envp[n] = NULL;
+//line: netp: servedynamic:setenv
+
+	if ((pid = Fork()) == 0)
 	{			/* Child */
 //line: netp: servedynamic:fork
-		/* Real server would set all CGI vars here */
-			setenv("QUERY_STRING", cgiargs, 1);
-//line: netp: servedynamic:setenv
-			Dup2(fd, STDOUT_FILENO);	/* Redirect stdout to
+			dup2(fd, STDOUT_FILENO);	/* Redirect stdout to
 							 * client */
 //line: netp: servedynamic:dup2
-			Execve(filename, emptylist, environ);	/* Run CGI program */
+			execve(filename, emptylist, envp);	/* Run CGI program */
 //line: netp: servedynamic:execve
+			_exit(127);
 	}
-	Wait(NULL);		/* Parent waits for and reaps child */
+	Free(query);
+	Free(envp);
+	Waitpid(pid, NULL, 0);	/* Parent waits for and reaps its own child,
+				 * with -c other workers have theirs */
 //line: netp: servedynamic:wait
 }
 /* $end serve_dynamic */
 
+/*
+ * serve_plugin - answer a dynamic request with a handler from plugin.c.
+ * The whole body is made before anything is sent, so unlike CGI output
+ * it has a length and the connection can persist.
+ */
+int 
+serve_plugin(int fd, tiny_handler_t handle, char *cgiargs, int persist)
+{
+	tiny_response_t	res = {200, "OK", "text/html", NULL, 0, 0};
+	char		hdr       [MAXLINE];
+	int		hdrlen, sent;
+	ssize_t		n;
+
+	if (handle(cgiargs, &res) < 0)
+	{
+		free(res.body);
+		clienterror(fd, cgiargs, "500", "Internal Server Error",
+			    "Tiny's handler failed on");
+		return 0;
+	}
+	hdrlen = snprintf(hdr, sizeof(hdr),
+			  "HTTP/1.1 %d %s\r\n"
+			  "Server: Tiny Web Server\r\n"
+			  "Content-length: %zu\r\n"
+			  "Content-type: %s\r\n"
+			  "Connection: %s\r\n\r\n",
+			  res.status, res.reason, res.len, res.content_type,
+			  persist ? "keep-alive" : "close");
+	if (!quiet)
+	{
+		printf("Response headers:\n");
+		printf("%s", hdr);
+	}
+
+	/* Headers and body in one write, for a small body one packet */
+	struct iovec	iov[2] = {{hdr, hdrlen}, {res.body, res.len}};
+	n = writev(fd, iov, 2);
+	sent = n == hdrlen + res.len;
+	if (n >= hdrlen && !sent)	/* the socket only took part of the body */
+		sent = rio_writen(fd, res.body + (n - hdrlen), res.len - (n - hdrlen)) == res.len - (n - hdrlen);
+	free(res.body);
+	return persist && sent;
+}
+
 /*
  * clienterror - returns an error message to the client
  */
@@ -288,11 +825,11 @@ clienterror(int fd, char *cause, char *errnum,
 
 	/* Print the HTTP response */
 	sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-	Rio_writen(fd, buf, strlen(buf));
+	rio_writen(fd, buf, strlen(buf));
 	sprintf(buf, "Content-type: text/html\r\n");
-	Rio_writen(fd, buf, strlen(buf));
+	rio_writen(fd, buf, strlen(buf));
 	sprintf(buf, "Content-length: %d\r\n\r\n", (int)strlen(body));
-	Rio_writen(fd, buf, strlen(buf));
-	Rio_writen(fd, body, strlen(body));
+	rio_writen(fd, buf, strlen(buf));
+	rio_writen(fd, body, strlen(body));
 }
 /* $end clienterror */
@@ -0,0 +1,215 @@
+/*
+ * tracetop.c - the slowest requests in a proxy -T trace, phase by phase
+ *
+ * Reads the file the proxy writes with -T (see reqtrace.c) and prints, for
+ * every phase, how many requests went through it, its p50/p95/p99/max and
+ * its share of all the time spent, then the slowest requests with where
+ * their time went. Phase names come from the file itself, so a trace from
+ * a proxy with more phases than this knows about still reads.
+ *
+ * usage: ./tracetop [-n count] [-o outcome] [-u url_part] tracefile
+ */
+#include "csapp.h"
+
+#define TOP_PHASES 32 //most distinct phase names a trace may use
+#define TOP_NAME 32 //longest phase or outcome name kept
+
+typedef struct {
+   long long wall_ms; //when the request was picked up
+   long long total_us; //how long it took
+   long long span_us[TOP_PHASES]; //time in each phase, 0 if it never got there
+   char outcome[TOP_NAME];
+   char *url;
+} TopRecord;
+
+static char phases[TOP_PHASES][TOP_NAME]; //names in the order they first turned up
+static int nphases;
+
+/* Index of phase name, given one if it's new, -1 if there are too many */
+static int phase_index(char *name) {
+   for (int i = 0; i < nphases; i++) {
+      if (!strcmp(phases[i], name)) {
+         return i;
+      }
+   }
+   if (nphases == TOP_PHASES) {
+      return -1;
+   }
+   snprintf(phases[nphases], TOP_NAME, "%s", name);
+   return nphases++;
+}
+
+/* Reads one line of the trace into r, 0 if it isn't one */
+static int parse_line(char *line, TopRecord *r) {
+   char url[MAXLINE];
+   int used;
+   
+   memset(r, 0, sizeof(TopRecord));
+   if (sscanf(line, "%lld %lld %31s %8191s%n", &r->wall_ms, &r->total_us, r->outcome, url, &used) != 4) {
+      return 0;
+   }
+   for (char *tok = strtok(line + used, " \n"); tok != NULL; tok = strtok(NULL, " \n")) {
+      char *eq = strchr(tok, '=');
+      if (eq == NULL) {
+         continue;
+      }
+      *eq = '\0';
+      int p = phase_index(tok);
+      if (p >= 0) {
+         r->span_us[p] = atoll(eq + 1);
+      }
+   }
+   r->url = strdup(url);
+   return 1;
+}
+
+static int ll_cmp(const void *a, const void *b) {
+   long long x = *(long long *) a, y = *(long long *) b;
+   return x < y ? -1 : x > y;
+}
+
+static int slowest_first(const void *a, const void *b) {
+   long long x = ((TopRecord *) a)->total_us, y = ((TopRecord *) b)->total_us;
+   return x > y ? -1 : x < y;
+}
+
+/* Nearest rank percentile of n sorted values */
+static double percentile_ms(long long *sorted, size_t n, double p) {
+   size_t rank = p * n;
+   
+   if (rank < p * n) { //round up
+      rank++;
+   }
+   return sorted[rank > 0 ? rank - 1 : 0] / 1000.0;
+}
+
+static void print_phase(char *name, long long *values, size_t n, long long all_us) {
+   long long sum = 0;
+   
+   qsort(values, n, sizeof(long long), ll_cmp);
+   for (size_t i = 0; i < n; i++) {
+      sum += values[i];
+   }
+   printf("%-14s %8zu %9.2f %9.2f %9.2f %9.2f %7.1f\n", name, n,
+          percentile_ms(values, n, 0.5), percentile_ms(values, n, 0.95),
+          percentile_ms(values, n, 0.99), values[n - 1] / 1000.0, all_us ? 100.0 * sum / all_us : 0);
+}
+
+int main(int argc, char **argv) {
+   char line[MAXBUF];
+   char *outcome = NULL, *url_part = NULL;
+   int count = 10, opt;
+   size_t n = 0, cap = 1024;
+   unsigned long dropped = 0;
+   
+   while ((opt = getopt(argc, argv, "n:o:u:")) != -1) {
+      switch (opt) {
+         case 'n':
+            count = atoi(optarg);
+            break;
+         case 'o':
+            outcome = optarg;
+            break;
+         case 'u':
+            url_part = optarg;
+            break;
+         default:
+            optind = argc;
+            break;
+      }
+   }
+   if (optind != argc - 1) {
+      fprintf(stderr, "usage: %s [-n count] [-o outcome] [-u url_part] tracefile\n", argv[0]);
+      exit(1);
+   }
+   FILE *f = fopen(argv[optind], "r");
+   if (f == NULL) {
+      fprintf(stderr, "Couldn't read %s: %s\n", argv[optind], strerror(errno));
+      exit(1);
+   }
+   
+   TopRecord *records = Malloc(cap * sizeof(TopRecord));
+   while (fgets(line, sizeof(line), f) != NULL) {
+      unsigned long lost;
+      if (sscanf(line, "# %lu requests dropped", &lost) == 1) {
+         dropped += lost;
+         continue;
+      }
+      if (n == cap) {
+         cap *= 2;
+         records = Realloc(records, cap * sizeof(TopRecord));
+      }
+      if (!parse_line(line, &records[n])) {
+         continue;
+      }
+      if ((outcome != NULL && strcmp(records[n].outcome, outcome) != 0) ||
+          (url_part != NULL && strstr(records[n].url, url_part) == NULL)) {
+         free(records[n].url);
+         continue;
+      }
+      n++;
+   }
+   fclose(f);
+   printf("%s: %zu requests", argv[optind], n);
+   if (dropped) {
+      printf(", %lu more dropped by the proxy", dropped);
+   }
+   printf("\n\n");
+   if (n == 0) {
+      return 0;
+   }
+   
+   long long *values = Malloc(n * sizeof(long long));
+   long long all_us = 0;
+   for (size_t i = 0; i < n; i++) {
+      values[i] = records[i].total_us;
+      all_us += records[i].total_us;
+   }
+   printf("%-14s %8s %9s %9s %9s %9s %7s\n", "phase", "requests", "p50 ms", "p95 ms", "p99 ms", "max ms", "share %");
+   for (int p = 0; p < nphases; p++) {
+      size_t m = 0;
+      for (size_t i = 0; i < n; i++) {
+         if (records[i].span_us[p] > 0) {
+            values[m++] = records[i].span_us[p];
+         }
+      }
+      if (m > 0) {
+         print_phase(phases[p], values, m, all_us);
+      }
+   }
+   for (size_t i = 0; i < n; i++) {
+      values[i] = records[i].total_us;
+   }
+   print_phase("total", values, n, all_us);
+   
+   qsort(records, n, sizeof(TopRecord), slowest_first);
+   printf("\nslowest %d\n", count < (int) n ? count : (int) n);
+   for (size_t i = 0; i < n && (int) i < count; i++) {
+      TopRecord *r = &records[i];
+      time_t secs = r->wall_ms / 1000;
+      char when[32];
+      long long rest = r->total_us;
+      strftime(when, sizeof(when), "%H:%M:%S", localtime(&secs));
+      printf("%9.2f ms  %-11s %s.%03lld  %s\n", r->total_us / 1000.0, r->outcome, when, r->wall_ms % 1000, r->url);
+      for (int shown = 0; shown < nphases; shown++) { //biggest phase first
+         int top = -1;
+         for (int p = 0; p < nphases; p++) {
+            if (r->span_us[p] > 0 && (top < 0 || r->span_us[p] > r->span_us[top])) {
+               top = p;
+            }
+         }
+         if (top < 0) {
+            break;
+         }
+         printf("             %-14s %9.2f ms %5.1f%%\n", phases[top], r->span_us[top] / 1000.0,
+                r->total_us ? 100.0 * r->span_us[top] / r->total_us : 0);
+         rest -= r->span_us[top];
+         r->span_us[top] = 0;
+      }
+      if (rest > 0) { //between the timed phases: logging, locks, closing the socket
+         printf("             %-14s %9.2f ms %5.1f%%\n", "untimed", rest / 1000.0,
+                r->total_us ? 100.0 * rest / r->total_us : 0);
+      }
+   }
+   return 0;
+}
@@ -0,0 +1,318 @@
+/*
+ * tunnel.c - CONNECT tunnels, relayed by one thread with epoll and splice
+ *
+ * A worker thread only sets a tunnel up: it connects to the target, answers
+ * the CONNECT and hands both sockets to tunnel_add. From then on the tunnel
+ * thread moves the bytes for every open tunnel, so a long HTTPS session
+ * doesn't keep a worker away from the request queue.
+ *
+ * Each direction splices from its source socket into a pipe and from the
+ * pipe into the other socket, so the payload stays in the kernel. A
+ * direction only reads again once its pipe has drained, which is what
+ * pushes back on a fast sender when the receiver is slow. EOF one way is
+ * passed on with a shutdown and the other way keeps going until it ends
+ * too, the peer resets, or nothing has moved for the idle timeout.
+ */
+#define _GNU_SOURCE //splice, pipe2, F_SETPIPE_SZ, which is also why csapp.h stays out of here
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "tunnel.h"
+
+#define TUNNEL_EVENTS 64 //events taken from epoll per wait
+#define TUNNEL_ROUNDS 8 //pipefuls one event may move before the next tunnel gets a turn
+
+int tunnel_init(TunnelLoop *tl, int idle, tunnel_fn *closed, void *arg) {
+   struct epoll_event ev;
+   
+   if ((tl->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+      return -1;
+   }
+   if ((tl->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+      close(tl->epfd);
+      return -1;
+   }
+   ev.events = EPOLLIN;
+   ev.data.ptr = NULL; //the only event without a direction
+   epoll_ctl(tl->epfd, EPOLL_CTL_ADD, tl->wakefd, &ev);
+   tl->idle = idle;
+   tl->count = 0;
+   tl->first = tl->added = NULL;
+   tl->bytes_up = tl->bytes_down = 0;
+   tl->closed = closed;
+   tl->arg = arg;
+   pthread_mutex_init(&tl->mutex, NULL);
+   return 0;
+}
+
+/* Sets up one direction, from and to are sockets. -1 if out of descriptors. */
+static int dir_init(Tunnel *t, TunnelDir *d, int from, int to) {
+   if (pipe2(d->pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+      return -1;
+   }
+   fcntl(d->pipe[1], F_SETPIPE_SZ, TUNNEL_PIPE_SIZE); //only a hint, the default is fine too
+   d->tunnel = t;
+   d->from = from;
+   d->to = to;
+   d->pending = d->bytes = 0;
+   d->eof = d->shut = 0;
+   d->events = 0;
+   return 0;
+}
+
+/* The direction writing to the socket d reads from */
+static TunnelDir *dir_reverse(TunnelDir *d) {
+   return d == &d->tunnel->up ? &d->tunnel->down : &d->tunnel->up;
+}
+
+/* Asks epoll for whatever d's source socket can make progress on right now:
+ input if d's pipe is empty, output if the reverse direction has bytes for it */
+static void dir_watch(TunnelLoop *tl, TunnelDir *d, int op) {
+   struct epoll_event ev;
+   
+   ev.events = 0;
+   if (!d->eof && d->pending == 0) {
+      ev.events |= EPOLLIN;
+   }
+   if (dir_reverse(d)->pending > 0) {
+      ev.events |= EPOLLOUT;
+   }
+   if (op == EPOLL_CTL_MOD && ev.events == d->events) { //nothing changed, save the system call
+      return;
+   }
+   ev.data.ptr = d;
+   epoll_ctl(tl->epfd, op, d->from, &ev);
+   d->events = ev.events;
+}
+
+/*
+ * tunnel_add - start relaying between client and server. early is anything
+ * the client sent after its CONNECT that has already been read, it goes to
+ * the server first. The tunnel thread is woken to put the sockets in epoll
+ * itself, so it never sees a tunnel half set up. On success the tunnel owns
+ * both sockets; on -1 (too many tunnels, out of descriptors, or early
+ * didn't fit in the pipe) they are still the caller's to close.
+ */
+int tunnel_add(TunnelLoop *tl, int client, int server, char *target, char *early, size_t early_len) {
+   pthread_mutex_lock(&tl->mutex);
+   if (tl->count >= TUNNEL_MAX) {
+      pthread_mutex_unlock(&tl->mutex);
+      return -1;
+   }
+   tl->count++; //hold the slot while the pipes are made
+   pthread_mutex_unlock(&tl->mutex);
+   
+   Tunnel *t = calloc(1, sizeof(Tunnel)); //zeroed, so each tunnel pointer says whether its pipe got made
+   if (t == NULL || dir_init(t, &t->up, client, server) < 0 || dir_init(t, &t->down, server, client) < 0 ||
+       (early_len > 0 && write(t->up.pipe[1], early, early_len) != (ssize_t) early_len)) {
+      //early goes into the empty pipe whole or the tunnel is given up, nothing else would write the rest
+      if (t != NULL && t->up.tunnel == t) {
+         close(t->up.pipe[0]);
+         close(t->up.pipe[1]);
+      }
+      if (t != NULL && t->down.tunnel == t) {
+         close(t->down.pipe[0]);
+         close(t->down.pipe[1]);
+      }
+      free(t);
+      pthread_mutex_lock(&tl->mutex);
+      tl->count--;
+      pthread_mutex_unlock(&tl->mutex);
+      return -1;
+   }
+   t->up.pending = early_len;
+   t->client = client;
+   t->server = server;
+   t->opened = t->last_active = time(NULL);
+   t->closed = 0;
+   snprintf(t->target, sizeof(t->target), "%s", target);
+   fcntl(client, F_SETFL, fcntl(client, F_GETFL) | O_NONBLOCK);
+   fcntl(server, F_SETFL, fcntl(server, F_GETFL) | O_NONBLOCK);
+   
+   pthread_mutex_lock(&tl->mutex);
+   t->next = tl->added;
+   tl->added = t;
+   pthread_mutex_unlock(&tl->mutex);
+   uint64_t one = 1;
+   write(tl->wakefd, &one, sizeof(one)); //wakes the tunnel thread, can't fail short of 2^64 unread pokes
+   return 0;
+}
+
+/* Puts every tunnel the workers handed over since last time on the open list and in epoll */
+static void tunnel_start(TunnelLoop *tl) {
+   uint64_t pokes;
+   
+   read(tl->wakefd, &pokes, sizeof(pokes)); //just clears it, the list says what's new
+   pthread_mutex_lock(&tl->mutex);
+   Tunnel *t = tl->added;
+   tl->added = NULL;
+   pthread_mutex_unlock(&tl->mutex);
+   while (t != NULL) {
+      Tunnel *next = t->next;
+      t->prev = NULL;
+      t->next = tl->first;
+      if (tl->first != NULL) {
+         tl->first->prev = t;
+      }
+      tl->first = t;
+      dir_watch(tl, &t->up, EPOLL_CTL_ADD);
+      dir_watch(tl, &t->down, EPOLL_CTL_ADD);
+      t = next;
+   }
+}
+
+/* Writes out what is sitting in d's pipe, as far as d->to takes it. -1 on error. */
+static int dir_flush(TunnelDir *d) {
+   while (d->pending > 0) {
+      ssize_t n = splice(d->pipe[0], NULL, d->to, NULL, d->pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if (n < 0) {
+         return errno == EAGAIN || errno == EINTR ? 0 : -1;
+      }
+      d->pending -= n;
+      d->bytes += n;
+   }
+   return 0;
+}
+
+/*
+ * dir_pump - move what d can without blocking: finish the last pipeful,
+ * then keep taking pipefuls from the source while the other side keeps up,
+ * up to TUNNEL_ROUNDS so one busy tunnel can't hold up the rest. Passes EOF
+ * on once the pipe is empty. Returns -1 if either socket failed.
+ */
+static int dir_pump(TunnelDir *d) {
+   if (dir_flush(d) < 0) {
+      return -1;
+   }
+   for (int round = 0; round < TUNNEL_ROUNDS && d->pending == 0 && !d->eof; round++) {
+      ssize_t n = splice(d->from, NULL, d->pipe[1], NULL, TUNNEL_PIPE_SIZE, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if (n == 0) {
+         d->eof = 1;
+      }
+      else if (n > 0) {
+         d->pending = n;
+         if (dir_flush(d) < 0) {
+            return -1;
+         }
+      }
+      else if (errno == EAGAIN || errno == EINTR) {
+         break;
+      }
+      else {
+         return -1;
+      }
+   }
+   if (d->eof && d->pending == 0 && !d->shut) {
+      shutdown(d->to, SHUT_WR);
+      d->shut = 1;
+   }
+   return 0;
+}
+
+/* Takes t out of the loop and closes everything it had open. t itself goes
+ on *dead, to be freed once no event from this round can still point at it. */
+static void tunnel_close(TunnelLoop *tl, Tunnel *t, char *why, Tunnel **dead) {
+   if (t->prev != NULL) {
+      t->prev->next = t->next;
+   }
+   else {
+      tl->first = t->next;
+   }
+   if (t->next != NULL) {
+      t->next->prev = t->prev;
+   }
+   pthread_mutex_lock(&tl->mutex);
+   tl->count--;
+   tl->bytes_up += t->up.bytes;
+   tl->bytes_down += t->down.bytes;
+   pthread_mutex_unlock(&tl->mutex);
+   
+   epoll_ctl(tl->epfd, EPOLL_CTL_DEL, t->client, NULL);
+   epoll_ctl(tl->epfd, EPOLL_CTL_DEL, t->server, NULL);
+   close(t->client);
+   close(t->server);
+   close(t->up.pipe[0]);
+   close(t->up.pipe[1]);
+   close(t->down.pipe[0]);
+   close(t->down.pipe[1]);
+   t->closed = 1;
+   if (tl->closed != NULL) {
+      tl->closed(t, why, tl->arg);
+   }
+   t->next = *dead;
+   *dead = t;
+}
+
+/*
+ * tunnel_run - the tunnel thread. An event on a socket pumps the direction
+ * reading from it (input) or the one writing to it (output), and once a
+ * second tunnels idle for longer than the timeout are closed.
+ */
+void tunnel_run(TunnelLoop *tl) {
+   struct epoll_event events[TUNNEL_EVENTS];
+   time_t swept = time(NULL);
+   
+   while (1) {
+      int n = epoll_wait(tl->epfd, events, TUNNEL_EVENTS, 1000);
+      time_t now = time(NULL);
+      Tunnel *dead = NULL;
+   
+      for (int i = 0; i < n; i++) {
+         TunnelDir *d = events[i].data.ptr;
+         if (d == NULL) { //a worker handed over new tunnels
+            tunnel_start(tl);
+            continue;
+         }
+         TunnelDir *rev = dir_reverse(d);
+         Tunnel *t = d->tunnel;
+         if (t->closed) { //closed earlier in this round
+            continue;
+         }
+         t->last_active = now;
+         int rc = 0;
+         if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+            rc = dir_pump(d);
+         }
+         if (rc == 0 && events[i].events & (EPOLLOUT | EPOLLERR)) {
+            rc = dir_pump(rev);
+         }
+         if (rc < 0 || events[i].events & EPOLLERR) {
+            tunnel_close(tl, t, "reset", &dead);
+         }
+         else if (t->up.shut && t->down.shut) {
+            tunnel_close(tl, t, "done", &dead);
+         }
+         else if (events[i].events & EPOLLHUP && d->eof) { //hung up both ways, nothing more can get to it
+            tunnel_close(tl, t, "hangup", &dead);
+         }
+         else {
+            dir_watch(tl, d, EPOLL_CTL_MOD);
+            dir_watch(tl, rev, EPOLL_CTL_MOD);
+         }
+      }
+   
+      if (now != swept && tl->idle > 0) {
+         swept = now;
+         Tunnel *t = tl->first, *next;
+         while (t != NULL) {
+            next = t->next;
+            if (now - t->last_active >= tl->idle) {
+               tunnel_close(tl, t, "idle", &dead);
+            }
+            t = next;
+         }
+      }
+   
+      while (dead != NULL) {
+         Tunnel *t = dead;
+         dead = t->next;
+         free(t);
+      }
+   }
+}
@@ -0,0 +1,64 @@
+/*
+ * tunnel.h - CONNECT tunnels, relayed by one thread with epoll and splice
+ */
+#ifndef __TUNNEL_H__
+#define __TUNNEL_H__
+
+#include <stddef.h>
+#include <time.h>
+#include <pthread.h>
+
+#define TUNNEL_MAX 512 //open tunnels before CONNECT gets turned away
+#define TUNNEL_IDLE_TIMEOUT 300 //seconds a tunnel may go without moving a byte
+#define TUNNEL_PIPE_SIZE 65536 //bytes a direction may have in flight between its two sockets
+#define TUNNEL_TARGET_LEN 300 //room for host:port
+
+typedef struct Tunnel Tunnel;
+
+/* One direction of a tunnel, bytes go from one socket through a pipe to the other */
+typedef struct {
+   Tunnel *tunnel; //tunnel this is half of
+   int from; //socket read from
+   int to; //socket written to
+   int pipe[2]; //splice goes socket to pipe to socket, so the bytes never come up to user space
+   size_t pending; //bytes sitting in the pipe not written to yet
+   size_t bytes; //bytes delivered to so far
+   int eof; //from said it is done sending
+   int shut; //eof has been passed on to with a shutdown
+   unsigned events; //what epoll is watching from for
+} TunnelDir;
+
+struct Tunnel {
+   int client; //socket to the client that sent CONNECT
+   int server; //socket to the host it asked for
+   TunnelDir up; //client to server
+   TunnelDir down; //server to client
+   time_t opened; //when the tunnel was handed over
+   time_t last_active; //last time a byte moved either way
+   int closed; //already closed, an event still queued for it is ignored
+   char target[TUNNEL_TARGET_LEN]; //host:port from the CONNECT line
+   Tunnel *prev; //previous open tunnel
+   Tunnel *next; //next open tunnel, or next one waiting to be started or freed
+};
+
+typedef void tunnel_fn(Tunnel *t, char *why, void *arg);
+
+typedef struct {
+   int epfd; //every tunnel socket is in this epoll set
+   int wakefd; //eventfd a worker pokes after handing over a tunnel
+   int idle; //seconds before an idle tunnel is closed
+   int count; //open tunnels
+   Tunnel *first; //open tunnels, newest first, only the tunnel thread touches it
+   Tunnel *added; //tunnels handed over but not yet in epoll
+   size_t bytes_up; //bytes relayed client to server by tunnels already closed
+   size_t bytes_down; //bytes relayed server to client by tunnels already closed
+   tunnel_fn *closed; //called with every tunnel as it closes, for accounting
+   void *arg; //passed to closed
+   pthread_mutex_t mutex; //protects added and the counts
+} TunnelLoop;
+
+int tunnel_init(TunnelLoop *tl, int idle, tunnel_fn *closed, void *arg); //-1 if epoll isn't there
+int tunnel_add(TunnelLoop *tl, int client, int server, char *target, char *early, size_t early_len); //-1 if full
+void tunnel_run(TunnelLoop *tl); //relays forever, run it in its own thread
+
+#endif /* __TUNNEL_H__ */
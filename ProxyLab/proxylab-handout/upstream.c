@@ -0,0 +1,164 @@
+/*
+ * upstream.c - deadlines for talking to origin servers, and what hedging needs
+ *
+ * open_clientfd and the Rio readers wait as long as the server likes, so a
+ * server that accepts and then says nothing (nop-server.py) holds a worker
+ * forever. The proxy instead connects with a deadline, waits for the first
+ * byte of the answer with a deadline, and reads the rest with a socket
+ * receive timeout so a server that stalls halfway is given up on too.
+ *
+ * Hedging waits for the first byte only as long as most requests take (the
+ * 95th percentile of recent ones), then asks again on a second connection
+ * and takes whichever answers first.
+ */
+#include <poll.h>
+#include "upstream.h"
+
+/* Milliseconds left until deadline, never below 0 */
+static long remaining(struct timespec *deadline) {
+   struct timespec now;
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   long ms = (deadline->tv_sec - now.tv_sec) * 1000L + (deadline->tv_nsec - now.tv_nsec) / 1000000;
+   return ms < 0 ? 0 : ms;
+}
+
+/*
+ * upstream_connect - open_clientfd with a deadline. Each address getaddrinfo
+ * gives is tried in turn with a non-blocking connect until one works or
+ * timeout_ms is up for all of them together. The socket comes back blocking.
+ * Name lookup itself isn't covered by the deadline.
+ */
+int upstream_connect(char *hostname, char *port, long timeout_ms) {
+   struct addrinfo hints, *listp, *p;
+   struct timespec deadline;
+   int clientfd = UPSTREAM_DOWN, timed_out = 0;
+   
+   clock_gettime(CLOCK_MONOTONIC, &deadline);
+   deadline.tv_sec += timeout_ms / 1000;
+   deadline.tv_nsec += (timeout_ms % 1000) * 1000000;
+   if (deadline.tv_nsec >= 1000000000) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
+   }
+   
+   memset(&hints, 0, sizeof(struct addrinfo));
+   hints.ai_socktype = SOCK_STREAM;  /* Open a connection */
+   hints.ai_flags = AI_NUMERICSERV;  /* ... using a numeric port arg. */
+   hints.ai_flags |= AI_ADDRCONFIG;  /* Recommended for connections */
+   if (getaddrinfo(hostname, port, &hints, &listp) != 0) {
+      return UPSTREAM_DOWN;
+   }
+   
+   for (p = listp; p != NULL && clientfd < 0; p = p->ai_next) {
+      int fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+      if (fd < 0) {
+         continue;
+      }
+      int flags = fcntl(fd, F_GETFL);
+      fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+      int rc = connect(fd, p->ai_addr, p->ai_addrlen);
+      if (rc < 0 && errno == EINPROGRESS) { //the usual case, wait for it to finish
+         struct pollfd pfd = {fd, POLLOUT, 0};
+         int err = 0;
+         socklen_t len = sizeof(err);
+         while ((rc = poll(&pfd, 1, remaining(&deadline))) < 0 && errno == EINTR) {
+         }
+         if (rc == 0) {
+            timed_out = 1;
+            rc = -1;
+         }
+         else if (rc > 0 && getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0 && err == 0) {
+            rc = 0;
+         }
+         else {
+            rc = -1;
+         }
+      }
+      if (rc == 0) {
+         fcntl(fd, F_SETFL, flags);
+         clientfd = fd;
+      }
+      else {
+         close(fd);
+         if (timed_out) { //every address shares the one deadline
+            break;
+         }
+      }
+   }
+   freeaddrinfo(listp);
+   if (clientfd < 0 && timed_out) {
+      return UPSTREAM_TIMEOUT;
+   }
+   return clientfd;
+}
+
+/*
+ * upstream_wait - wait up to timeout_ms for any of the n sockets in fds to
+ * have something to read (or to have hung up, which a read will report).
+ * Returns the index of the first one that does.
+ */
+int upstream_wait(int *fds, int n, long timeout_ms) {
+   struct pollfd pfds[n];
+   int rc;
+   
+   for (int i = 0; i < n; i++) {
+      pfds[i].fd = fds[i];
+      pfds[i].events = POLLIN;
+      pfds[i].revents = 0;
+   }
+   while ((rc = poll(pfds, n, timeout_ms < 0 ? 0 : timeout_ms)) < 0 && errno == EINTR) {
+   }
+   if (rc < 0) {
+      return UPSTREAM_DOWN;
+   }
+   for (int i = 0; i < n; i++) {
+      if (pfds[i].revents != 0) {
+         return i;
+      }
+   }
+   return UPSTREAM_TIMEOUT;
+}
+
+/* Blocking reads on fd give up with EAGAIN after timeout_ms with no data */
+void upstream_idle(int fd, long timeout_ms) {
+   struct timeval tv;
+   tv.tv_sec = timeout_ms / 1000;
+   tv.tv_usec = (timeout_ms % 1000) * 1000;
+   setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+}
+
+void latency_init(LatencyLog *log) {
+   log->next = log->count = 0;
+   pthread_mutex_init(&log->mutex, NULL);
+}
+
+void latency_add(LatencyLog *log, long ms) {
+   pthread_mutex_lock(&log->mutex);
+   log->samples[log->next] = ms;
+   log->next = (log->next + 1) % LATENCY_SAMPLES;
+   if (log->count < LATENCY_SAMPLES) {
+      log->count++;
+   }
+   pthread_mutex_unlock(&log->mutex);
+}
+
+static int compare_long(const void *a, const void *b) {
+   long x = *(const long *) a, y = *(const long *) b;
+   return x < y ? -1 : x > y;
+}
+
+/* 95th percentile of the samples held, by sorting a copy, there are few enough */
+long latency_p95(LatencyLog *log) {
+   long sorted[LATENCY_SAMPLES];
+   int n;
+   
+   pthread_mutex_lock(&log->mutex);
+   n = log->count;
+   memcpy(sorted, log->samples, n * sizeof(long));
+   pthread_mutex_unlock(&log->mutex);
+   if (n < LATENCY_MIN_SAMPLES) {
+      return -1;
+   }
+   qsort(sorted, n, sizeof(long), compare_long);
+   return sorted[(n * 95) / 100];
+}
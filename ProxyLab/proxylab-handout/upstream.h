@@ -0,0 +1,31 @@
+/*
+ * upstream.h - deadlines for talking to origin servers, and what hedging needs
+ */
+#ifndef __UPSTREAM_H__
+#define __UPSTREAM_H__
+
+#include "csapp.h"
+
+#define UPSTREAM_DOWN -1 //refused, unresolvable, or hung up
+#define UPSTREAM_TIMEOUT -2 //didn't answer in time
+
+#define LATENCY_SAMPLES 256 //first byte times kept for the hedge delay
+#define LATENCY_MIN_SAMPLES 20 //fewer than this and there's no p95 to speak of
+
+/* Recent request-to-first-byte times, the hedge delay is their 95th percentile */
+typedef struct {
+   long samples[LATENCY_SAMPLES]; //ms, a ring
+   int next; //slot the next sample goes in
+   int count; //samples held, up to LATENCY_SAMPLES
+   pthread_mutex_t mutex; //workers all add to the same log
+} LatencyLog;
+
+int upstream_connect(char *hostname, char *port, long timeout_ms); //socket, or UPSTREAM_DOWN/UPSTREAM_TIMEOUT
+int upstream_wait(int *fds, int n, long timeout_ms); //index of the first to be readable, or UPSTREAM_DOWN/UPSTREAM_TIMEOUT
+void upstream_idle(int fd, long timeout_ms); //reads on fd fail with EAGAIN after timeout_ms of silence
+
+void latency_init(LatencyLog *log);
+void latency_add(LatencyLog *log, long ms);
+long latency_p95(LatencyLog *log); //-1 until there are LATENCY_MIN_SAMPLES
+
+#endif /* __UPSTREAM_H__ */